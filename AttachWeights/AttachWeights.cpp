@@ -10,13 +10,18 @@
 #include "../Pinocchio/debugging.h"
 #include "../Pinocchio/attachment.h"
 #include "../Pinocchio/pinocchioApi.h"
+#include "../Pinocchio/lsqSolver.h"
+#include "../Pinocchio/voxelheat.h"
+#include "../Pinocchio/proxy.h"
 
 struct ArgData
 {
     ArgData() :
-        stopAtMesh(false), stopAfterCircles(false), skelScale(1.), noFit(true),
+        stopAtMesh(false), stopAfterCircles(false), skelScale(1.), noFit(true), autoSkeleton(false),
         skeleton(HumanSkeleton()), stiffness(1.),
-        skelOutName("skeleton.out"), weightOutName("attachment.out")
+        skelOutName("skeleton.out"), weightOutName("attachment.out"), benchSolvers(false), localHeat(0.),
+        voxelHeat(0), compareVoxelHeat(false), symmetric(false),
+        proxyVertices(0), proxyError(defaultProxyError), garmentSmoothing(0)
     {
     }
 
@@ -26,21 +31,38 @@ struct ArgData
     Quaternion<> meshTransform;
     double skelScale;
     bool noFit;
+    bool autoSkeleton; //try all built-in skeletons and use the best fitting one
     Skeleton skeleton;
     string skeletonname;
     double stiffness;
     string skelOutName;
     string weightOutName;
+    string weightBinName; //binary Attachment file, not written if empty
+    string solverName; //solver backend for the heat equation, chosen by size if empty
+    bool benchSolvers; //time the heat equation with every solver backend
+    double localHeat; //tolerance of bone-local heat solves, global solve if 0
+    int voxelHeat; //resolution of the voxel heat weights, mesh Laplacian weights if 0
+    bool compareVoxelHeat; //compare the voxel and the mesh Laplacian weights
+    bool symmetric; //rig half of a mirror symmetric mesh and mirror the results
+    int proxyVertices; //rig a decimated proxy this size and transfer the weights, full mesh if 0
+    double proxyError; //largest decimation error of the proxy
+    vector<string> garmentNames; //meshes over this one that get its weights transferred
+    int garmentSmoothing; //smoothing steps of the transferred weights
 };
 
 
 void printUsageAndExit()
 {
     cout << "Usage: attachWeights filename.{obj | ply | off | gts | stl}" << endl;
-    cout << "              [-skel skelname] [-rot x y z deg]* [-scale s]" << endl;
+    cout << "              [-skel skelname | -skel auto] [-rot x y z deg]* [-scale s]" << endl;
     cout << "              [-meshonly | -mo] [-circlesonly | -co]" << endl;
     cout << "              [-fit] [-stiffness s]" << endl;
     cout << "              [-skelOut skelOutFile] [-weightOut weightOutFile]" << endl;
+    cout << "              [-weightBin attachmentFile]" << endl;
+    cout << "              [-solver backend] [-benchSolvers] [-localHeat tolerance]" << endl;
+    cout << "              [-voxelHeat resolution] [-compareVoxelHeat] [-symmetric]" << endl;
+    cout << "              [-proxy vertices] [-proxyError error]" << endl;
+    cout << "              [-garment garmentFile]* [-garmentSmooth steps]" << endl;
 
     exit(0);
 }
@@ -73,6 +95,10 @@ ArgData processArgs(const vector<string> &args)
                 out.skeleton = QuadSkeleton();
             else if(curStr == string("centaur"))
                 out.skeleton = CentaurSkeleton();
+            else if(curStr == string("auto")) {
+                out.autoSkeleton = true;
+                out.noFit = false; //choosing a skeleton requires fitting
+            }
             else
                 out.skeleton = FileSkeleton(curStr);
             out.skeletonname = curStr;
@@ -138,13 +164,111 @@ ArgData processArgs(const vector<string> &args)
             out.weightOutName = curStr;
             continue;
         }
+        if(curStr == string("-weightBin")) {
+            if(cur == num) {
+                cout << "No binary weight output specified; ignoring." << endl;
+                continue;
+            }
+            curStr = args[cur++];
+            out.weightBinName = curStr;
+            continue;
+        }
+        if(curStr == string("-solver")) {
+            if(cur == num) {
+                cout << "No solver specified; ignoring." << endl;
+                continue;
+            }
+            out.solverName = args[cur++];
+            continue;
+        }
+        if(curStr == string("-localHeat")) {
+            if(cur == num) {
+                cout << "No local heat tolerance specified; ignoring." << endl;
+                continue;
+            }
+            sscanf(args[cur++].c_str(), "%lf", &out.localHeat);
+            continue;
+        }
+        if(curStr == string("-voxelHeat")) {
+            if(cur == num) {
+                cout << "No voxel resolution specified; ignoring." << endl;
+                continue;
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.voxelHeat);
+            continue;
+        }
+        if(curStr == string("-proxy")) {
+            if(cur == num) {
+                cout << "No proxy size specified; ignoring." << endl;
+                continue;
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.proxyVertices);
+            continue;
+        }
+        if(curStr == string("-proxyError")) {
+            if(cur == num) {
+                cout << "No proxy error specified; ignoring." << endl;
+                continue;
+            }
+            sscanf(args[cur++].c_str(), "%lf", &out.proxyError);
+            continue;
+        }
+        if(curStr == string("-garment")) {
+            if(cur == num) {
+                cout << "No garment file specified; ignoring." << endl;
+                continue;
+            }
+            out.garmentNames.push_back(args[cur++]);
+            continue;
+        }
+        if(curStr == string("-garmentSmooth")) {
+            if(cur == num) {
+                cout << "No smoothing steps specified; ignoring." << endl;
+                continue;
+            }
+            sscanf(args[cur++].c_str(), "%d", &out.garmentSmoothing);
+            continue;
+        }
+        if(curStr == string("-symmetric")) {
+            out.symmetric = true;
+            continue;
+        }
+        if(curStr == string("-compareVoxelHeat")) {
+            out.compareVoxelHeat = true;
+            continue;
+        }
+        if(curStr == string("-benchSolvers")) {
+            out.benchSolvers = true;
+            continue;
+        }
         cout << "Unrecognized option: " << curStr << endl;
         printUsageAndExit();
     }
 
+    if(out.voxelHeat > 0 && out.autoSkeleton) {
+        cout << "-voxelHeat needs a skeleton; it does not work with -skel auto" << endl;
+        exit(0);
+    }
+    if(out.voxelHeat > 0 && (out.proxyVertices > 0 || out.symmetric))
+        cout << "-voxelHeat rigs the whole mesh; ignoring -proxy and -symmetric." << endl;
+
     return out;
 }
 
+//one line of weights per vertex
+void writeWeights(const Attachment &attachment, int numVertices, const string &filename)
+{
+    std::ofstream astrm(filename.c_str());
+    for(int i = 0; i < numVertices; ++i) {
+        Vector<double, -1> v = attachment.getWeights(i);
+        for(int j = 0; j < v.size(); ++j) {
+            double d = floor(0.5 + v[j] * 10000.) / 10000.;
+            astrm << d << " ";
+        }
+        astrm << endl;
+    }
+}
+
 void process(const vector<string> &args)
 {
     int i;
@@ -152,6 +276,17 @@ void process(const vector<string> &args)
 
     Debugging::setOutStream(cout);
 
+    if(!a.solverName.empty() && !setDefaultSolverBackend(a.solverName)) {
+        cout << "Unknown solver " << a.solverName << "; available:";
+        vector<string> names = solverBackendNames();
+        for(i = 0; i < (int)names.size(); ++i)
+            cout << " " << names[i];
+        cout << endl;
+        exit(0);
+    }
+    setLocalHeatTolerance(a.localHeat);
+    setUseMirrorSymmetry(a.symmetric);
+
     Mesh m(a.filename);
     if(m.vertices.size() == 0) {
         cout << "Error reading file.  Aborting." << endl;
@@ -172,18 +307,71 @@ void process(const vector<string> &args)
     }
 
     PinocchioOutput o;
-    if(!a.noFit) { //do everything
+    if(a.voxelHeat > 0 && !a.noFit) { //do everything, with voxel heat weights
+        o = autorigVoxelHeat(given, m, a.voxelHeat, a.stiffness);
+    }
+    else if(a.voxelHeat > 0) { //no fitting, voxel heat weights
+        TreeType *distanceField = constructDistanceField(m);
+
+        o.embedding = a.skeleton.fGraph().verts;
+        for(i = 0; i < (int)o.embedding.size(); ++i)
+            o.embedding[i] = m.toAdd + o.embedding[i] * m.scale;
+
+        o.attachment = voxelHeatAttachment(m, a.skeleton, o.embedding, distanceField, a.voxelHeat, a.stiffness);
+
+        delete distanceField;
+    }
+    else if(a.autoSkeleton) { //do everything for every skeleton, keep the best fit
+        vector<Skeleton> candidates;
+        candidates.push_back(HumanSkeleton());
+        candidates.push_back(QuadSkeleton());
+        candidates.push_back(HorseSkeleton());
+        candidates.push_back(CentaurSkeleton());
+        for(i = 0; i < (int)candidates.size(); ++i)
+            candidates[i].scale(a.skelScale * 0.7);
+
+        int chosen;
+        o = autorig(candidates, m, &chosen);
+        if(chosen >= 0) {
+            a.skeleton = candidates[chosen];
+            cout << "Using skeleton " << chosen << endl;
+        }
+    }
+    else if(!a.noFit && a.proxyVertices > 0) { //do everything on a decimated proxy
+        o = autorigProxy(given, m, a.proxyVertices, a.proxyError);
+    }
+    else if(!a.noFit) { //do everything
         o = autorig(given, m);
     }
+    else if(a.proxyVertices > 0 && (int)m.vertices.size() > a.proxyVertices) { //no fitting, weights on a proxy
+        Mesh proxy = decimateMesh(m, a.proxyVertices, a.proxyError);
+        TreeType *distanceField = constructDistanceField(proxy);
+        VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
+
+        o.embedding = a.skeleton.fGraph().verts;
+        for(i = 0; i < (int)o.embedding.size(); ++i)
+            o.embedding[i] = m.toAdd + o.embedding[i] * m.scale;
+
+        Attachment proxyAttachment(proxy, a.skeleton, o.embedding, tester, a.stiffness);
+        vector<Pinocchio::Vector3> points(m.vertices.size());
+        for(i = 0; i < (int)points.size(); ++i)
+            points[i] = m.vertices[i].pos;
+        o.attachment = transferAttachment(proxy, proxyAttachment, points);
+
+        delete tester;
+        delete distanceField;
+    }
     else { //skip the fitting step--assume the skeleton is already correct for the mesh
-        TreeType *distanceField = constructDistanceField(m);
+        vector<int> mirror;
+        bool symmetric = a.symmetric && detectMirrorSymmetry(m, &mirror);
+        TreeType *distanceField = constructDistanceField(m, defaultTreeTol, symmetric);
         VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
 
         o.embedding = a.skeleton.fGraph().verts;
         for(i = 0; i < (int)o.embedding.size(); ++i)
             o.embedding[i] = m.toAdd + o.embedding[i] * m.scale;
 
-		o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, a.stiffness);
+		o.attachment = new Attachment(m, a.skeleton, o.embedding, tester, a.stiffness, NULL, symmetric ? &mirror : NULL);
 
         delete tester;
         delete distanceField;
@@ -194,6 +382,32 @@ void process(const vector<string> &args)
         exit(0);
     }
 
+    if(a.compareVoxelHeat) {
+        TreeType *distanceField = constructDistanceField(m);
+        VoxelHeatComparison c = compareVoxelHeat(m, a.skeleton, o.embedding, distanceField,
+                                                 a.voxelHeat > 0 ? a.voxelHeat : defaultVoxelHeatResolution, a.stiffness);
+        cout << "mesh " << c.meshTime << "s voxel " << c.voxelTime << "s (" << c.voxels << " voxels, " <<
+                c.iterations << " iterations)" << endl;
+        cout << "weight difference max " << c.maxDifference << " mean " << c.meanDifference <<
+                ", same dominant bone " << c.sameDominantBone << endl;
+        delete distanceField;
+    }
+
+    if(a.benchSolvers) { //same heat equation through every solver
+        TreeType *distanceField = constructDistanceField(m);
+        VisTester<TreeType> tester(distanceField);
+        vector<SolverBenchmark> results = benchmarkHeatSolvers(m, a.skeleton, o.embedding, &tester, a.stiffness);
+        for(i = 0; i < (int)results.size(); ++i) {
+            cout << results[i].backend << ": ";
+            if(results[i].ok)
+                cout << "factor " << results[i].factorTime << "s solve " << results[i].solveTime <<
+                        "s residual " << results[i].residual << endl;
+            else
+                cout << "failed" << endl;
+        }
+        delete distanceField;
+    }
+
     //output skeleton embedding
     for(i = 0; i < (int)o.embedding.size(); ++i)
         o.embedding[i] = (o.embedding[i] - m.toAdd) / m.scale;
@@ -204,16 +418,29 @@ void process(const vector<string> &args)
     }
 
     //output attachment
-    std::ofstream astrm(a.weightOutName.c_str());
-    for(i = 0; i < (int)m.vertices.size(); ++i) {
-        Vector<double, -1> v = o.attachment->getWeights(i);
-        for(int j = 0; j < v.size(); ++j) {
-            double d = floor(0.5 + v[j] * 10000.) / 10000.;
-            astrm << d << " ";
+    writeWeights(*o.attachment, m.vertices.size(), a.weightOutName);
+
+    //garments get their weights from the mesh and are written next to their files
+    if(a.garmentNames.size() > 0) {
+        vector<Mesh> garments;
+        for(i = 0; i < (int)a.garmentNames.size(); ++i) {
+            garments.push_back(Mesh(a.garmentNames[i]));
+            for(int j = 0; j < (int)garments[i].vertices.size(); ++j)
+                garments[i].vertices[j].pos = m.toAdd + (a.meshTransform * garments[i].vertices[j].pos) * m.scale;
+        }
+        vector<Attachment *> garmentAttachments = transferAttachments(m, *o.attachment, garments, a.garmentSmoothing);
+        for(i = 0; i < (int)garments.size(); ++i) {
+            if(garmentAttachments[i] == NULL)
+                continue;
+            string name = a.garmentNames[i];
+            writeWeights(*garmentAttachments[i], garments[i].vertices.size(), name.substr(0, name.rfind('.')) + ".weights.out");
+            delete garmentAttachments[i];
         }
-        astrm << endl;
     }
 
+    if(!a.weightBinName.empty())
+        o.attachment->save(a.weightBinName);
+
     delete o.attachment;
 }
 
@@ -18,9 +18,15 @@
 
 #include <fstream>
 #include <sstream>
+#include <cstring>
+#include <climits>
+#include <queue>
 #include "attachment.h"
 #include "vecutils.h"
 #include "lsqSolver.h"
+#include "meshoperators.h"
+#include "debugging.h"
+#include "parallel.h"
 
 class AttachmentPrivate
 {
@@ -28,7 +34,11 @@ public:
     AttachmentPrivate() {}
     virtual ~AttachmentPrivate() {}
     virtual Mesh deform(const Mesh &mesh, const vector<Transform<> > &transforms) const = 0;
+    virtual bool deform(const Mesh &mesh, const vector<Transform<> > &transforms,
+                        vector<Pinocchio::Vector3> &positions, vector<Pinocchio::Vector3> *normals) const = 0;
     virtual Vector<double, -1> getWeights(int i) const = 0;
+    virtual void compact(int maxInfluences) = 0;
+    virtual bool save(ostream &os) const = 0;
     virtual AttachmentPrivate *clone() const = 0;
 };
 
@@ -42,143 +52,764 @@ bool vectorInCone(const Pinocchio::Vector3 &v, const vector<Pinocchio::Vector3>
     return v.normalize() * avg.normalize() > 0.5;
 }
 
-class AttachmentPrivate1 : public AttachmentPrivate {
-public:
-    AttachmentPrivate1() {}
+SymbolicCache &heatSymbolicCache()
+{
+    static SymbolicCache cache;
+    return cache;
+}
 
-    AttachmentPrivate1(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match, const VisibilityTester *tester,
-		double initialHeatWeight)
-    {
-        int i, j;
-        int nv = mesh.vertices.size();
-        //compute edges
-        vector<vector<int> > edges(nv);
+//the mirror image of every bone (bone j ends at joint j + 1), itself for the bones on the plane
+static vector<int> mirrorBones(const Skeleton &skeleton)
+{
+    int bones = skeleton.fGraph().verts.size() - 1;
+    vector<int> out(bones);
+    for(int j = 0; j < bones; ++j)
+        out[j] = j;
+    for(int j = 0; j < bones; ++j) {
+        int sym = skeleton.fSym()[j + 1];
+        if(sym > 0) {
+            out[j] = sym - 1;
+            out[sym - 1] = j;
+        }
+    }
+    return out;
+}
+
+//sets up the heat equation for the bone weights: A is the lower triangle of the system matrix
+//(the same for every bone) and rhs[j] is the right hand side of bone j.  With a mirror map of the mesh,
+//the bone distances and visibility are only computed for one vertex of every mirror pair.
+static void heatEquation(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                         const VisibilityTester *tester, double initialHeatWeight,
+                         vector<vector<pair<int, double> > > &A, vector<vector<double> > &rhs,
+                         const vector<int> *mirror = NULL)
+{
+    int i, j;
+    int nv = mesh.vertices.size();
+    int bones = skeleton.fGraph().verts.size() - 1;
+    MeshAdjacency adj = computeAdjacency(mesh);
+
+    vector<vector<double> > boneDists(nv);
+    vector<vector<bool> > boneVis(nv);
+    vector<vector<pair<int, Pinocchio::Vector3> > > toTest(nv); //(bone, closest point) to test visibility of
+
+    parallelFor(0, nv, [&](int i) {
+        int j;
+        if(mirror && (*mirror)[i] < i)
+            return; //copied from the mirror vertex below
+        boneDists[i].resize(bones, -1);
+        boneVis[i].resize(bones);
+        Pinocchio::Vector3 cPos = mesh.vertices[i].pos;
+
+        vector<Pinocchio::Vector3> normals = ringNormals(mesh, adj, i);
+
+        double minDist = 1e37;
+        for(j = 1; j <= bones; ++j) {
+            const Pinocchio::Vector3 &v1 = match[j], &v2 = match[skeleton.fPrev()[j]];
+            boneDists[i][j - 1] = sqrt(distsqToSeg(cPos, v1, v2));
+            minDist = min(boneDists[i][j - 1], minDist);
+        }
+        for(j = 1; j <= bones; ++j) {
+            //the reason we don't just pick the closest bone is so that if two are
+            //equally close, both are factored in.
+            if(boneDists[i][j - 1] > minDist * 1.0001)
+                continue;
+
+            const Pinocchio::Vector3 &v1 = match[j], &v2 = match[skeleton.fPrev()[j]];
+            Pinocchio::Vector3 p = projToSeg(cPos, v1, v2);
+            if(vectorInCone(cPos - p, normals)) //cheap test first
+                toTest[i].push_back(make_pair(j - 1, p));
+        }
+    });
+
+    //test the visibility of all the candidate bones at once
+    vector<Pinocchio::Vector3> from, to;
+    for(i = 0; i < nv; ++i) {
+        for(j = 0; j < (int)toTest[i].size(); ++j) {
+            from.push_back(mesh.vertices[i].pos);
+            to.push_back(toTest[i][j].second);
+        }
+    }
+    vector<bool> visible;
+    tester->canSee(from, to, visible);
+    int query = 0;
+    for(i = 0; i < nv; ++i) {
+        for(j = 0; j < (int)toTest[i].size(); ++j)
+            boneVis[i][toTest[i][j].first] = visible[query++];
+    }
+    vector<vector<pair<int, Pinocchio::Vector3> > >().swap(toTest);
 
+    if(mirror) {
+        vector<int> symBone = mirrorBones(skeleton);
         for(i = 0; i < nv; ++i) {
-            int cur, start;
-            cur = start = mesh.vertices[i].edge;
-            do {
-                edges[i].push_back(mesh.edges[cur].vertex);
-                cur = mesh.edges[mesh.edges[cur].prev].twin;
-            } while(cur != start);
+            int m = (*mirror)[i];
+            if(m >= i)
+                continue;
+            boneDists[i].resize(bones);
+            boneVis[i].resize(bones);
+            for(j = 0; j < bones; ++j) {
+                boneDists[i][j] = boneDists[m][symBone[j]];
+                boneVis[i][j] = boneVis[m][symBone[j]];
+            }
         }
+    }
 
-        weights.resize(nv);
-        int bones = skeleton.fGraph().verts.size() - 1;
+    //We have -Lw+Hw=HI, same as (H-L)w=HI, with (H-L)=DA (with D=diag(1./area))
+    //so w = A^-1 (HI/D)
 
-        for(i = 0; i < nv; ++i) // initialize the weights vectors so they are big enough
-            weights[i][bones - 1] = 0.;
+    vector<double> D = computeVertexAreas(mesh, adj), H(nv, 0.), diagonal(nv);
+    vector<int> closest(nv, -1);
+    for(i = 0; i < nv; ++i) {
+        D[i] = 1. / (1e-10 + D[i]);
+
+        //get bones
+        double minDist = 1e37;
+        for(j = 0; j < bones; ++j) {
+          // Would like to change to:
+          //   if(boneDists[i][j] < minDist && boneVis[i][j])
+          // but need to make boneVis more robust - ie, check
+          // if the bone is initially outside the mesh, etc
+          if(boneDists[i][j] < minDist) {
+                closest[i] = j;
+                minDist = boneDists[i][j];
+            }
+        }
+        for(j = 0; j < bones; ++j)
+            if(boneVis[i][j] && boneDists[i][j] <= minDist * 1.00001)
+                H[i] += initialHeatWeight / SQR(1e-8 + boneDists[i][closest[i]]);
+
+        diagonal[i] = H[i] / D[i];
+    }
+
+    //get laplacian
+    A = computeCotLaplacian(mesh, adj, diagonal);
+
+    //seed every bone only at the vertices it heats
+    rhs.assign(bones, vector<double>(nv, 0.));
+    for(i = 0; i < nv; ++i) {
+        if(H[i] == 0.)
+            continue;
+        for(j = 0; j < bones; ++j) {
+            if(boneVis[i][j] && boneDists[i][j] <= boneDists[i][closest[i]] * 1.00001)
+                rhs[j][i] = H[i] / D[i];
+        }
+    }
+}
+
+//factors a heat equation matrix with the default backend or, if there is none, one chosen by size.
+//The pattern depends only on the mesh connectivity, so a symbolic factorization from an earlier
+//attachment of the same topology can be reused by the builtin solver--symbolic if given, otherwise
+//the one in the process-wide cache under key
+static LLTMatrix *factorHeat(const SPDMatrix &Am, unsigned long long key, SymbolicLLT *symbolic)
+{
+    string backendName = defaultSolverBackend();
+    if(backendName.empty())
+        backendName = Am.size() >= iterativeHeatSolveSize ? "iterative" : "builtin";
+    SymbolicCache &cache = heatSymbolicCache();
+    if(backendName == "builtin" && symbolic == NULL && cache.capacity() > 0)
+        return Am.factor(*cache.get(key, Am));
+    return getSolverBackend(backendName)->factor(Am, symbolic);
+}
+
+//solves the heat equation for all the bones together on the whole mesh (in place)
+static bool solveHeat(const Mesh &mesh, const vector<vector<pair<int, double> > > &A, vector<vector<double> > &rhs,
+                      SymbolicLLT *symbolic)
+{
+    LLTMatrix *Ainv = factorHeat(SPDMatrix(A), connectivityHash(mesh), symbolic);
+    if(Ainv == NULL)
+        return false;
+
+    Ainv->solveMany(rhs);
+    delete Ainv;
+    return true;
+}
 
-        vector<vector<double> > boneDists(nv);
-        vector<vector<bool> > boneVis(nv);
+//solves the heat equation of a mirror symmetric mesh on half of it (in place).  The mirror permutation
+//commutes with A, so for a bone b and its mirror image s, u = wb + ws is symmetric and d = wb - ws is
+//antisymmetric (zero on the plane).  u is solved for on one vertex of every mirror pair plus the vertices
+//on the plane (whose rows are halved to keep the system symmetric) and d on one vertex of every pair,
+//which is two systems of half the size instead of the whole one.
+static bool solveHeatMirrored(const Mesh &mesh, const vector<vector<pair<int, double> > > &A, vector<vector<double> > &rhs,
+                              const vector<int> &mirror, const vector<int> &symBone)
+{
+    int i, j, k;
+    int nv = A.size(), bones = rhs.size();
+
+    vector<int> half, evenIdx(nv, -1), oddIdx(nv, -1);
+    int odd = 0;
+    for(i = 0; i < nv; ++i) {
+        if(mirror[i] < i)
+            continue;
+        evenIdx[i] = half.size();
+        half.push_back(i);
+        if(mirror[i] != i)
+            oddIdx[i] = odd++;
+    }
+
+    //fold the columns of the other half onto their mirror images
+    vector<vector<pair<int, double> > > even(half.size()), oddM(odd);
+    auto add = [&](int r, int c, double v) {
+        if(evenIdx[r] < 0)
+            return;
+        int rep = evenIdx[c] >= 0 ? c : mirror[c];
+        if(evenIdx[rep] <= evenIdx[r])
+            even[evenIdx[r]].push_back(make_pair(evenIdx[rep], mirror[r] == r ? 0.5 * v : v));
+        if(oddIdx[r] >= 0 && oddIdx[rep] >= 0 && oddIdx[rep] <= oddIdx[r])
+            oddM[oddIdx[r]].push_back(make_pair(oddIdx[rep], rep == c ? v : -v));
+    };
+    for(i = 0; i < nv; ++i) {
+        for(k = 0; k < (int)A[i].size(); ++k) {
+            add(i, A[i][k].first, A[i][k].second);
+            if(A[i][k].first != i)
+                add(A[i][k].first, i, A[i][k].second);
+        }
+    }
+    for(int pass = 0; pass < 2; ++pass) {
+        vector<vector<pair<int, double> > > &rows = pass == 0 ? even : oddM;
+        for(i = 0; i < (int)rows.size(); ++i) { //sort and merge, which leaves the diagonal last
+            sort(rows[i].begin(), rows[i].end());
+            int out = 0;
+            for(k = 0; k < (int)rows[i].size(); ++k) {
+                if(out > 0 && rows[i][out - 1].first == rows[i][k].first)
+                    rows[i][out - 1].second += rows[i][k].second;
+                else
+                    rows[i][out++] = rows[i][k];
+            }
+            rows[i].resize(out);
+        }
+    }
 
+    //right hand sides: one symmetric one per bone pair (or bone on the plane), one antisymmetric per pair
+    vector<vector<double> > evenRhs, oddRhs;
+    vector<int> evenBone;
+    for(j = 0; j < bones; ++j) {
+        int sym = symBone[j];
+        if(sym < j)
+            continue;
+        vector<double> u(half.size()), d(odd);
+        for(k = 0; k < (int)half.size(); ++k) {
+            i = half[k];
+            u[k] = rhs[j][i] + (sym != j ? rhs[sym][i] : 0.);
+            if(mirror[i] == i)
+                u[k] *= 0.5;
+            if(oddIdx[i] >= 0)
+                d[oddIdx[i]] = rhs[j][i] - rhs[sym][i];
+        }
+        evenRhs.push_back(u);
+        evenBone.push_back(j);
+        if(sym != j)
+            oddRhs.push_back(d);
+    }
+
+    //cached apart from the whole mesh's symbolic factorization
+    unsigned long long key = connectivityHash(mesh);
+    LLTMatrix *evenInv = factorHeat(SPDMatrix(even), key + 1, NULL);
+    vector<vector<pair<int, double> > >().swap(even);
+    bool ok = evenInv != NULL && evenInv->solveMany(evenRhs);
+    delete evenInv;
+    if(ok && !oddRhs.empty()) {
+        LLTMatrix *oddInv = factorHeat(SPDMatrix(oddM), key + 2, NULL);
+        ok = oddInv != NULL && oddInv->solveMany(oddRhs);
+        delete oddInv;
+    }
+    if(!ok)
+        return false;
+
+    //wb = (u + d) / 2 and ws = (u - d) / 2 on the half, swapped on the other
+    int nextOdd = 0;
+    for(k = 0; k < (int)evenBone.size(); ++k) {
+        j = evenBone[k];
+        int sym = symBone[j];
+        const vector<double> &u = evenRhs[k];
+        const vector<double> *d = sym != j ? &oddRhs[nextOdd++] : NULL;
         for(i = 0; i < nv; ++i) {
-            boneDists[i].resize(bones, -1);
-            boneVis[i].resize(bones);
-            Pinocchio::Vector3 cPos = mesh.vertices[i].pos;
-
-            vector<Pinocchio::Vector3> normals;
-            for(j = 0; j < (int)edges[i].size(); ++j) {
-                int nj = (j + 1) % edges[i].size();
-                Pinocchio::Vector3 v1 = mesh.vertices[edges[i][j]].pos - cPos;
-                Pinocchio::Vector3 v2 = mesh.vertices[edges[i][nj]].pos - cPos;
-                normals.push_back((v1 % v2).normalize());
+            int rep = evenIdx[i] >= 0 ? i : mirror[i];
+            double uVal = u[evenIdx[rep]], dVal = (d && oddIdx[rep] >= 0) ? (*d)[oddIdx[rep]] : 0.;
+            if(sym == j)
+                rhs[j][i] = uVal;
+            else {
+                rhs[j][i] = 0.5 * (rep == i ? uVal + dVal : uVal - dVal);
+                rhs[sym][i] = 0.5 * (rep == i ? uVal - dVal : uVal + dVal);
             }
+        }
+    }
+    return true;
+}
+
+//solves the heat equation for every bone only where its weight is estimated to stay above tolerance,
+//with zero weight (a Dirichlet condition) outside.  Heat decays by about exp(-sqrt(a / w)) per edge
+//into a vertex that absorbs a (its row sum) and whose edges have weight w on average, so the region
+//is everything within a decay of -log(tolerance) of the vertices the bone heats.  The bones are
+//solved in parallel.
+static bool solveHeatLocally(const vector<vector<pair<int, double> > > &A, vector<vector<double> > &rhs, double tolerance)
+{
+    int i, j;
+    int nv = A.size(), bones = rhs.size();
+
+    //neighbors from the lower triangle, and the decay into every vertex
+    vector<int> start(nv + 1, 0), adj;
+    vector<double> rowSum(nv, 0.), edgeSum(nv, 0.);
+    for(i = 0; i < nv; ++i) for(j = 0; j < (int)A[i].size(); ++j) {
+        int col = A[i][j].first;
+        rowSum[i] += A[i][j].second;
+        if(col == i)
+            continue;
+        rowSum[col] += A[i][j].second;
+        edgeSum[i] -= A[i][j].second;
+        edgeSum[col] -= A[i][j].second;
+        ++start[i + 1];
+        ++start[col + 1];
+    }
+    for(i = 0; i < nv; ++i)
+        start[i + 1] += start[i];
+    adj.resize(start[nv]);
+    vector<int> fill(start.begin(), start.end() - 1);
+    for(i = 0; i < nv; ++i) for(j = 0; j < (int)A[i].size() - 1; ++j) {
+        adj[fill[i]++] = A[i][j].first;
+        adj[fill[A[i][j].first]++] = i;
+    }
+    vector<double> decay(nv);
+    for(i = 0; i < nv; ++i) {
+        double degree = max(1, start[i + 1] - start[i]);
+        decay[i] = sqrt(max(rowSum[i], 0.) / max(edgeSum[i] / degree, 1e-10));
+    }
 
-            double minDist = 1e37;
-            for(j = 1; j <= bones; ++j) {
-                const Pinocchio::Vector3 &v1 = match[j], &v2 = match[skeleton.fPrev()[j]];
-                boneDists[i][j - 1] = sqrt(distsqToSeg(cPos, v1, v2));
-                minDist = min(boneDists[i][j - 1], minDist);
+    double maxDecay = -log(tolerance);
+    string backendName = defaultSolverBackend();
+    const SolverBackend *backend = getSolverBackend(backendName.empty() ? string("builtin") : backendName);
+    vector<char> ok(bones, true);
+    parallelFor(0, bones, [&](int b) {
+        int i, k;
+        vector<double> &x = rhs[b];
+
+        //grow the region from the vertices the bone heats (Dijkstra)
+        vector<double> dist(nv, maxDecay + 1.);
+        priority_queue<pair<double, int>, vector<pair<double, int> >, greater<pair<double, int> > > todo;
+        for(i = 0; i < nv; ++i) {
+            if(x[i] != 0.) {
+                dist[i] = 0.;
+                todo.push(make_pair(0., i));
             }
-            for(j = 1; j <= bones; ++j) {
-                //the reason we don't just pick the closest bone is so that if two are
-                //equally close, both are factored in.
-                if(boneDists[i][j - 1] > minDist * 1.0001)
+        }
+        while(!todo.empty()) {
+            pair<double, int> cur = todo.top();
+            todo.pop();
+            if(cur.first > dist[cur.second])
+                continue; //already reached closer
+            for(k = start[cur.second]; k < start[cur.second + 1]; ++k) {
+                int next = adj[k];
+                double d = cur.first + decay[next];
+                if(d > maxDecay || d >= dist[next])
                     continue;
+                dist[next] = d;
+                todo.push(make_pair(d, next));
+            }
+        }
 
-                const Pinocchio::Vector3 &v1 = match[j], &v2 = match[skeleton.fPrev()[j]];
-                Pinocchio::Vector3 p = projToSeg(cPos, v1, v2);
-                boneVis[i][j - 1] = tester->canSee(cPos, p) && vectorInCone(cPos - p, normals);
+        //the equations of the region, without the columns of the (zero) vertices outside
+        vector<int> region, local(nv, -1);
+        for(i = 0; i < nv; ++i) {
+            if(dist[i] <= maxDecay) {
+                local[i] = region.size();
+                region.push_back(i);
             }
         }
+        if(region.empty())
+            return; //heats nothing, so the weight is zero everywhere
+        vector<vector<pair<int, double> > > sub(region.size());
+        vector<double> subRhs(region.size());
+        for(i = 0; i < (int)region.size(); ++i) {
+            const vector<pair<int, double> > &row = A[region[i]];
+            for(k = 0; k < (int)row.size(); ++k)
+                if(local[row[k].first] >= 0)
+                    sub[i].push_back(make_pair(local[row[k].first], row[k].second));
+            subRhs[i] = x[region[i]];
+        }
 
-        //We have -Lw+Hw=HI, same as (H-L)w=HI, with (H-L)=DA (with D=diag(1./area))
-        //so w = A^-1 (HI/D)
+        LLTMatrix *factored = backend->factor(SPDMatrix(sub));
+        if(factored == NULL || !factored->solve(subRhs))
+            ok[b] = false;
+        delete factored;
 
-        vector<vector<pair<int, double> > > A(nv);
-        vector<double> D(nv, 0.), H(nv, 0.);
-        vector<int> closest(nv, -1);
-        for(i = 0; i < nv; ++i) {
-            //get areas
-            for(j = 0; j < (int)edges[i].size(); ++j) {
-                int nj = (j + 1) % edges[i].size();
+        x.assign(nv, 0.);
+        for(i = 0; i < (int)region.size(); ++i)
+            x[region[i]] = subRhs[i];
+    });
+
+    for(j = 0; j < bones; ++j)
+        if(!ok[j])
+            return false;
+    return true;
+}
+
+static double localHeatToleranceSetting = 0.;
 
-                D[i] += ((mesh.vertices[edges[i][j]].pos - mesh.vertices[i].pos) %
-                         (mesh.vertices[edges[i][nj]].pos - mesh.vertices[i].pos)).length();
+void setLocalHeatTolerance(double tolerance) { localHeatToleranceSetting = tolerance; }
+double localHeatTolerance() { return localHeatToleranceSetting; }
+
+class AttachmentPrivate1 : public AttachmentPrivate {
+public:
+    AttachmentPrivate1() : bones(0), influences(0) {}
+
+    AttachmentPrivate1(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match, const VisibilityTester *tester,
+		double initialHeatWeight, SymbolicLLT *symbolic, const vector<int> *mirror) : influences(0)
+    {
+        int nv = mesh.vertices.size();
+        bones = skeleton.fGraph().verts.size() - 1;
+
+        vector<vector<pair<int, double> > > A;
+        vector<vector<double> > rhs;
+        heatEquation(mesh, skeleton, match, tester, initialHeatWeight, A, rhs, mirror);
+
+        double tolerance = localHeatTolerance();
+        bool ok;
+        if(mirror)
+            ok = solveHeatMirrored(mesh, A, rhs, *mirror, mirrorBones(skeleton));
+        else if(tolerance > 0.)
+            ok = solveHeatLocally(A, rhs, tolerance);
+        else
+            ok = solveHeat(mesh, A, rhs, symbolic);
+        if(!ok)
+            rhs.assign(bones, vector<double>(nv, 0.)); //failed: all weights zero
+
+        setWeights(rhs);
+    }
+
+    AttachmentPrivate1(const vector<vector<double> > &boneWeights) : bones(boneWeights.size()), influences(0)
+    {
+        setWeights(boneWeights);
+    }
+
+    Mesh deform(const Mesh &mesh, const vector<Transform<> > &transforms) const
+    {
+        Mesh out = mesh;
+        int i, nv = mesh.vertices.size();
+
+        vector<Pinocchio::Vector3> positions;
+        if(!deform(mesh, transforms, positions, NULL))
+            return out; //error
+        for(i = 0; i < nv; ++i)
+            out.vertices[i].pos = positions[i];
+
+        out.computeVertexNormals();
+
+        return out;
+    }
+
+    bool deform(const Mesh &mesh, const vector<Transform<> > &transforms,
+                vector<Pinocchio::Vector3> &positions, vector<Pinocchio::Vector3> *normals) const
+    {
+        int i, nv = mesh.vertices.size();
+        if(nv != numVertices() || (int)transforms.size() < bones) { //error
+            positions.clear();
+            if(normals)
+                normals->clear();
+            return false;
+        }
+
+        //3x4 matrix palette, row major: the rotation and scale columns followed by the translation
+        vector<double> palette(12 * transforms.size());
+        for(i = 0; i < (int)transforms.size(); ++i) {
+            double *p = &palette[12 * i];
+            for(int c = 0; c < 3; ++c) {
+                Pinocchio::Vector3 col = transforms[i].mult3(Pinocchio::Vector3(c == 0, c == 1, c == 2));
+                p[c] = col[0]; p[4 + c] = col[1]; p[8 + c] = col[2];
             }
-            D[i] = 1. / (1e-10 + D[i]);
+            Pinocchio::Vector3 trans = transforms[i].getTrans();
+            p[3] = trans[0]; p[7] = trans[1]; p[11] = trans[2];
+        }
 
-            //get bones
-            double minDist = 1e37;
-            for(j = 0; j < bones; ++j) {
-              // Would like to change to:
-              //   if(boneDists[i][j] < minDist && boneVis[i][j])
-              // but need to make boneVis more robust - ie, check
-              // if the bone is initially outside the mesh, etc
-              if(boneDists[i][j] < minDist) {
-                    closest[i] = j;
-                    minDist = boneDists[i][j];
+        positions.resize(nv);
+        if(normals)
+            normals->resize(nv);
+
+        const int chunk = 1024 / blockSize; //blocks per task
+        int numBlocks = (nv + blockSize - 1) / blockSize;
+        parallelFor(0, (numBlocks + chunk - 1) / chunk, [&](int c) {
+            int b, j, k, l;
+            int end = min(numBlocks, (c + 1) * chunk);
+            for(b = c * chunk; b < end; ++b) {
+                int first = b * blockSize, lanes = min(blockSize, nv - first);
+
+                //blend the matrices of the influences of the block's vertices (a palette entry is 12 contiguous
+                //doubles), then transpose them so that the transforms run across the vertices
+                double blended[blockSize][12] = { { 0. } }, m[12][blockSize];
+                for(j = blockSlots[b]; j < blockSlots[b + 1]; ++j) {
+                    const int *idx = &blockBones[j * blockSize];
+                    const double *w = &blockWeights[j * blockSize];
+                    for(l = 0; l < blockSize; ++l) {
+                        const double *pal = &palette[idx[l]];
+                        for(k = 0; k < 12; ++k)
+                            blended[l][k] += pal[k] * w[l];
+                    }
+                }
+                for(k = 0; k < 12; ++k)
+                    for(l = 0; l < blockSize; ++l)
+                        m[k][l] = blended[l][k];
+
+                double p[3][blockSize] = { { 0. } }, out[3][blockSize];
+                for(l = 0; l < lanes; ++l)
+                    for(k = 0; k < 3; ++k)
+                        p[k][l] = mesh.vertices[first + l].pos[k];
+                for(k = 0; k < 3; ++k)
+                    for(l = 0; l < blockSize; ++l)
+                        out[k][l] = m[4 * k][l] * p[0][l] + m[4 * k + 1][l] * p[1][l] + m[4 * k + 2][l] * p[2][l] + m[4 * k + 3][l];
+                for(l = 0; l < lanes; ++l)
+                    positions[first + l] = Pinocchio::Vector3(out[0][l], out[1][l], out[2][l]);
+
+                if(normals) { //through the cofactor matrix (the inverse transpose times the determinant), which
+                              //takes cross products of edges to cross products of the transformed edges
+                    double n[3][blockSize] = { { 0. } };
+                    for(l = 0; l < lanes; ++l)
+                        for(k = 0; k < 3; ++k)
+                            n[k][l] = mesh.vertices[first + l].normal[k];
+                    for(k = 0; k < 3; ++k) { //row k of the cofactor matrix is the cross product of rows k + 1 and k + 2
+                        const double *r1[3] = { m[4 * ((k + 1) % 3)], m[4 * ((k + 1) % 3) + 1], m[4 * ((k + 1) % 3) + 2] };
+                        const double *r2[3] = { m[4 * ((k + 2) % 3)], m[4 * ((k + 2) % 3) + 1], m[4 * ((k + 2) % 3) + 2] };
+                        for(l = 0; l < blockSize; ++l)
+                            out[k][l] = (r1[1][l] * r2[2][l] - r1[2][l] * r2[1][l]) * n[0][l] +
+                                        (r1[2][l] * r2[0][l] - r1[0][l] * r2[2][l]) * n[1][l] +
+                                        (r1[0][l] * r2[1][l] - r1[1][l] * r2[0][l]) * n[2][l];
+                    }
+                    for(l = 0; l < blockSize; ++l) {
+                        double len = sqrt(out[0][l] * out[0][l] + out[1][l] * out[1][l] + out[2][l] * out[2][l]);
+                        for(k = 0; k < 3; ++k)
+                            out[k][l] /= len;
+                    }
+                    for(l = 0; l < lanes; ++l)
+                        (*normals)[first + l] = Pinocchio::Vector3(out[0][l], out[1][l], out[2][l]);
                 }
             }
-            for(j = 0; j < bones; ++j)
-                if(boneVis[i][j] && boneDists[i][j] <= minDist * 1.00001)
-                    H[i] += initialHeatWeight / SQR(1e-8 + boneDists[i][closest[i]]);
+        });
+        return true;
+    }
+
+    Vector<double, -1> getWeights(int i) const
+    {
+        if(influences == 0)
+            return weights[i];
+
+        Vector<double, -1> out;
+        if(bones > 0)
+            out[bones - 1] = 0.;
+        for(int j = 0; j < influences && boneWeights[i * influences + j] > 0.f; ++j)
+            out[boneIndices[i * influences + j]] = boneWeights[i * influences + j];
+        return out;
+    }
+
+    void compact(int maxInfluences)
+    {
+        int i, j;
+        if(influences > 0 || maxInfluences <= 0)
+            return; //already compact
+        if(bones > 65536) {
+            Debugging::out() << "Too many bones to compact attachment" << endl;
+            return;
+        }
+
+        int nv = nzweights.size();
+        influences = maxInfluences;
+        boneIndices.assign(nv * influences, 0);
+        boneWeights.assign(nv * influences, 0.f); //unused slots have zero weight and come last
+
+        for(i = 0; i < nv; ++i) {
+            vector<pair<double, int> > sorted; //largest first
+            for(j = 0; j < (int)nzweights[i].size(); ++j)
+                sorted.push_back(make_pair(-nzweights[i][j].second, nzweights[i][j].first));
+            int num = min(influences, (int)sorted.size());
+            partial_sort(sorted.begin(), sorted.begin() + num, sorted.end());
 
-            //get laplacian
             double sum = 0.;
-            for(j = 0; j < (int)edges[i].size(); ++j) {
-                int nj = (j + 1) % edges[i].size();
-                int pj = (j + edges[i].size() - 1) % edges[i].size();
+            for(j = 0; j < num; ++j)
+                sum -= sorted[j].first;
+            for(j = 0; j < num; ++j) {
+                boneIndices[i * influences + j] = (unsigned short)sorted[j].second;
+                boneWeights[i * influences + j] = float(-sorted[j].first / sum);
+            }
+        }
 
-                Pinocchio::Vector3 v1 = mesh.vertices[i].pos - mesh.vertices[edges[i][pj]].pos;
-                Pinocchio::Vector3 v2 = mesh.vertices[edges[i][j]].pos - mesh.vertices[edges[i][pj]].pos;
-                Pinocchio::Vector3 v3 = mesh.vertices[i].pos - mesh.vertices[edges[i][nj]].pos;
-                Pinocchio::Vector3 v4 = mesh.vertices[edges[i][j]].pos - mesh.vertices[edges[i][nj]].pos;
+        vector<Vector<double, -1> >().swap(weights); //free the uncompacted weights
+        vector<vector<pair<int, double> > >().swap(nzweights);
+        makeBlocks();
+    }
 
-                double cot1 = (v1 * v2) / (1e-6 + (v1 % v2).length());
-                double cot2 = (v3 * v4) / (1e-6 + (v3 % v4).length());
-                sum += (cot1 + cot2);
+    //File layout (in the byte order of the machine that saved it, swapped on load if needed):
+    //  AttachmentHeader
+    //  uncompacted: unsigned int offsets[vertices + 1], unsigned int bones[entries], double weights[entries]
+    //  compacted: unsigned short bones[vertices * influences], float weights[vertices * influences]
+    //the header and every array are zero padded to a multiple of 8 bytes, so every array starts at one
+    struct AttachmentHeader
+    {
+        char magic[4];
+        unsigned int byteOrder; //byteOrderMark as saved
+        unsigned int version;
+        unsigned int vertices;
+        unsigned int bones;
+        unsigned int influences; //0 if not compacted
+        unsigned int entries; //number of nonzero weights if not compacted
+    };
+
+    bool save(ostream &os) const
+    {
+        int i, j;
+        AttachmentHeader h;
+        memcpy(h.magic, "PNAT", 4);
+        h.byteOrder = byteOrderMark;
+        h.version = attachmentFileVersion;
+        h.vertices = numVertices();
+        h.bones = bones;
+        h.influences = influences;
+        h.entries = 0;
+        for(i = 0; i < (int)nzweights.size(); ++i)
+            h.entries += nzweights[i].size();
+        write(os, &h, sizeof(h));
+
+        if(influences > 0) {
+            write(os, boneIndices.empty() ? NULL : &boneIndices[0], boneIndices.size() * sizeof(unsigned short));
+            write(os, boneWeights.empty() ? NULL : &boneWeights[0], boneWeights.size() * sizeof(float));
+            return !os.fail();
+        }
 
-                if(edges[i][j] > i) //check for triangular here because sum should be computed regardless
-                    continue;
-                A[i].push_back(make_pair(edges[i][j], -cot1 - cot2));
+        vector<unsigned int> offsets(1, 0), idx;
+        vector<double> w;
+        idx.reserve(h.entries);
+        w.reserve(h.entries);
+        for(i = 0; i < (int)nzweights.size(); ++i) {
+            for(j = 0; j < (int)nzweights[i].size(); ++j) {
+                idx.push_back(nzweights[i][j].first);
+                w.push_back(nzweights[i][j].second);
             }
+            offsets.push_back(idx.size());
+        }
+        write(os, &offsets[0], offsets.size() * sizeof(unsigned int));
+        write(os, idx.empty() ? NULL : &idx[0], idx.size() * sizeof(unsigned int));
+        write(os, w.empty() ? NULL : &w[0], w.size() * sizeof(double));
+        return !os.fail();
+    }
 
-            A[i].push_back(make_pair(i, sum + H[i] / D[i]));
+    //is must be seekable: the sizes in the header are checked against the file length before anything is allocated
+    static AttachmentPrivate1 *load(istream &is)
+    {
+        int i, j;
+        AttachmentHeader h;
+        if(!read(is, &h, sizeof(h)) || memcmp(h.magic, "PNAT", 4) != 0) {
+            Debugging::out() << "Not an attachment file" << endl;
+            return NULL;
+        }
+        bool swapped = h.byteOrder != byteOrderMark;
+        if(swapped)
+            swapBytes(&h.byteOrder, sizeof(unsigned int), (sizeof(h) - sizeof(h.magic)) / sizeof(unsigned int));
+        if(h.byteOrder != byteOrderMark || h.version != (unsigned int)attachmentFileVersion) {
+            Debugging::out() << "Unsupported attachment file version " << h.version << endl;
+            return NULL;
+        }
 
-            sort(A[i].begin(), A[i].end());
+        streamoff start = is.tellg();
+        is.seekg(0, ios::end);
+        streamoff length = is.tellg() - start;
+        is.seekg(start);
+        if(start < 0 || length < 0 || is.fail()) {
+            Debugging::out() << "Cannot determine attachment file length" << endl;
+            return NULL;
         }
 
-        nzweights.resize(nv);
-        SPDMatrix Am(A);
-        LLTMatrix *Ainv = Am.factor();
-        if(Ainv == NULL)
-            return;
+        //64 bit, so that corrupt counts cannot overflow
+        unsigned long long vertices = h.vertices, influences = h.influences, entries = h.entries;
+        unsigned long long expected;
+        if(influences > 0)
+            expected = padded(vertices * influences * sizeof(unsigned short)) + padded(vertices * influences * sizeof(float));
+        else
+            expected = padded((vertices + 1) * sizeof(unsigned int)) + padded(entries * sizeof(unsigned int)) +
+                       padded(entries * sizeof(double));
+        if(h.vertices > INT_MAX || h.bones > INT_MAX || h.influences > INT_MAX || h.entries > INT_MAX ||
+           (influences > 0 && h.bones > 65536) || expected > (unsigned long long)length) {
+            Debugging::out() << "Corrupt attachment file" << endl;
+            return NULL;
+        }
 
-        for(j = 0; j < bones; ++j) {
-            vector<double> rhs(nv, 0.);
-            for(i = 0; i < nv; ++i) {
-                if(boneVis[i][j] && boneDists[i][j] <= boneDists[i][closest[i]] * 1.00001)
-                    rhs[i] = H[i] / D[i];
+        AttachmentPrivate1 *out = new AttachmentPrivate1();
+        out->bones = h.bones;
+        out->influences = h.influences;
+        bool ok;
+
+        if(influences > 0) {
+            vector<unsigned short> &idx = out->boneIndices;
+            vector<float> &w = out->boneWeights;
+            idx.resize(vertices * influences);
+            w.resize(vertices * influences);
+            ok = read(is, idx.empty() ? NULL : &idx[0], idx.size() * sizeof(unsigned short)) &&
+                 read(is, w.empty() ? NULL : &w[0], w.size() * sizeof(float));
+            if(ok && swapped) {
+                swapBytes(idx.empty() ? NULL : &idx[0], sizeof(unsigned short), idx.size());
+                swapBytes(w.empty() ? NULL : &w[0], sizeof(float), w.size());
+            }
+
+            for(i = 0; ok && i < (int)idx.size(); ++i)
+                ok = idx[i] < h.bones;
+        }
+        else {
+            vector<unsigned int> offsets(vertices + 1), idx(entries);
+            vector<double> w(entries);
+            ok = read(is, &offsets[0], offsets.size() * sizeof(unsigned int)) &&
+                 read(is, idx.empty() ? NULL : &idx[0], idx.size() * sizeof(unsigned int)) &&
+                 read(is, w.empty() ? NULL : &w[0], w.size() * sizeof(double));
+            if(ok && swapped) {
+                swapBytes(&offsets[0], sizeof(unsigned int), offsets.size());
+                swapBytes(idx.empty() ? NULL : &idx[0], sizeof(unsigned int), idx.size());
+                swapBytes(w.empty() ? NULL : &w[0], sizeof(double), w.size());
             }
 
-            Ainv->solve(rhs);
+            for(i = 0; ok && i < (int)h.vertices; ++i)
+                ok = offsets[i] <= offsets[i + 1] && offsets[i + 1] <= h.entries;
+            for(i = 0; ok && i < (int)h.entries; ++i)
+                ok = idx[i] < h.bones;
+
+            if(ok) {
+                out->nzweights.resize(h.vertices);
+                out->weights.resize(h.vertices);
+                for(i = 0; i < (int)h.vertices; ++i) {
+                    if(h.bones > 0)
+                        out->weights[i][h.bones - 1] = 0.;
+                    for(j = offsets[i]; j < (int)offsets[i + 1]; ++j) {
+                        out->nzweights[i].push_back(make_pair((int)idx[j], w[j]));
+                        out->weights[i][idx[j]] = w[j];
+                    }
+                }
+            }
+        }
+
+        if(!ok) {
+            Debugging::out() << "Corrupt attachment file" << endl;
+            delete out;
+            return NULL;
+        }
+        out->makeBlocks();
+        return out;
+    }
+
+    AttachmentPrivate *clone() const
+    {
+        AttachmentPrivate1 *out = new AttachmentPrivate1();
+        *out = *this;
+        return out;
+    }
+
+private:
+    //boneWeights[j][i] is the weight of bone j at vertex i: clipped to 1, dropped below 1e-8 and normalized
+    void setWeights(const vector<vector<double> > &boneWeights)
+    {
+        int i, j;
+        int nv = boneWeights.empty() ? 0 : boneWeights[0].size();
+
+        weights.resize(nv);
+        for(i = 0; i < nv; ++i) // initialize the weights vectors so they are big enough
+            weights[i][bones - 1] = 0.;
+
+        nzweights.resize(nv);
+        for(j = 0; j < bones; ++j) {
             for(i = 0; i < nv; ++i) {
-                if(rhs[i] > 1.)
-                    rhs[i] = 1.; //clip just in case
-                if(rhs[i] > 1e-8)
-                    nzweights[i].push_back(make_pair(j, rhs[i]));
+                double w = min(boneWeights[j][i], 1.); //clip just in case
+                if(w > 1e-8)
+                    nzweights[i].push_back(make_pair(j, w));
             }
         }
 
@@ -192,48 +823,95 @@ public:
                 weights[i][nzweights[i][j].first] = nzweights[i][j].second;
             }
         }
-
-        delete Ainv;
-        return;
+        makeBlocks();
     }
 
-    Mesh deform(const Mesh &mesh, const vector<Transform<> > &transforms) const
+    //lays the nonzero weights out for deform (see blockSize)
+    void makeBlocks()
     {
-        Mesh out = mesh;
-        int i, nv = mesh.vertices.size();
-
-        if(mesh.vertices.size() != weights.size())
-            return out; //error
+        int i, j, l;
+        int nv = numVertices(), numBlocks = (nv + blockSize - 1) / blockSize;
+        vector<vector<pair<int, double> > > block(blockSize);
+
+        blockSlots.assign(1, 0);
+        blockBones.clear();
+        blockWeights.clear();
+        for(i = 0; i < numBlocks; ++i) {
+            int slots = 0;
+            for(l = 0; l < blockSize; ++l) {
+                int v = i * blockSize + l;
+                block[l].clear();
+                if(v >= nv)
+                    continue;
+                if(influences > 0) {
+                    for(j = 0; j < influences && boneWeights[v * influences + j] > 0.f; ++j)
+                        block[l].push_back(make_pair((int)boneIndices[v * influences + j], (double)boneWeights[v * influences + j]));
+                }
+                else
+                    block[l] = nzweights[v];
+                slots = max(slots, (int)block[l].size());
+            }
 
-        for(i = 0; i < nv; ++i) {
-            Pinocchio::Vector3 newPos;
-            int j;
-            for(j = 0; j < (int)nzweights[i].size(); ++j) {
-                int boneno = nzweights[i][j].first;
-                double weight = nzweights[i][j].second;
-                double CurrBoneweights = weights[i][boneno];
-                newPos += ((transforms[nzweights[i][j].first] * out.vertices[i].pos) * nzweights[i][j].second);
+            //slots past the influences of a vertex have weight zero on bone 0
+            blockBones.resize((blockSlots.back() + slots) * blockSize, 0);
+            blockWeights.resize((blockSlots.back() + slots) * blockSize, 0.);
+            for(l = 0; l < blockSize; ++l) {
+                for(j = 0; j < (int)block[l].size(); ++j) {
+                    blockBones[(blockSlots.back() + j) * blockSize + l] = 12 * block[l][j].first;
+                    blockWeights[(blockSlots.back() + j) * blockSize + l] = block[l][j].second;
+                }
             }
-            out.vertices[i].pos = newPos;
+            blockSlots.push_back(blockSlots.back() + slots);
         }
+    }
 
-        out.computeVertexNormals();
+    static const unsigned int byteOrderMark = 0x01020304;
 
-        return out;
+    //binary io, padding every array to a multiple of 8 bytes
+    static unsigned long long padded(unsigned long long size) { return (size + 7) / 8 * 8; }
+
+    static void swapBytes(void *data, size_t elementSize, size_t count)
+    {
+        char *c = (char *)data;
+        for(size_t i = 0; i < count; ++i, c += elementSize)
+            reverse(c, c + elementSize);
     }
 
-    Vector<double, -1> getWeights(int i) const { return weights[i]; }
+    static void write(ostream &os, const void *data, size_t size)
+    {
+        static const char zeros[8] = { 0 };
+        if(size > 0)
+            os.write((const char *)data, size);
+        os.write(zeros, (8 - size % 8) % 8);
+    }
 
-    AttachmentPrivate *clone() const
+    static bool read(istream &is, void *data, size_t size)
     {
-        AttachmentPrivate1 *out = new AttachmentPrivate1();
-        *out = *this;
-        return out;
+        char padding[8];
+        if(size > 0)
+            is.read((char *)data, size);
+        is.read(padding, (8 - size % 8) % 8);
+        return !is.fail();
     }
 
-private:
+    int numVertices() const { return influences > 0 ? (int)boneWeights.size() / influences : (int)weights.size(); }
+
+    int bones;
     vector<Vector<double, -1> > weights;
     vector<vector<pair<int, double> > > nzweights; //sparse representation
+
+    //compact representation: influences entries per vertex, largest weight first
+    int influences; //0 if not compacted
+    vector<unsigned short> boneIndices;
+    vector<float> boneWeights;
+
+    //deform's layout of the weights: blocks of blockSize consecutive vertices, each with as many slots as
+    //the vertex with the most influences in it has influences.  A slot holds one palette offset (12 times the
+    //bone index) and one weight per vertex of the block, so the blend runs across the vertices of a block.
+    static const int blockSize = 8;
+    vector<int> blockSlots; //slots of block b are [blockSlots[b], blockSlots[b + 1])
+    vector<int> blockBones; //blockSize entries per slot
+    vector<double> blockWeights; //blockSize entries per slot
 };
 
 Attachment::~Attachment()
@@ -249,13 +927,82 @@ Attachment::Attachment(const Attachment &att)
 
 Vector<double, -1> Attachment::getWeights(int i) const { return a->getWeights(i); }
 
+void Attachment::compact(int maxInfluences) { a->compact(maxInfluences); }
+
+bool Attachment::save(const string &filename) const
+{
+    ofstream os(filename.c_str(), ios::binary);
+    if(!os.is_open() || a == NULL) {
+        Debugging::out() << "Error writing attachment " << filename << endl;
+        return false;
+    }
+    return a->save(os);
+}
+
+bool Attachment::load(const string &filename)
+{
+    ifstream is(filename.c_str(), ios::binary);
+    if(!is.is_open()) {
+        Debugging::out() << "Error opening attachment " << filename << endl;
+        return false;
+    }
+
+    AttachmentPrivate *loaded = AttachmentPrivate1::load(is);
+    if(loaded == NULL)
+        return false;
+
+    if(a)
+        delete a;
+    a = loaded;
+    return true;
+}
+
 Mesh Attachment::deform(const Mesh &mesh, const vector<Transform<> > &transforms) const
 {
     return a->deform(mesh, transforms);
 }
 
+bool Attachment::deform(const Mesh &mesh, const vector<Transform<> > &transforms,
+                        vector<Pinocchio::Vector3> &positions, vector<Pinocchio::Vector3> *normals) const
+{
+    return a->deform(mesh, transforms, positions, normals);
+}
+
 Attachment::Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match, const VisibilityTester *tester,
-					   double initialHeatWeight)
+					   double initialHeatWeight, SymbolicLLT *symbolic, const vector<int> *mirror)
+{
+    a = new AttachmentPrivate1(mesh, skeleton, match, tester, initialHeatWeight, symbolic, mirror);
+}
+
+Attachment::Attachment(const vector<vector<double> > &boneWeights)
+{
+    a = new AttachmentPrivate1(boneWeights);
+}
+
+vector<SolverBenchmark> benchmarkHeatSolvers(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                                             const VisibilityTester *tester, double initialHeatWeight)
+{
+    vector<vector<pair<int, double> > > A;
+    vector<vector<double> > rhs;
+    heatEquation(mesh, skeleton, match, tester, initialHeatWeight, A, rhs);
+    return benchmarkSolverBackends(SPDMatrix(A), rhs);
+}
+
+double localHeatError(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                      const VisibilityTester *tester, double tolerance, double initialHeatWeight)
 {
-    a = new AttachmentPrivate1(mesh, skeleton, match, tester, initialHeatWeight);
+    vector<vector<pair<int, double> > > A;
+    vector<vector<double> > global, local;
+    heatEquation(mesh, skeleton, match, tester, initialHeatWeight, A, global);
+    local = global;
+
+    SymbolicLLT symbolic; //leaves the cache alone
+    if(!solveHeat(mesh, A, global, &symbolic) || !solveHeatLocally(A, local, tolerance))
+        return -1.;
+
+    double out = 0.;
+    for(int j = 0; j < (int)global.size(); ++j)
+        for(int i = 0; i < (int)global[j].size(); ++i)
+            out = max(out, fabs(global[j][i] - local[j][i]));
+    return out;
 }
@@ -22,12 +22,22 @@
 #include "mesh.h"
 #include "skeleton.h"
 #include "transform.h"
+#include "parallel.h"
 
 class VisibilityTester
 {
 public:
     virtual ~VisibilityTester() {}
     virtual bool canSee(const Pinocchio::Vector3 &v1, const Pinocchio::Vector3 &v2) const = 0;
+
+    //batched version: out[i] = canSee(v1[i], v2[i]).  Serial by default, since not every tester
+    //can be queried concurrently
+    virtual void canSee(const vector<Pinocchio::Vector3> &v1, const vector<Pinocchio::Vector3> &v2, vector<bool> &out) const
+    {
+        out.resize(v1.size());
+        for(int i = 0; i < (int)v1.size(); ++i)
+            out[i] = canSee(v1[i], v2[i]);
+    }
 };
 
 template<class T> class VisTester : public VisibilityTester
@@ -35,6 +45,19 @@ template<class T> class VisTester : public VisibilityTester
 public:
     VisTester(const T *t) : tree(t) {}
 
+    //the distance field is read only, so the queries are split across threads
+    virtual void canSee(const vector<Pinocchio::Vector3> &v1, const vector<Pinocchio::Vector3> &v2, vector<bool> &out) const
+    {
+        vector<char> result(v1.size());
+        const int chunk = 256;
+        parallelFor(0, ((int)v1.size() + chunk - 1) / chunk, [&](int c) {
+            int end = min((int)v1.size(), (c + 1) * chunk);
+            for(int i = c * chunk; i < end; ++i)
+                result[i] = canSee(v1[i], v2[i]);
+        });
+        out.assign(result.begin(), result.end());
+    }
+
     virtual bool canSee(const Pinocchio::Vector3 &v1, const Pinocchio::Vector3 &v2) const //faster when v2 is farther inside than v1
     {
         const double maxVal = 0.002;
@@ -62,19 +85,77 @@ private:
 template<class T> VisibilityTester *makeVisibilityTester(const T *tree) { return new VisTester<T>(tree); } //be sure to delete afterwards
 
 class AttachmentPrivate;
+class SymbolicLLT;
+class SymbolicCache;
+struct SolverBenchmark;
+
+static const int attachmentFileVersion = 2;
+
+static const int defaultMaxInfluences = 4;
+
+//unless a default solver backend is set (see lsqSolver.h), meshes with at least this many vertices
+//solve the heat equation iteratively--the factor would not fit in memory
+static const int iterativeHeatSolveSize = 2000000;
+
+//bone-local heat solves: every bone's weights are solved for only where they are estimated to stay
+//above tolerance and are zero elsewhere, which is much less work than the global solve for skeletons
+//with many bones.  0, the default, solves on the whole mesh.
+void PINOCCHIO_API setLocalHeatTolerance(double tolerance);
+double PINOCCHIO_API localHeatTolerance();
 
 class PINOCCHIO_API Attachment
 {
 public:
     Attachment() : a(NULL) {}
     Attachment(const Attachment &);
-    Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match, const VisibilityTester *tester, double initialHeatWeight=1.);
+    //if symbolic is given, it is reused for the heat equation when it fits this mesh and recomputed into
+    //otherwise--keep it across attachments of the same mesh (e.g., a stiffness sweep) to skip the ordering.
+    //Without it, heatSymbolicCache() does the same for every mesh topology seen recently.
+    //If mirror is given (see detectMirrorSymmetry), the mesh and the skeleton are taken to be symmetric about
+    //the x = 0.5 plane and the heat equation is set up and solved on half the mesh (symbolic and the local
+    //heat tolerance are not used then).
+    Attachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match, const VisibilityTester *tester,
+               double initialHeatWeight=1., SymbolicLLT *symbolic=NULL, const vector<int> *mirror=NULL);
+    //from weights computed elsewhere: boneWeights[j][i] is the weight of bone j at vertex i.
+    //They are clipped and normalized the same way as the heat equation solution.
+    Attachment(const vector<vector<double> > &boneWeights);
     virtual ~Attachment();
 
     Mesh deform(const Mesh &mesh, const vector<Transform<> > &transforms) const;
+    //linear blend skinning of the mesh vertices into caller-owned buffers (resized as needed), in parallel.
+    //Normals are the rest normals through the cofactors (inverse transposes) of the blended linear parts, renormalized;
+    //skipped if NULL.  Returns false, with the buffers emptied, if the mesh does not match the attachment or
+    //there are fewer transforms than bones.
+    bool deform(const Mesh &mesh, const vector<Transform<> > &transforms,
+                vector<Pinocchio::Vector3> &positions, vector<Pinocchio::Vector3> *normals = NULL) const;
     Vector<double, -1> getWeights(int i) const;
+
+    //keeps only the maxInfluences largest weights of every vertex (renormalized), stored compactly
+    //as 16-bit bone indices and float weights--deform and getWeights use that from then on
+    void compact(int maxInfluences = defaultMaxInfluences);
+
+    //binary weights file: a fixed header followed by 8-byte aligned arrays in the byte order of the saving
+    //machine, which the header records so that load can swap it.  Loading restores the weights bit for bit.
+    //Both return false on failure, load also on truncated or inconsistent files.
+    bool save(const string &filename) const;
+    bool load(const string &filename);
 private:
     AttachmentPrivate * a = nullptr;
 };
 
+//symbolic factorizations of the heat equation shared by all attachments, keyed by connectivityHash,
+//so that meshes with the same topology (e.g., morph targets of one base mesh) skip the ordering and
+//symbolic analysis.  Holds defaultSymbolicCacheCapacity topologies unless changed; see lsqSolver.h.
+SymbolicCache PINOCCHIO_API &heatSymbolicCache();
+
+//sets up the heat equation an Attachment of this mesh would solve and runs it through every solver backend
+vector<SolverBenchmark> PINOCCHIO_API benchmarkHeatSolvers(const Mesh &mesh, const Skeleton &skeleton,
+                                                           const vector<Pinocchio::Vector3> &match,
+                                                           const VisibilityTester *tester, double initialHeatWeight=1.);
+
+//largest difference between the bone-local and the global heat solutions of this mesh (before clipping
+//and normalization), to check a local heat tolerance.  Negative if either solve fails.
+double PINOCCHIO_API localHeatError(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                                    const VisibilityTester *tester, double tolerance, double initialHeatWeight=1.);
+
 #endif
@@ -24,11 +24,15 @@
 class Debugging
 {
 public:
-    static ostream &out() { return *outStream; }
+    static ostream &out() { return threadOutStream ? *threadOutStream : *outStream; }
     static void PINOCCHIO_API setOutStream(ostream &os) { outStream = &os; }
+    //out() on the calling thread only goes to os instead (back to the shared stream if NULL), so that
+    //work running in parallel can buffer its output and print it afterwards without interleaving
+    static void PINOCCHIO_API setThreadOutStream(ostream *os) { threadOutStream = os; }
 
 private:
     static ostream *outStream;
+    static thread_local ostream *threadOutStream;
 };
 
 #endif //DEBUGGING_H
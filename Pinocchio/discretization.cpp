@@ -37,8 +37,71 @@ Mesh  prepareMesh(const Mesh &m)
 }
 
 
+bool detectMirrorSymmetry(const Mesh &m, vector<int> *mirror, double tol)
+{
+    int i, j, k;
+    int nv = m.vertices.size();
+    if(nv == 0)
+        return false;
+
+    //vertices hashed on a grid of tol sized cells, so the candidates are in the 27 around the mirror point
+    double cell = max(tol, 1e-6);
+    auto cellKey = [&](int x, int y, int z) { return ((long long)x << 42) + ((long long)y << 21) + (long long)z; };
+    auto cellOf = [&](double c) { return max(0, min((1 << 21) - 1, (int)floor(c / cell) + 1)); };
+    unordered_map<long long, vector<int> > grid;
+    for(i = 0; i < nv; ++i) {
+        const Pinocchio::Vector3 &p = m.vertices[i].pos;
+        grid[cellKey(cellOf(p[0]), cellOf(p[1]), cellOf(p[2]))].push_back(i);
+    }
+
+    vector<int> out(nv, -1);
+    for(i = 0; i < nv; ++i) {
+        Pinocchio::Vector3 p = m.vertices[i].pos;
+        p[0] = 1. - p[0];
+        int c[3] = { cellOf(p[0]), cellOf(p[1]), cellOf(p[2]) };
+        double best = SQR(tol);
+        for(k = 0; k < 27; ++k) {
+            unordered_map<long long, vector<int> >::const_iterator it =
+                grid.find(cellKey(c[0] + k % 3 - 1, c[1] + k / 3 % 3 - 1, c[2] + k / 9 - 1));
+            if(it == grid.end())
+                continue;
+            for(j = 0; j < (int)it->second.size(); ++j) {
+                double distSq = (m.vertices[it->second[j]].pos - p).lengthsq();
+                if(distSq <= best) {
+                    best = distSq;
+                    out[i] = it->second[j];
+                }
+            }
+        }
+        if(out[i] < 0)
+            return false;
+    }
+    for(i = 0; i < nv; ++i)
+        if(out[out[i]] != i)
+            return false;
+
+    //the triangles must match too, or the heat equation would not be symmetric
+    vector<pair<long long, int> > tris;
+    for(i = 0; i + 2 < (int)m.edges.size(); i += 3) {
+        int v[3] = { m.edges[i].vertex, m.edges[i + 1].vertex, m.edges[i + 2].vertex };
+        sort(v, v + 3);
+        tris.push_back(make_pair((long long)v[0] * nv + v[1], v[2]));
+    }
+    sort(tris.begin(), tris.end());
+    for(i = 0; i + 2 < (int)m.edges.size(); i += 3) {
+        int v[3] = { out[m.edges[i].vertex], out[m.edges[i + 1].vertex], out[m.edges[i + 2].vertex] };
+        sort(v, v + 3);
+        if(!binary_search(tris.begin(), tris.end(), make_pair((long long)v[0] * nv + v[1], v[2])))
+            return false;
+    }
+
+    if(mirror)
+        mirror->swap(out);
+    return true;
+}
+
 //constructs a distance field on an octree--user responsible for deleting output
-TreeType *constructDistanceField(const Mesh &m, double tol)
+TreeType *constructDistanceField(const Mesh &m, double tol, bool mirrorX)
 {
     vector<Tri3Object> triobjvec;
     for(int i = 0; i < (int)m.edges.size(); i += 3) {
@@ -51,7 +114,7 @@ TreeType *constructDistanceField(const Mesh &m, double tol)
     
     ObjectProjector<3, Tri3Object> proj(triobjvec);
 
-    TreeType *out = OctTreeMaker<TreeType>().make(proj, m, tol);
+    TreeType *out = OctTreeMaker<TreeType>().make(proj, m, tol, mirrorX);
 
     Debugging::out() << "Done fullSplit " << out->countNodes() << " " << out->maxLevel() << endl;
 
@@ -95,7 +158,7 @@ bool sphereComp(const Sphere &s1, const Sphere &s2) { return s1.radius > s2.radi
 
 //samples the distance field to find spheres on the medial surface
 //output is sorted by radius in decreasing order
-vector<Sphere> sampleMedialSurface(TreeType *distanceField, double tol)
+vector<Sphere> sampleMedialSurface(TreeType *distanceField, double tol, bool mirrorX)
 {
     int i;
     vector<Sphere> out;
@@ -115,6 +178,8 @@ vector<Sphere> sampleMedialSurface(TreeType *distanceField, double tol)
         
         //we are at octree leaf
         Rect3 r = cur->getRect();
+        if(mirrorX && r.getHi()[0] <= 0.5)
+            continue; //mirrored from the other half below
         double rad = r.getSize().length() / 2.;
         Pinocchio::Vector3 c = r.getCenter();
         double dot = getMinDot(distanceField, c, rad);
@@ -144,6 +209,8 @@ vector<Sphere> sampleMedialSurface(TreeType *distanceField, double tol)
             if(dot > 0.0)
                 continue;
             out.push_back(Sphere(p, dist));
+            if(mirrorX && p[0] > 0.5)
+                out.push_back(Sphere(Pinocchio::Vector3(1. - p[0], p[1], p[2]), dist));
         }
     }
     
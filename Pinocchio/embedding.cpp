@@ -17,12 +17,18 @@
 */
 
 #include "pinocchioApi.h"
+#include "parallel.h"
 #include "debugging.h"
 
 struct FP //information for penalty functions
 {
     FP(const PtGraph &inG, const Skeleton &inSk, const vector<Sphere> &inS)
-        : graph(inG), given(inSk), sph(inS), paths(inG) {}
+        : graph(inG), given(inSk), sph(inS), paths(inG)
+    {
+        footBase = 1.;
+        for(int i = 0; i < (int)graph.verts.size(); ++i)
+            footBase = min(footBase, graph.verts[i][1]);
+    }
 
     const PtGraph &graph;
     const Skeleton &given;
@@ -33,11 +39,12 @@ struct FP //information for penalty functions
 
 struct PartialMatch
 {
-    PartialMatch(int vsz) : penalty(0), heuristic(0) { vTaken.resize(vsz, false); }
+    PartialMatch(int vsz, int jsz) : penalty(0), heuristic(0), placed(0) { vTaken.resize(vsz, false); match.resize(jsz, -1); }
     
-    vector<int> match;
+    vector<int> match; //sphere for every compressed joint, -1 if the joint is not placed yet
     double penalty;
     double heuristic;
+    int placed; //how many joints of the current search order have been placed
     bool operator<(const PartialMatch &pm) const { return heuristic > pm.heuristic; } //smallest penalty first
     
     vector<bool> vTaken;
@@ -111,10 +118,8 @@ vector<vector<int> > computePossibilities(const PtGraph &graph, const vector<Sph
 vector<PenaltyFunction *> getPenaltyFunctions(FP *fp); //user responsible for deletion of penalties
 
 double computePenalty(const vector<PenaltyFunction *> &penaltyFunctions,
-                      const PartialMatch &cur, int next, int idx = -1)
+                      const PartialMatch &cur, int next, int idx)
 {
-    if(idx == -1)
-        idx = cur.match.size();
     if(idx == 0)
         return 0;
 
@@ -128,26 +133,32 @@ double computePenalty(const vector<PenaltyFunction *> &penaltyFunctions,
     return out;
 }
 
-vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
-                          const Skeleton &skeleton, const vector<vector<int> > &possibilities)
+//marks the graph path of the bone ending at (already placed) joint idx as taken
+void takePath(FP *fp, PartialMatch &pm, int idx)
 {
-    int i, j;
-    FP fp(graph, skeleton, spheres);
-
-    fp.footBase = 1.;
-    for(i = 0; i < (int)graph.verts.size(); ++i)
-        fp.footBase = min(fp.footBase, graph.verts[i][1]);
-
-    vector<PenaltyFunction *> penaltyFunctions = getPenaltyFunctions(&fp);
+    int prev = fp->given.cPrev()[idx];
+    if(prev < 0)
+        return;
+    vector<int> path = fp->paths.path(pm.match[idx], pm.match[prev]);
+    for(int i = 0; i < (int)path.size(); ++i)
+        pm.vTaken[path[i]] = true;
+}
 
-    int toMatch = skeleton.cGraph().verts.size();
-    
-    Debugging::out() << "Matching!" << endl;
+//best-first search that places the joints in order (parents before children) on top of the
+//joints already placed in start.  Returns up to maxResults complete matches, best first.
+//The joints in lookahead are not placed, but count towards the heuristic like unplaced joints do.
+vector<PartialMatch> searchEmbedding(FP *fp, const vector<PenaltyFunction *> &penaltyFunctions,
+                                     const vector<vector<int> > &possibilities, const vector<int> &order,
+                                     const vector<int> &lookahead, const PartialMatch &start,
+                                     int maxResults, bool verbose)
+{
+    int i, j, k;
+    const Skeleton &skeleton = fp->given;
+    int toMatch = order.size();
+    vector<PartialMatch> out;
     
     priority_queue<PartialMatch> todo;
-    
-    PartialMatch output(graph.verts.size());
-    todo.push(output);
+    todo.push(start);
     
     int maxSz = 0;
     
@@ -155,48 +166,45 @@ vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
         PartialMatch cur = todo.top();
         todo.pop();
         
-        int idx = cur.match.size();
-        
         int curSz = (int)log((double)todo.size());
         if(curSz > maxSz) {
             maxSz = curSz;
-            if(maxSz > 3)
+            if(maxSz > 3 && verbose)
                 Debugging::out() << "Reached " << todo.size() << endl;
         }
         
-        if(idx == toMatch) {
-            output = cur;
-            Debugging::out() << "Found: residual = " << cur.penalty << endl;
-            break;
+        if(cur.placed == toMatch) {
+            out.push_back(cur);
+            if((int)out.size() >= maxResults)
+                break;
+            continue;
         }
         
+        int idx = order[cur.placed];
         for(i = 0; i < (int)possibilities[idx].size(); ++i) {
             int candidate = possibilities[idx][i];
-            int k;
-            double extraPenalty = computePenalty(penaltyFunctions, cur, candidate);
+            double extraPenalty = computePenalty(penaltyFunctions, cur, candidate, idx);
 
-            if(extraPenalty < 0)
+            if(extraPenalty < 0 && verbose)
                 Debugging::out() << "ERR = " << extraPenalty << endl;
             if(cur.penalty + extraPenalty < 1.) {
                 PartialMatch next = cur;
-                next.match.push_back(candidate);
+                next.match[idx] = candidate;
+                ++next.placed;
                 next.penalty += extraPenalty;
                 next.heuristic = next.penalty;
                 
                 //compute taken vertices and edges
-                if(idx > 0) {
-                    vector<int> path = fp.paths.path(candidate, next.match[skeleton.cPrev()[idx]]);
-                    for(j = 0; j < (int)path.size(); ++j)
-                        next.vTaken[path[j]] = true;
-                }
+                takePath(fp, next, idx);
 
                 //compute heuristic
-                for(j = idx + 1; j < toMatch; ++j) {
-                    if(skeleton.cPrev()[j] > idx)
+                for(j = next.placed; j < toMatch + (int)lookahead.size(); ++j) {
+                    int jIdx = j < toMatch ? order[j] : lookahead[j - toMatch];
+                    if(next.match[skeleton.cPrev()[jIdx]] < 0)
                         continue;
                     double minP = 1e37;
-                    for(k = 0; k < (int)possibilities[j].size(); ++k) {
-                        minP = min(minP, computePenalty(penaltyFunctions, next, possibilities[j][k], j));
+                    for(k = 0; k < (int)possibilities[jIdx].size(); ++k) {
+                        minP = min(minP, computePenalty(penaltyFunctions, next, possibilities[jIdx][k], jIdx));
                     }
                     next.heuristic += minP;
                     if(next.heuristic > 1.)
@@ -211,15 +219,307 @@ vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
         }
     }
     
-    if(output.match.size() == 0)
+    return out;
+}
+
+vector<int> discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
+                          const Skeleton &skeleton, const vector<vector<int> > &possibilities)
+{
+    int i;
+    FP fp(graph, skeleton, spheres);
+
+    vector<PenaltyFunction *> penaltyFunctions = getPenaltyFunctions(&fp);
+
+    int toMatch = skeleton.cGraph().verts.size();
+    vector<int> order(toMatch);
+    for(i = 0; i < toMatch; ++i)
+        order[i] = i;
+    
+    Debugging::out() << "Matching!" << endl;
+    
+    vector<PartialMatch> found = searchEmbedding(&fp, penaltyFunctions, possibilities, order, vector<int>(),
+                                                 PartialMatch(graph.verts.size(), toMatch), 1, true);
+    
+    vector<int> out;
+    if(found.size() == 0)
     {
         Debugging::out() << "No Match" << endl;
     }
+    else {
+        Debugging::out() << "Found: residual = " << found[0].penalty << endl;
+        out = found[0].match;
+    }
 
     for(i = 0; i < (int)penaltyFunctions.size(); ++i)
         delete penaltyFunctions[i];
 
-    return output.match;
+    return out;
+}
+
+//-------------------------------------------------Hierarchical embedding---------------------
+
+//a group of compressed joints that is embedded in one search
+struct EmbedStage
+{
+    vector<int> joints; //in increasing order, so parents come before children
+    vector<int> children; //stages hanging off this one, embedded after it
+    vector<int> childRoots; //the top joint of each child stage
+    vector<PartialMatch> results; //best embeddings found for this stage, best first
+};
+
+//splits the subtree under root into stages of at most maxStageJoints joints (when possible)
+//and returns the index of the stage containing root
+int formStages(const Skeleton &skeleton, int root, int maxStageJoints, vector<EmbedStage> &stages)
+{
+    int i;
+    const vector<int> &prev = skeleton.cPrev();
+    int sz = prev.size();
+
+    //children always have larger indices than their parents
+    vector<bool> inTree(sz, false);
+    vector<int> subtree(1, root);
+    inTree[root] = true;
+    for(i = root + 1; i < sz; ++i) {
+        if(prev[i] >= 0 && inTree[prev[i]]) {
+            inTree[i] = true;
+            subtree.push_back(i);
+        }
+    }
+
+    vector<bool> inStage(sz, false);
+    inStage[root] = true;
+    int count = 1;
+    if((int)subtree.size() <= maxStageJoints) {
+        for(i = 1; i < (int)subtree.size(); ++i)
+            inStage[subtree[i]] = true;
+        count = subtree.size();
+    }
+    else {
+        //the fat joints (the torso) and everything on the way to them go first
+        for(i = 1; i < (int)subtree.size(); ++i) {
+            if(!skeleton.cFat()[subtree[i]])
+                continue;
+            for(int cur = subtree[i]; !inStage[cur]; cur = prev[cur]) {
+                inStage[cur] = true;
+                ++count;
+            }
+        }
+        //then grow the stage a full ring of joints at a time while it stays small enough
+        while(true) {
+            vector<int> ring;
+            for(i = 1; i < (int)subtree.size(); ++i)
+                if(!inStage[subtree[i]] && inStage[prev[subtree[i]]])
+                    ring.push_back(subtree[i]);
+            if(ring.empty() || count + (int)ring.size() > maxStageJoints)
+                break;
+            for(i = 0; i < (int)ring.size(); ++i)
+                inStage[ring[i]] = true;
+            count += ring.size();
+        }
+    }
+
+    int out = stages.size();
+    stages.resize(out + 1);
+    vector<int> childRoots;
+    for(i = 0; i < (int)subtree.size(); ++i) {
+        if(inStage[subtree[i]])
+            stages[out].joints.push_back(subtree[i]);
+        else if(inStage[prev[subtree[i]]])
+            childRoots.push_back(subtree[i]);
+    }
+
+    stages[out].childRoots = childRoots;
+    for(i = 0; i < (int)childRoots.size(); ++i) {
+        int child = formStages(skeleton, childRoots[i], maxStageJoints, stages);
+        stages[out].children.push_back(child);
+    }
+
+    return out;
+}
+
+struct HP //information for hierarchical embedding
+{
+    FP *fp;
+    const vector<PenaltyFunction *> *penaltyFunctions;
+    const vector<vector<int> > *possibilities;
+    vector<EmbedStage> stages;
+};
+
+static const int stageAlternatives = 4; //embeddings tried or kept per stage
+
+//embeds a stage given the joints placed before it, then its child stages in parallel.
+//If some child stage cannot be embedded, the next best embedding of this stage is tried.
+//Leaf stages keep their alternatives for the final reconciliation.
+bool embedStage(HP *hp, int stageIdx, const PartialMatch &context)
+{
+    EmbedStage &stage = hp->stages[stageIdx];
+    stage.results = searchEmbedding(hp->fp, *(hp->penaltyFunctions), *(hp->possibilities), stage.joints,
+                                    stage.childRoots, context, stageAlternatives, false);
+    if(stage.children.empty())
+        return !stage.results.empty();
+
+    const vector<int> &children = stage.children;
+    for(int r = 0; r < (int)stage.results.size(); ++r) {
+        //the penalty budget of the search is per stage
+        PartialMatch next = stage.results[r];
+        next.placed = 0;
+        next.penalty = next.heuristic = 0.;
+
+        vector<char> success(children.size());
+        parallelFor(0, (int)children.size(), [&](int i) { success[i] = embedStage(hp, children[i], next); });
+        if(find(success.begin(), success.end(), false) == success.end()) {
+            stage.results = vector<PartialMatch>(1, stage.results[r]);
+            return true;
+        }
+    }
+    stage.results.clear();
+    return false;
+}
+
+//penalty of a complete match, accumulated joint by joint in the same order as the flat search
+double matchPenalty(FP *fp, const vector<PenaltyFunction *> &penaltyFunctions, const vector<int> &match)
+{
+    PartialMatch cur(fp->graph.verts.size(), match.size());
+    for(int idx = 0; idx < (int)match.size(); ++idx) {
+        cur.penalty += computePenalty(penaltyFunctions, cur, match[idx], idx);
+        cur.match[idx] = match[idx];
+        takePath(fp, cur, idx);
+    }
+    return cur.penalty;
+}
+
+vector<int> discreteEmbedHierarchical(const PtGraph &graph, const vector<Sphere> &spheres,
+                                      const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                                      int maxStageJoints)
+{
+    int i, j, k;
+    FP fp(graph, skeleton, spheres);
+
+    vector<PenaltyFunction *> penaltyFunctions = getPenaltyFunctions(&fp);
+
+    HP hp;
+    hp.fp = &fp;
+    hp.penaltyFunctions = &penaltyFunctions;
+    hp.possibilities = &possibilities;
+
+    int toMatch = skeleton.cGraph().verts.size();
+    formStages(skeleton, 0, max(1, maxStageJoints), hp.stages);
+    
+    Debugging::out() << "Matching in " << hp.stages.size() << " stages" << endl;
+
+    embedStage(&hp, 0, PartialMatch(graph.verts.size(), toMatch));
+
+    vector<int> out(toMatch, -1);
+    for(i = 0; i < (int)hp.stages.size(); ++i) {
+        const EmbedStage &stage = hp.stages[i];
+        if(stage.results.empty()) {
+            Debugging::out() << "No Match for stage " << i << endl;
+            out.clear();
+            break;
+        }
+        for(j = 0; j < (int)stage.joints.size(); ++j)
+            out[stage.joints[j]] = stage.results[0].match[stage.joints[j]];
+    }
+
+    if(out.size()) {
+        //the limbs did not see each other: re-pick among their alternatives
+        //against the full penalty, which includes symmetry and disjointness across limbs
+        //(only leaf stages have alternatives left)
+        double best = matchPenalty(&fp, penaltyFunctions, out);
+        for(int sweep = 0; sweep < 3; ++sweep) {
+            bool improved = false;
+            for(i = 0; i < (int)hp.stages.size(); ++i) {
+                const EmbedStage &stage = hp.stages[i];
+                for(k = 1; k < (int)stage.results.size(); ++k) {
+                    vector<int> trial = out;
+                    for(j = 0; j < (int)stage.joints.size(); ++j)
+                        trial[stage.joints[j]] = stage.results[k].match[stage.joints[j]];
+                    double penalty = matchPenalty(&fp, penaltyFunctions, trial);
+                    if(penalty < best) {
+                        best = penalty;
+                        out = trial;
+                        improved = true;
+                    }
+                }
+            }
+            if(!improved)
+                break;
+        }
+        Debugging::out() << "Found: residual = " << best << endl;
+    }
+
+    for(i = 0; i < (int)penaltyFunctions.size(); ++i)
+        delete penaltyFunctions[i];
+
+    return out;
+}
+
+double embeddingPenalty(const PtGraph &graph, const vector<Sphere> &spheres,
+                        const Skeleton &skeleton, const vector<int> &embeddingIndices)
+{
+    FP fp(graph, skeleton, spheres);
+    vector<PenaltyFunction *> penaltyFunctions = getPenaltyFunctions(&fp);
+
+    double out = matchPenalty(&fp, penaltyFunctions, embeddingIndices);
+
+    for(int i = 0; i < (int)penaltyFunctions.size(); ++i)
+        delete penaltyFunctions[i];
+
+    return out;
+}
+
+//-------------------------------------------------Warm start---------------------------------
+
+vector<vector<int> > warmStartPossibilities(const PtGraph &graph, const Skeleton &skeleton,
+                                            const vector<vector<int> > &possibilities,
+                                            const vector<Pinocchio::Vector3> &previousEmbedding, int candidates)
+{
+    int i, j;
+    vector<vector<int> > out(possibilities.size());
+
+    if(previousEmbedding.size() != skeleton.fGraph().verts.size()) {
+        Debugging::out() << "Warm start embedding has wrong size" << endl;
+        return possibilities;
+    }
+
+    for(i = 0; i < (int)possibilities.size(); ++i) {
+        const Pinocchio::Vector3 &prev = previousEmbedding[skeleton.cfMap()[i]];
+
+        vector<pair<double, int> > byDist(possibilities[i].size());
+        for(j = 0; j < (int)possibilities[i].size(); ++j)
+            byDist[j] = make_pair((graph.verts[possibilities[i][j]] - prev).lengthsq(), possibilities[i][j]);
+
+        int num = min(candidates, (int)byDist.size());
+        partial_sort(byDist.begin(), byDist.begin() + num, byDist.end());
+        for(j = 0; j < num; ++j)
+            out[i].push_back(byDist[j].second);
+    }
+
+    return out;
+}
+
+vector<int> discreteEmbedWarm(const PtGraph &graph, const vector<Sphere> &spheres,
+                              const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                              const vector<Pinocchio::Vector3> &previousEmbedding, double maxPenalty, int candidates)
+{
+    bool hierarchical = (int)skeleton.cGraph().verts.size() > hierarchicalEmbedJoints;
+
+    vector<vector<int> > pruned = warmStartPossibilities(graph, skeleton, possibilities, previousEmbedding, candidates);
+
+    Debugging::out() << "Warm start with " << candidates << " candidates per joint" << endl;
+    vector<int> out = hierarchical ? discreteEmbedHierarchical(graph, spheres, skeleton, pruned)
+                                   : discreteEmbed(graph, spheres, skeleton, pruned);
+
+    if(out.size() > 0) {
+        double penalty = embeddingPenalty(graph, spheres, skeleton, out);
+        if(penalty <= maxPenalty)
+            return out;
+        Debugging::out() << "Warm start residual " << penalty << " is above " << maxPenalty << endl;
+    }
+
+    Debugging::out() << "Falling back to full search" << endl;
+    return hierarchical ? discreteEmbedHierarchical(graph, spheres, skeleton, possibilities)
+                        : discreteEmbed(graph, spheres, skeleton, possibilities);
 }
 
 vector<Pinocchio::Vector3> splitPath(FP *fp, int joint, int curIdx, int prevIdx)
@@ -324,12 +624,9 @@ public:
     }
 };
 
-vector<Pinocchio::Vector3> computeDirs(FP * fp, const PartialMatch &cur, int next, int idx = -1)
+vector<Pinocchio::Vector3> computeDirs(FP * fp, const PartialMatch &cur, int next, int idx)
 {
     vector<Pinocchio::Vector3> out;
-    if(idx == -1)
-        idx = cur.match.size();
-    
     int prev = fp->given.cPrev()[idx];
 
     if(idx == 0 || next == cur.match[prev]) //path of zero length
@@ -409,7 +706,7 @@ public:
     double get(const PartialMatch &cur, int next, int idx) const
     {
         int prev = fp->given.cPrev()[idx];
-        if(fp->given.cSym()[idx] < 0 || fp->given.cSym()[idx] >= (int)cur.match.size())
+        if(fp->given.cSym()[idx] < 0 || cur.match[fp->given.cSym()[idx]] < 0)
             return 0.; //doesn't apply here
 
         double dist = fp->paths.dist(next, cur.match[prev]);
@@ -438,6 +735,8 @@ public:
         int prev = fp->given.cPrev()[idx];
         double out = 0;
         for(int i = 0; i < (int)cur.match.size(); ++i) {
+            if(cur.match[i] < 0)
+                continue;
             if(i != prev && fp->given.cPrev()[i] != prev)
                     continue;
             if((fp->graph.verts[next] - fp->graph.verts[cur.match[i]]).lengthsq() < 1e-16)
@@ -551,7 +850,7 @@ public:
         double out = 0.;
 
         for(int i = 0; i < (int)cur.match.size(); ++i) {
-            if(i == idx || i == prev)
+            if(i == idx || i == prev || cur.match[i] < 0)
                 continue;
             
             //compute LCA of idx and i
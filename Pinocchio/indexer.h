@@ -102,13 +102,16 @@ class ArrayIndexer
 public:
     typedef typename Node::Vec Vec;
 
-    ArrayIndexer() : root(NULL) {}
+    ArrayIndexer() : root(NULL), mirrorX(false) {}
 
     void setRoot(Node *n) 
     {
         root = n;
     } 
 
+    //if set, points with x < 0.5 are located in the x > 0.5 half at their mirror image
+    void setMirrorX(bool mirror) { mirrorX = mirror; }
+
     static const int bits = 16 - (16 % Dim);
 
     void preprocessIndex()
@@ -128,7 +131,14 @@ public:
 
     Node *locate(const Vec &v) const
     {
-        unsigned int idx = _lookup(v);
+        unsigned int idx;
+        if(mirrorX && v[0] < 0.5) {
+            Vec mirrored = v;
+            mirrored[0] = 1. - v[0];
+            idx = _lookup(mirrored);
+        }
+        else
+            idx = _lookup(v);
         Node *out = table[idx & ((1 << bits) - 1)];
         if(!out->getChild(0))
             return out;
@@ -142,6 +152,7 @@ public:
     }
 private:
     Node *root;
+    bool mirrorX;
     Node *table[(1 << bits)];
 };
 
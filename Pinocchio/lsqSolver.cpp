@@ -16,13 +16,546 @@
     Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
 */
 
+#ifdef EIGEN //ahead of mathutils.h, whose min and max macros break Eigen
+#include <Eigen/SparseCholesky>
+#endif
+
 #include "lsqSolver.h"
 
 #include <queue>
 #include <set>
 #include <iostream>
+#include <chrono>
 #include "hashutils.h"
 #include "debugging.h"
+#include "parallel.h"
+
+bool LLTMatrix::solveMany(vector<vector<double> > &bs) const
+{
+    for(int i = 0; i < (int)bs.size(); ++i) //not every factorization can be solved concurrently
+        if(!solve(bs[i]))
+            return false;
+    return true;
+}
+
+bool SymbolicLLT::matches(const SPDMatrix &matrix) const
+{
+    const vector<vector<pair<int, double> > > &m = matrix.m;
+    if(inputStart.size() != m.size() + 1)
+        return false;
+    for(int i = 0; i < (int)m.size(); ++i) {
+        if(inputStart[i + 1] - inputStart[i] != (int)m[i].size())
+            return false;
+        for(int j = 0; j < (int)m[i].size(); ++j)
+            if(inputCols[inputStart[i] + j] != m[i][j].first)
+                return false;
+    }
+    return true;
+}
+
+shared_ptr<const SymbolicLLT> SymbolicCache::get(unsigned long long key, const SPDMatrix &matrix)
+{
+    int i;
+    {
+        lock_guard<mutex> guard(lock);
+        for(i = 0; i < (int)entries.size(); ++i) {
+            if(entries[i].key == key && entries[i].symbolic->matches(matrix)) {
+                ++hitCount;
+                entries[i].lastUse = ++clock;
+                return entries[i].symbolic;
+            }
+        }
+        ++missCount;
+    }
+
+    //analyze without holding the lock, so other patterns are not held up
+    shared_ptr<const SymbolicLLT> out(new SymbolicLLT(matrix.analyze()));
+
+    lock_guard<mutex> guard(lock);
+    if(cap <= 0)
+        return out;
+    int victim = -1;
+    for(i = 0; i < (int)entries.size() && victim < 0; ++i)
+        if(entries[i].key == key) //stale, or another thread just put it in
+            victim = i;
+    if(victim < 0 && (int)entries.size() < cap) {
+        victim = entries.size();
+        entries.push_back(Entry());
+    }
+    if(victim < 0) { //drop the least recently used
+        victim = 0;
+        for(i = 1; i < (int)entries.size(); ++i)
+            if(entries[i].lastUse < entries[victim].lastUse)
+                victim = i;
+    }
+    entries[victim].key = key;
+    entries[victim].symbolic = out;
+    entries[victim].lastUse = ++clock;
+    return out;
+}
+
+void SymbolicCache::setCapacity(int inCapacity)
+{
+    lock_guard<mutex> guard(lock);
+    cap = inCapacity;
+    while((int)entries.size() > max(cap, 0)) { //drop the least recently used
+        int victim = 0;
+        for(int i = 1; i < (int)entries.size(); ++i)
+            if(entries[i].lastUse < entries[victim].lastUse)
+                victim = i;
+        entries.erase(entries.begin() + victim);
+    }
+}
+
+void SymbolicCache::clear()
+{
+    lock_guard<mutex> guard(lock);
+    entries.clear();
+    hitCount = missCount = 0;
+}
+
+int SymbolicCache::size() const
+{
+    lock_guard<mutex> guard(lock);
+    return entries.size();
+}
+
+class PCGMatrix : public LLTMatrix
+{
+public:
+    bool solve(vector<double> &b) const;
+    bool solveMany(vector<vector<double> > &bs) const;
+    int size() const { return (int)start.size() - 1; }
+
+private:
+    static const int chainSize = 8; //right hand sides solved in sequence, warm starting each other
+
+    bool solve(vector<double> &b, const vector<double> *guess) const;
+    void multiply(const vector<double> &x, vector<double> &out) const;
+    void precondition(const vector<double> &r, vector<double> &out) const;
+
+    vector<int> start, cols; //the whole matrix by rows
+    vector<double> values;
+    vector<int> lowerStart, lowerCols; //incomplete cholesky factor by rows, without the diagonal
+    vector<double> lower, diag; //if lower is empty, diag has the inverse diagonal for Jacobi
+    double tolerance;
+
+    friend class SPDMatrix;
+};
+
+LLTMatrix *SPDMatrix::iterativeSolver(double tolerance, Preconditioner preconditioner) const
+{
+    int i, j, k;
+    int sz = m.size();
+    PCGMatrix *out = new PCGMatrix();
+    out->tolerance = tolerance;
+
+    //symmetric matrix from the lower triangle
+    out->start.assign(sz + 1, 0);
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)m[i].size(); ++j) {
+        ++out->start[i + 1];
+        if(m[i][j].first != i)
+            ++out->start[m[i][j].first + 1];
+    }
+    for(i = 0; i < sz; ++i)
+        out->start[i + 1] += out->start[i];
+    out->cols.resize(out->start[sz]);
+    out->values.resize(out->start[sz]);
+    vector<int> fill(out->start.begin(), out->start.end() - 1);
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)m[i].size(); ++j) { //rows come out sorted
+        int col = m[i][j].first;
+        out->cols[fill[i]] = col;
+        out->values[fill[i]++] = m[i][j].second;
+        if(col != i) {
+            out->cols[fill[col]] = i;
+            out->values[fill[col]++] = m[i][j].second;
+        }
+    }
+
+    if(preconditioner == incompleteCholeskyPreconditioner) {
+        //cholesky restricted to the pattern of the lower triangle
+        out->lowerStart.assign(sz + 1, 0);
+        out->diag.resize(sz);
+        vector<double> row(sz, 0.);
+        for(i = 0; i < sz; ++i) {
+            int rowBegin = out->lowerCols.size();
+            for(j = 0; j < (int)m[i].size() - 1; ++j) {
+                int col = m[i][j].first;
+                double val = m[i][j].second;
+                for(k = out->lowerStart[col]; k < out->lowerStart[col + 1]; ++k)
+                    val -= row[out->lowerCols[k]] * out->lower[k];
+                val /= out->diag[col];
+                row[col] = val;
+                out->lowerCols.push_back(col);
+                out->lower.push_back(val);
+            }
+            double d = m[i].back().second;
+            for(k = rowBegin; k < (int)out->lowerCols.size(); ++k) {
+                d -= SQR(out->lower[k]);
+                row[out->lowerCols[k]] = 0.;
+            }
+            out->lowerStart[i + 1] = out->lowerCols.size();
+            if(d <= 0.) {
+                Debugging::out() << "Incomplete cholesky broke down, using Jacobi" << endl;
+                out->diag.clear();
+                break;
+            }
+            out->diag[i] = sqrt(d);
+        }
+        if(out->diag.empty())
+            preconditioner = jacobiPreconditioner;
+    }
+
+    if(preconditioner == jacobiPreconditioner) {
+        out->lowerStart.clear();
+        out->lowerCols.clear();
+        out->lower.clear();
+        out->diag.resize(sz);
+        for(i = 0; i < sz; ++i)
+            out->diag[i] = 1. / m[i].back().second;
+    }
+
+    return out;
+}
+
+void PCGMatrix::multiply(const vector<double> &x, vector<double> &out) const
+{
+    for(int i = 0; i < size(); ++i) {
+        double sum = 0.;
+        for(int j = start[i]; j < start[i + 1]; ++j)
+            sum += values[j] * x[cols[j]];
+        out[i] = sum;
+    }
+}
+
+void PCGMatrix::precondition(const vector<double> &r, vector<double> &out) const
+{
+    int i, j;
+    int sz = size();
+
+    if(lower.empty()) { //Jacobi
+        for(i = 0; i < sz; ++i)
+            out[i] = r[i] * diag[i];
+        return;
+    }
+
+    for(i = 0; i < sz; ++i) { //L y = r
+        double val = r[i];
+        for(j = lowerStart[i]; j < lowerStart[i + 1]; ++j)
+            val -= lower[j] * out[lowerCols[j]];
+        out[i] = val / diag[i];
+    }
+    for(i = sz - 1; i >= 0; --i) { //L^T x = y
+        out[i] /= diag[i];
+        for(j = lowerStart[i]; j < lowerStart[i + 1]; ++j)
+            out[lowerCols[j]] -= lower[j] * out[i];
+    }
+}
+
+bool PCGMatrix::solve(vector<double> &b) const
+{
+    return solve(b, NULL);
+}
+
+bool PCGMatrix::solve(vector<double> &b, const vector<double> *guess) const
+{
+    int i;
+    int sz = size();
+    if((int)b.size() != sz)
+        return false;
+
+    double bNorm = 0.;
+    for(i = 0; i < sz; ++i)
+        bNorm += SQR(b[i]);
+    if(bNorm == 0.) //x = 0
+        return true;
+
+    vector<double> x(sz, 0.), r = b, z(sz), p(sz), ap(sz);
+    double rNorm = bNorm;
+    if(guess) { //use it if it has the smaller residual
+        multiply(*guess, ap);
+        double gNorm = 0.;
+        for(i = 0; i < sz; ++i)
+            gNorm += SQR(b[i] - ap[i]);
+        if(gNorm < bNorm) {
+            x = *guess;
+            for(i = 0; i < sz; ++i)
+                r[i] = b[i] - ap[i];
+            rNorm = gNorm;
+        }
+    }
+
+    double stop = SQR(tolerance) * bNorm;
+    precondition(r, z);
+    p = z;
+    double rz = 0.;
+    for(i = 0; i < sz; ++i)
+        rz += r[i] * z[i];
+
+    int iter;
+    for(iter = 0; iter < maxSolverIterations && rNorm > stop; ++iter) {
+        multiply(p, ap);
+        double pap = 0.;
+        for(i = 0; i < sz; ++i)
+            pap += p[i] * ap[i];
+        double alpha = rz / pap;
+        rNorm = 0.;
+        for(i = 0; i < sz; ++i) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * ap[i];
+            rNorm += SQR(r[i]);
+        }
+        precondition(r, z);
+        double rzNew = 0.;
+        for(i = 0; i < sz; ++i)
+            rzNew += r[i] * z[i];
+        double beta = rzNew / rz;
+        rz = rzNew;
+        for(i = 0; i < sz; ++i)
+            p[i] = z[i] + beta * p[i];
+    }
+
+    b.swap(x);
+    if(rNorm > stop) {
+        Debugging::out() << "Conjugate gradients did not converge: residual " << sqrt(rNorm / bNorm) << endl;
+        return false;
+    }
+    return true;
+}
+
+bool PCGMatrix::solveMany(vector<vector<double> > &bs) const
+{
+    //chains of a fixed length, so the result does not depend on the number of threads
+    int chains = (bs.size() + chainSize - 1) / chainSize;
+    vector<char> ok(chains, true);
+    parallelFor(0, chains, [&](int chain) {
+        int end = min((chain + 1) * chainSize, (int)bs.size());
+        for(int i = chain * chainSize; i < end; ++i)
+            ok[chain] = solve(bs[i], i == chain * chainSize ? NULL : &bs[i - 1]) && ok[chain];
+    });
+
+    for(int i = 0; i < chains; ++i)
+        if(!ok[i])
+            return false;
+    return true;
+}
+
+void SPDMatrix::multiply(const vector<double> &x, vector<double> &out) const
+{
+    out.assign(m.size(), 0.);
+    for(int i = 0; i < (int)m.size(); ++i) for(int j = 0; j < (int)m[i].size(); ++j) {
+        int col = m[i][j].first;
+        out[i] += m[i][j].second * x[col];
+        if(col != i)
+            out[col] += m[i][j].second * x[i];
+    }
+}
+
+class BuiltinBackend : public SolverBackend
+{
+public:
+    LLTMatrix *factor(const SPDMatrix &matrix, SymbolicLLT *symbolic) const
+    {
+        if(symbolic == NULL)
+            return matrix.factor();
+        if(!symbolic->matches(matrix))
+            *symbolic = matrix.analyze();
+        return matrix.factor(*symbolic);
+    }
+};
+
+class IterativeBackend : public SolverBackend
+{
+public:
+    LLTMatrix *factor(const SPDMatrix &matrix, SymbolicLLT *) const { return matrix.iterativeSolver(); }
+};
+
+#ifdef EIGEN
+class EigenLDLTMatrix : public LLTMatrix
+{
+public:
+    bool solve(vector<double> &b) const
+    {
+        if((int)b.size() != size())
+            return false;
+        Eigen::Map<Eigen::VectorXd> x(b.data(), b.size());
+        x = Eigen::VectorXd(ldlt.solve(x));
+        return true;
+    }
+
+    bool solveMany(vector<vector<double> > &bs) const
+    {
+        int i;
+        for(i = 0; i < (int)bs.size(); ++i)
+            if((int)bs[i].size() != size())
+                return false;
+
+        //Eigen substitutes a block of right hand sides together; solving does not modify the factor
+        int blocks = (bs.size() + blockSize - 1) / blockSize;
+        parallelFor(0, blocks, [&](int block) {
+            int r, begin = block * blockSize, end = min((block + 1) * blockSize, (int)bs.size());
+            Eigen::MatrixXd x(size(), end - begin);
+            for(r = begin; r < end; ++r)
+                x.col(r - begin) = Eigen::Map<const Eigen::VectorXd>(bs[r].data(), size());
+            x = ldlt.solve(x).eval();
+            for(r = begin; r < end; ++r)
+                Eigen::Map<Eigen::VectorXd>(bs[r].data(), size()) = x.col(r - begin);
+        });
+        return true;
+    }
+
+    int size() const { return (int)ldlt.rows(); }
+
+private:
+    static const int blockSize = 8; //right hand sides solved together
+
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double>, Eigen::Lower> ldlt;
+
+    friend class EigenBackend;
+};
+
+class EigenBackend : public SolverBackend
+{
+public:
+    LLTMatrix *factor(const SPDMatrix &matrix, SymbolicLLT *) const
+    {
+        const vector<vector<pair<int, double> > > &m = matrix.rows();
+        int sz = m.size();
+        vector<Eigen::Triplet<double> > entries;
+        for(int i = 0; i < sz; ++i) for(int j = 0; j < (int)m[i].size(); ++j)
+            entries.push_back(Eigen::Triplet<double>(i, m[i][j].first, m[i][j].second));
+        Eigen::SparseMatrix<double> lower(sz, sz);
+        lower.setFromTriplets(entries.begin(), entries.end());
+
+        EigenLDLTMatrix *out = new EigenLDLTMatrix();
+        out->ldlt.compute(lower);
+        if(out->ldlt.info() != Eigen::Success) {
+            Debugging::out() << "Eigen could not factor the matrix" << endl;
+            delete out;
+            return NULL;
+        }
+        return out;
+    }
+};
+#endif //EIGEN
+
+struct SolverRegistry
+{
+    SolverRegistry()
+    {
+        backends["builtin"] = new BuiltinBackend();
+        backends["iterative"] = new IterativeBackend();
+#ifdef EIGEN
+        backends["eigen"] = new EigenBackend();
+#endif
+    }
+
+    ~SolverRegistry()
+    {
+        for(map<string, SolverBackend *>::iterator it = backends.begin(); it != backends.end(); ++it)
+            delete it->second;
+    }
+
+    mutex lock;
+    map<string, SolverBackend *> backends;
+    string defaultName;
+};
+
+static SolverRegistry &solverRegistry()
+{
+    static SolverRegistry registry;
+    return registry;
+}
+
+void registerSolverBackend(const string &name, SolverBackend *backend)
+{
+    SolverRegistry &registry = solverRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    SolverBackend *&cur = registry.backends[name];
+    if(cur && cur != backend)
+        delete cur;
+    cur = backend;
+}
+
+const SolverBackend *getSolverBackend(const string &name)
+{
+    SolverRegistry &registry = solverRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    map<string, SolverBackend *>::const_iterator it = registry.backends.find(name);
+    return it == registry.backends.end() ? NULL : it->second;
+}
+
+vector<string> solverBackendNames()
+{
+    SolverRegistry &registry = solverRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    vector<string> out;
+    for(map<string, SolverBackend *>::const_iterator it = registry.backends.begin(); it != registry.backends.end(); ++it)
+        out.push_back(it->first);
+    return out;
+}
+
+bool setDefaultSolverBackend(const string &name)
+{
+    SolverRegistry &registry = solverRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    if(!name.empty() && registry.backends.count(name) == 0)
+        return false;
+    registry.defaultName = name;
+    return true;
+}
+
+string defaultSolverBackend()
+{
+    SolverRegistry &registry = solverRegistry();
+    lock_guard<mutex> guard(registry.lock);
+    return registry.defaultName;
+}
+
+static double secondsSince(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+vector<SolverBenchmark> benchmarkSolverBackends(const SPDMatrix &matrix, const vector<vector<double> > &rhs)
+{
+    int i, j, k;
+    vector<string> names = solverBackendNames();
+    vector<SolverBenchmark> out(names.size());
+
+    for(i = 0; i < (int)names.size(); ++i) {
+        out[i].backend = names[i];
+        const SolverBackend *backend = getSolverBackend(names[i]);
+
+        chrono::steady_clock::time_point start = chrono::steady_clock::now();
+        LLTMatrix *factored = backend->factor(matrix);
+        out[i].factorTime = secondsSince(start);
+        if(factored == NULL)
+            continue;
+
+        vector<vector<double> > x = rhs;
+        start = chrono::steady_clock::now();
+        out[i].ok = factored->solveMany(x);
+        out[i].solveTime = secondsSince(start);
+        delete factored;
+        if(!out[i].ok)
+            continue;
+
+        vector<double> ax;
+        for(j = 0; j < (int)rhs.size(); ++j) {
+            matrix.multiply(x[j], ax);
+            double err = 0., norm = 0.;
+            for(k = 0; k < (int)ax.size(); ++k) {
+                err += SQR(ax[k] - rhs[j][k]);
+                norm += SQR(rhs[j][k]);
+            }
+            if(norm > 0.)
+                out[i].residual = max(out[i].residual, sqrt(err / norm));
+        }
+    }
+
+    return out;
+}
 
 #ifdef TAUCS //TAUCS
 
@@ -71,6 +604,16 @@ private:
     friend class SPDMatrix;
 };
 
+SymbolicLLT SPDMatrix::analyze() const
+{
+    return SymbolicLLT(); //TAUCS does its own analysis
+}
+
+LLTMatrix *SPDMatrix::factor(const SymbolicLLT &) const
+{
+    return factor();
+}
+
 LLTMatrix *SPDMatrix::factor() const
 {
     //taucs_logfile("stdout");
@@ -125,19 +668,371 @@ class MyLLTMatrix : public LLTMatrix
 {
 public:
     bool solve(vector<double> &b) const; //solves it in place
-    int size() const { return m.size(); }
+    bool solveMany(vector<vector<double> > &bs) const;
+    int size() const { return perm.size(); }
 
 private:
-    void initMt();
-    vector<vector<pair<int, double> > > m; //off-diagonal values stored by rows
-    vector<vector<pair<int, double> > > mt; //off-diagonal values transposed stored by rows
-    vector<double> diag; //values on diagonal
+    static const int blockSize = 8; //right hand sides substituted together
+
+    void solveBlock(vector<vector<double> > &bs, int begin, int end) const;
+    void substitute(double *x, int nb, int first) const;
+
+    //the factor in supernodal column storage: the columns of supernode s are a dense column major
+    //block of values starting at superValueStart[s], with rows superRows[superRowStart[s]] ...
+    vector<int> superStart, superRowStart, superRows;
+    vector<size_t> superValueStart;
+    vector<double> values;
     vector<int> perm; //permutation
 
     friend class SPDMatrix;
 };
 
 
+//Approximate minimum degree ordering (Amestoy, Davis and Duff) of the graph given as adjacency lists
+//(start[i] .. start[i + 1] - 1 index into adj).  Works on the quotient graph: an eliminated vertex
+//becomes an element that stands for the clique among its neighbors instead of forming the clique,
+//so the storage never grows.  Degrees are upper bounds computed from the elements, and vertices
+//that become indistinguishable are merged into supervariables and eliminated together.
+//Returns the elimination order.
+static vector<int> approximateMinimumDegree(const vector<int> &start, const vector<int> &adj)
+{
+    int i, j, k;
+    int sz = start.size() - 1;
+    vector<int> order;
+    order.reserve(sz);
+
+    enum { variable, element, absorbed, merged };
+    vector<char> status(sz, variable);
+    vector<int> weight(sz, 1); //supervariable sizes, 0 if not principal
+    vector<vector<int> > vars(sz), elems(sz); //adjacent variables and elements of the variables
+    vector<vector<int> > members(sz); //variables of the elements, once they are elements
+    vector<vector<int> > followers(sz); //variables merged into a principal one
+    vector<int> degree(sz);
+
+    for(i = 0; i < sz; ++i) {
+        vars[i].assign(adj.begin() + start[i], adj.begin() + start[i + 1]);
+        degree[i] = vars[i].size();
+    }
+
+    //degree lists
+    vector<int> head(sz + 1, -1), next(sz, -1), prev(sz, -1);
+    int minDegree = 0;
+    auto insert = [&](int v) {
+        int d = degree[v];
+        prev[v] = -1;
+        next[v] = head[d];
+        if(head[d] != -1)
+            prev[head[d]] = v;
+        head[d] = v;
+        minDegree = min(minDegree, d);
+    };
+    auto remove = [&](int v) {
+        if(prev[v] != -1)
+            next[prev[v]] = next[v];
+        else
+            head[degree[v]] = next[v];
+        if(next[v] != -1)
+            prev[next[v]] = prev[v];
+    };
+    for(i = 0; i < sz; ++i)
+        insert(i);
+
+    vector<int> mark(sz, -1), wMark(sz, -1), w(sz);
+    int stamp = 0, remaining = sz;
+    while(remaining > 0) {
+        //pick the pivot
+        while(head[minDegree] == -1)
+            ++minDegree;
+        int p = head[minDegree];
+        remove(p);
+
+        order.push_back(p);
+        for(i = 0; i < (int)followers[p].size(); ++i)
+            order.push_back(followers[p][i]);
+        vector<int>().swap(followers[p]);
+        remaining -= weight[p];
+
+        //the new element: all the variables adjacent to p or to its elements
+        ++stamp;
+        mark[p] = stamp;
+        vector<int> &lp = members[p];
+        int lpWeight = 0;
+        for(i = 0; i < (int)vars[p].size(); ++i) {
+            int v = vars[p][i];
+            if(status[v] == variable && mark[v] != stamp) {
+                mark[v] = stamp;
+                lp.push_back(v);
+                lpWeight += weight[v];
+            }
+        }
+        for(i = 0; i < (int)elems[p].size(); ++i) {
+            int e = elems[p][i];
+            if(status[e] != element)
+                continue;
+            for(j = 0; j < (int)members[e].size(); ++j) {
+                int v = members[e][j];
+                if(status[v] == variable && mark[v] != stamp) {
+                    mark[v] = stamp;
+                    lp.push_back(v);
+                    lpWeight += weight[v];
+                }
+            }
+            status[e] = absorbed; //p's element covers it
+            vector<int>().swap(members[e]);
+        }
+        status[p] = element;
+        vector<int>().swap(vars[p]);
+        vector<int>().swap(elems[p]);
+
+        //w[e] = weight of the variables of element e outside the new element
+        for(i = 0; i < (int)lp.size(); ++i) {
+            int v = lp[i];
+            remove(v);
+            for(j = 0; j < (int)elems[v].size(); ++j) {
+                int e = elems[v][j];
+                if(status[e] != element)
+                    continue;
+                if(wMark[e] != stamp) {
+                    wMark[e] = stamp;
+                    int outside = 0, kept = 0;
+                    for(k = 0; k < (int)members[e].size(); ++k) { //prune eliminated and merged variables
+                        int u = members[e][k];
+                        if(status[u] == variable) {
+                            members[e][kept++] = u;
+                            outside += weight[u];
+                        }
+                    }
+                    members[e].resize(kept);
+                    w[e] = outside;
+                }
+                w[e] -= weight[v];
+            }
+        }
+
+        //prune the adjacency of the new element's variables and bound their degrees
+        for(i = 0; i < (int)lp.size(); ++i) {
+            int v = lp[i];
+            int elemDegree = 0, varDegree = 0, kept = 0;
+            for(j = 0; j < (int)elems[v].size(); ++j) {
+                int e = elems[v][j];
+                if(status[e] != element)
+                    continue;
+                if(w[e] == 0) { //aggressive absorption--all its variables are in the new element
+                    status[e] = absorbed;
+                    vector<int>().swap(members[e]);
+                    continue;
+                }
+                elems[v][kept++] = e;
+                elemDegree += w[e];
+            }
+            elems[v].resize(kept);
+            elems[v].push_back(p);
+
+            kept = 0;
+            for(j = 0; j < (int)vars[v].size(); ++j) {
+                int u = vars[v][j];
+                if(status[u] != variable || mark[u] == stamp) //covered by the new element
+                    continue;
+                vars[v][kept++] = u;
+                varDegree += weight[u];
+            }
+            vars[v].resize(kept);
+
+            int external = lpWeight - weight[v];
+            degree[v] = min(remaining - weight[v], min(degree[v] + external, varDegree + elemDegree + external));
+        }
+
+        //find indistinguishable variables by hashing their adjacency, and merge them
+        vector<pair<unsigned int, int> > hashes(lp.size());
+        for(i = 0; i < (int)lp.size(); ++i) {
+            int v = lp[i];
+            unsigned int h = 0;
+            for(j = 0; j < (int)elems[v].size(); ++j)
+                h += elems[v][j];
+            for(j = 0; j < (int)vars[v].size(); ++j)
+                h += vars[v][j];
+            hashes[i] = make_pair(h, v);
+        }
+        sort(hashes.begin(), hashes.end());
+        for(i = 0; i < (int)hashes.size(); ++i) {
+            int v = hashes[i].second;
+            if(status[v] != variable)
+                continue;
+            bool marked = false;
+            for(j = i + 1; j < (int)hashes.size() && hashes[j].first == hashes[i].first; ++j) {
+                int u = hashes[j].second;
+                if(status[u] != variable || elems[u].size() != elems[v].size() || vars[u].size() != vars[v].size())
+                    continue;
+                if(!marked) {
+                    ++stamp;
+                    for(k = 0; k < (int)elems[v].size(); ++k)
+                        mark[elems[v][k]] = stamp;
+                    for(k = 0; k < (int)vars[v].size(); ++k)
+                        mark[vars[v][k]] = stamp;
+                    marked = true;
+                }
+                bool same = true;
+                for(k = 0; same && k < (int)elems[u].size(); ++k)
+                    same = (mark[elems[u][k]] == stamp);
+                for(k = 0; same && k < (int)vars[u].size(); ++k)
+                    same = (mark[vars[u][k]] == stamp);
+                if(!same)
+                    continue;
+
+                //u joins v
+                degree[v] -= weight[u];
+                weight[v] += weight[u];
+                weight[u] = 0;
+                status[u] = merged;
+                followers[v].push_back(u);
+                followers[v].insert(followers[v].end(), followers[u].begin(), followers[u].end());
+                vector<int>().swap(followers[u]);
+                vector<int>().swap(vars[u]);
+                vector<int>().swap(elems[u]);
+            }
+        }
+
+        int kept = 0;
+        for(i = 0; i < (int)lp.size(); ++i) {
+            int v = lp[i];
+            if(status[v] != variable)
+                continue;
+            lp[kept++] = v;
+            degree[v] = max(0, degree[v]);
+            insert(v);
+        }
+        lp.resize(kept);
+    }
+
+    return order;
+}
+
+//Nested dissection: splits the graph with a separator from a breadth first level structure, orders
+//the two halves recursively and the separator last.  Pieces below leafSize are ordered by
+//approximate minimum degree.  Returns the elimination order.
+static vector<int> nestedDissection(const vector<int> &start, const vector<int> &adj)
+{
+    static const int leafSize = 256;
+    int i, j;
+    int sz = start.size() - 1;
+    vector<int> order;
+    order.reserve(sz);
+
+    vector<int> region(sz, 0), level(sz, -1), local(sz, -1);
+    int regions = 1;
+
+    //breadth first search within the region, returns the visited vertices in order
+    auto bfs = [&](int root, vector<int> &visited) {
+        visited.clear();
+        visited.push_back(root);
+        level[root] = 0;
+        for(int q = 0; q < (int)visited.size(); ++q) {
+            int cur = visited[q];
+            for(int k = start[cur]; k < start[cur + 1]; ++k) {
+                int nb = adj[k];
+                if(region[nb] == region[root] && level[nb] == -1) {
+                    level[nb] = level[cur] + 1;
+                    visited.push_back(nb);
+                }
+            }
+        }
+    };
+
+    //orders a piece by minimum degree on its induced graph
+    auto orderLeaf = [&](const vector<int> &nodes) {
+        for(int q = 0; q < (int)nodes.size(); ++q)
+            local[nodes[q]] = q;
+        vector<int> lstart(1, 0), ladj;
+        for(int q = 0; q < (int)nodes.size(); ++q) {
+            int cur = nodes[q];
+            for(int k = start[cur]; k < start[cur + 1]; ++k)
+                if(region[adj[k]] == region[cur])
+                    ladj.push_back(local[adj[k]]);
+            lstart.push_back(ladj.size());
+        }
+        vector<int> lorder = approximateMinimumDegree(lstart, ladj);
+        for(int q = 0; q < (int)lorder.size(); ++q)
+            order.push_back(nodes[lorder[q]]);
+    };
+
+    //recursion with an explicit stack of pieces.  A separator goes on the stack below its two
+    //pieces, flagged, so it is emitted once both pieces are ordered.
+    vector<pair<vector<int>, bool> > stack(1, make_pair(vector<int>(sz), false));
+    for(i = 0; i < sz; ++i)
+        stack[0].first[i] = i;
+    vector<int> visited, visited2;
+    while(!stack.empty()) {
+        if(stack.back().second) { //a separator whose pieces are done
+            order.insert(order.end(), stack.back().first.begin(), stack.back().first.end());
+            stack.pop_back();
+            continue;
+        }
+        vector<int> nodes;
+        nodes.swap(stack.back().first);
+        stack.pop_back();
+        if(nodes.empty())
+            continue;
+
+        int id = regions++;
+        for(i = 0; i < (int)nodes.size(); ++i)
+            region[nodes[i]] = id;
+
+        if((int)nodes.size() <= leafSize) {
+            orderLeaf(nodes);
+            continue;
+        }
+
+        //level structure from a pseudo-peripheral vertex
+        bfs(nodes[0], visited);
+        for(i = 0; i < (int)visited.size(); ++i)
+            level[visited[i]] = -1;
+        if(visited.size() < nodes.size()) { //disconnected--split off the component
+            for(i = 0; i < (int)visited.size(); ++i)
+                region[visited[i]] = regions;
+            ++regions;
+            vector<int> rest;
+            for(i = 0; i < (int)nodes.size(); ++i)
+                if(region[nodes[i]] == id)
+                    rest.push_back(nodes[i]);
+            stack.push_back(make_pair(rest, false));
+            stack.push_back(make_pair(visited, false));
+            continue;
+        }
+        bfs(visited.back(), visited2);
+
+        //separator: the vertices of the median level that touch the next level
+        int mid = level[visited2[visited2.size() / 2]];
+        vector<int> sep, part1, part2;
+        for(i = 0; i < (int)visited2.size(); ++i) {
+            int cur = visited2[i];
+            if(level[cur] < mid)
+                part1.push_back(cur);
+            else if(level[cur] > mid)
+                part2.push_back(cur);
+            else {
+                bool touches = false;
+                for(j = start[cur]; j < start[cur + 1]; ++j)
+                    if(region[adj[j]] == id && level[adj[j]] == mid + 1)
+                        touches = true;
+                (touches ? sep : part1).push_back(cur);
+            }
+        }
+        for(i = 0; i < (int)visited2.size(); ++i)
+            level[visited2[i]] = -1;
+
+        if(sep.empty() || part1.empty() || part2.empty()) { //could not split
+            orderLeaf(nodes);
+            continue;
+        }
+
+        stack.push_back(make_pair(sep, true));
+        stack.push_back(make_pair(part2, false));
+        stack.push_back(make_pair(part1, false));
+    }
+
+    return order;
+}
+
 vector<int> SPDMatrix::computePerm() const
 {
     int i, j;
@@ -154,6 +1049,48 @@ vector<int> SPDMatrix::computePerm() const
     return out;
 #endif
 
+    if(ordering == minimumDegreeOrdering)
+        out = minimumDegreeOrder();
+    else {
+        //adjacency lists of the matrix graph
+        vector<int> start(sz + 1, 0), adj;
+        for(i = 0; i < sz; ++i) {
+            for(j = 0; j < (int)m[i].size() - 1; ++j) {
+                ++start[i + 1];
+                ++start[m[i][j].first + 1];
+            }
+        }
+        for(i = 0; i < sz; ++i)
+            start[i + 1] += start[i];
+        adj.resize(start[sz]);
+        vector<int> fill(start.begin(), start.end() - 1);
+        for(i = 0; i < sz; ++i) {
+            for(j = 0; j < (int)m[i].size() - 1; ++j) {
+                adj[fill[i]++] = m[i][j].first;
+                adj[fill[m[i][j].first]++] = i;
+            }
+        }
+
+        if(ordering == nestedDissectionOrdering || (ordering == automaticOrdering && sz >= nestedDissectionSize))
+            out = nestedDissection(start, adj);
+        else
+            out = approximateMinimumDegree(start, adj);
+    }
+
+    vector<int> oout = out;
+    for(i = 0; i < sz; ++i) //invert the permutation
+        out[oout[i]] = i;
+        
+    return out;
+}
+
+vector<int> SPDMatrix::minimumDegreeOrder() const
+{
+    int i, j;
+
+    vector<int> out;
+    int sz = m.size();
+
     //initialize
     set<pair<int, int> > neighborSize;
     vector<unordered_set<int>> neighbors(sz);
@@ -195,178 +1132,402 @@ vector<int> SPDMatrix::computePerm() const
             neighborSize.insert(make_pair(neighbors[nb[i]].size(), nb[i]));
     }
 
-    vector<int> oout = out;
-    for(i = 0; i < sz; ++i) //invert the permutation
-        out[oout[i]] = i;
-        
     return out;
 }
 
 LLTMatrix *SPDMatrix::factor() const
 {
-    int i, j, k;
-    MyLLTMatrix *outP = new MyLLTMatrix();
-    MyLLTMatrix &out = *outP;
+    return factor(analyze());
+}
+
+SymbolicLLT SPDMatrix::analyze() const
+{
+    int i, j;
+    SymbolicLLT out;
     int sz = m.size();
-    out.m.resize(sz);
-    out.diag.resize(sz);
 
     Debugging::out() << "Factoring size = " << sz << endl;
-    
+
+    out.inputStart.resize(sz + 1, 0);
+    for(i = 0; i < sz; ++i)
+        out.inputStart[i + 1] = out.inputStart[i] + m[i].size();
+    out.inputCols.resize(out.inputStart[sz]);
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)m[i].size(); ++j)
+        out.inputCols[out.inputStart[i] + j] = m[i][j].first;
+
     out.perm = computePerm();
 
     Debugging::out() << "Perm computed" << endl;
-    
-    //permute matrix according to the permuation
-    vector<vector<pair<int, double> > > pm(sz);
+
+    //permute matrix according to the permuation, remembering where every entry came from
+    vector<vector<pair<int, int> > > pm(sz); //by rows first, for the elimination tree
     for(i = 0; i < sz; ++i) {
         for(j = 0; j < (int)m[i].size(); ++j) {
             int ni = out.perm[i], nidx = out.perm[m[i][j].first];
             if(ni >= nidx)
-                pm[ni].push_back(make_pair(nidx, m[i][j].second));
+                pm[ni].push_back(make_pair(nidx, out.inputStart[i] + j));
             else
-                pm[nidx].push_back(make_pair(ni, m[i][j].second));
+                pm[nidx].push_back(make_pair(ni, out.inputStart[i] + j));
         }
     }
-    for(i = 0; i < sz; ++i)
-        sort(pm[i].begin(), pm[i].end());
-
-    //prepare for decomposition
-    vector<vector<pair<int, double> > > cols(sz);
-    vector<double> dinv(sz); //inverses of out.diag
-
-    vector<bool> added(sz, false);
-
-    //Sparse cholesky decomposition
-    for(i = 0; i < sz; ++i) { //current row
-        vector<int> columnsAdded;
-        columnsAdded.reserve(2 * pm[i].size());
-
-        //compute columnsAdded (nonzero indices of factor in current row)
-        int inCA = 0;
-        for(j = 0; j < (int)pm[i].size() - 1; ++j) {
-            added[pm[i][j].first] = true;
-            columnsAdded.push_back(pm[i][j].first);
-        }
-        while(inCA < (int)columnsAdded.size()) {
-            int idx = columnsAdded[inCA];
-            ++inCA;
-            for(k = 0; k < (int)cols[idx].size(); ++k) {
-                int curCol = cols[idx][k].first;
-                if(!added[curCol]) {
-                    added[curCol] = true;
-                    columnsAdded.push_back(curCol);
-                }
+
+    //elimination tree, with path compression through the ancestors
+    out.parent.assign(sz, -1);
+    vector<int> ancestor(sz, -1);
+    for(i = 0; i < sz; ++i) {
+        for(j = 0; j < (int)pm[i].size(); ++j) {
+            int cur = pm[i][j].first;
+            while(cur != -1 && cur < i) {
+                int next = ancestor[cur];
+                ancestor[cur] = i;
+                if(next == -1)
+                    out.parent[cur] = i;
+                cur = next;
             }
         }
-        sort(columnsAdded.begin(), columnsAdded.end());
+    }
 
-        for(j = 0; j < (int)columnsAdded.size(); ++j) {//add the columns and clear added
-            added[columnsAdded[j]] = false;
-            cols[columnsAdded[j]].push_back(make_pair(i, 0.));
+    //the pattern of row i of the factor is everything reachable in the tree from the
+    //pattern of row i of the matrix without passing i--collect it by columns
+    vector<int> mark(sz, -1), colCount(sz, 0);
+    vector<int> rowCols;
+    vector<int> rowStart(sz + 1, 0);
+    for(i = 0; i < sz; ++i) {
+        mark[i] = i;
+        for(j = 0; j < (int)pm[i].size(); ++j) {
+            for(int cur = pm[i][j].first; mark[cur] != i; cur = out.parent[cur]) {
+                mark[cur] = i;
+                rowCols.push_back(cur);
+                ++colCount[cur];
+            }
         }
+        rowStart[i + 1] = rowCols.size();
+    }
+    vector<int> colStart(sz + 1, 0);
+    for(i = 0; i < sz; ++i)
+        colStart[i + 1] = colStart[i] + colCount[i];
+    out.nonzeros = colStart[sz];
+    vector<int> colRows(colStart[sz]);
+    vector<int> colFill(colStart.begin(), colStart.end() - 1);
+    for(i = 0; i < sz; ++i) for(j = rowStart[i]; j < rowStart[i + 1]; ++j) //rows come out sorted
+        colRows[colFill[rowCols[j]]++] = i;
+    vector<int>().swap(rowCols);
+
+    //the permuted lower triangle by columns
+    out.pmStart.assign(sz + 1, 0);
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)pm[i].size(); ++j)
+        ++out.pmStart[pm[i][j].first + 1];
+    for(i = 0; i < sz; ++i)
+        out.pmStart[i + 1] += out.pmStart[i];
+    out.pmRows.resize(out.pmStart[sz]);
+    out.pmSource.resize(out.pmStart[sz]);
+    colFill.assign(out.pmStart.begin(), out.pmStart.end() - 1);
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)pm[i].size(); ++j) {
+        int pos = colFill[pm[i][j].first]++;
+        out.pmRows[pos] = i;
+        out.pmSource[pos] = pm[i][j].second;
+    }
+
+    //fundamental supernodes: a column joins the previous one if it is its parent and the previous
+    //column's pattern is just this column plus this column's pattern
+    out.columnSuper.resize(sz);
+    out.superRowStart.push_back(0);
+    for(i = 0; i < sz; ++i) {
+        if(i == 0 || out.parent[i - 1] != i || colCount[i - 1] != colCount[i] + 1)
+            out.superStart.push_back(i);
+        out.columnSuper[i] = out.superStart.size() - 1;
+    }
+    out.superStart.push_back(sz);
+    for(int s = 0; s + 1 < (int)out.superStart.size(); ++s) {
+        int last = out.superStart[s + 1] - 1;
+        for(i = out.superStart[s]; i <= last; ++i)
+            out.superRows.push_back(i);
+        out.superRows.insert(out.superRows.end(), colRows.begin() + colStart[last], colRows.begin() + colStart[last + 1]);
+        out.superRowStart.push_back(out.superRows.size());
+    }
 
-        for(j = 0; j < (int)pm[i].size() - 1; ++j) { //initialize it with m's entries
-            int curCol = pm[i][j].first;
-            cols[curCol].back().second = pm[i][j].second * dinv[curCol];
+    //which supernodes update which: each one updates the supernodes of its rows below its
+    //own columns, in order, a run of rows per supernode
+    int supers = out.supernodes();
+    out.superParent.assign(supers, -1);
+    vector<vector<pair<int, int> > > updates(supers);
+    for(int s = 0; s < supers; ++s) {
+        int cols = out.superStart[s + 1] - out.superStart[s];
+        const int *rows = &out.superRows[out.superRowStart[s]];
+        int nrows = out.superRowStart[s + 1] - out.superRowStart[s];
+        if(cols < nrows)
+            out.superParent[s] = out.columnSuper[rows[cols]];
+        for(i = cols; i < nrows; ++i) {
+            int target = out.columnSuper[rows[i]];
+            if(i == cols || target != out.columnSuper[rows[i - 1]])
+                updates[target].push_back(make_pair(s, i));
         }
-        for(j = 0; j < (int)columnsAdded.size(); ++j) { //current column
-            int idx = columnsAdded[j];
-            int csz = cols[idx].size() - 1;
-            for(k = 0; k < csz; ++k) { //index in column above current row -- inner loop
-                int tidx = cols[idx][k].first; //index into current row
-                double prod = cols[idx][k].second * cols[idx].back().second * dinv[tidx];
-                cols[tidx].back().second -= prod;
-            }
+    }
+    out.updateStart.push_back(0);
+    for(int s = 0; s < supers; ++s) {
+        for(j = 0; j < (int)updates[s].size(); ++j) {
+            out.updateSupers.push_back(updates[s][j].first);
+            out.updateRows.push_back(updates[s][j].second);
         }
-        //now diagonal
-        out.diag[i] = pm[i].back().second;
-        for(j = 0; j < (int)columnsAdded.size(); ++j) {
-            double val = cols[columnsAdded[j]].back().second;
-            out.diag[i] -= SQR(val);
-            out.m[i].push_back(make_pair(columnsAdded[j], val)); //also add rows to output
-        }
-        if(out.diag[i] <= 0.) { //not positive definite
-            assert(false && "Not positive definite matrix (or ill-conditioned)");
-            delete outP;
-            return new MyLLTMatrix();
-        }
-        out.diag[i] = sqrt(out.diag[i]);
-        dinv[i] = 1. / out.diag[i];
-    }
-
-    out.initMt();
-
-    /* Error check 
-    double totErr = 0;
-    for(i = 0; i < m.size(); ++i) {
-        for(j = 0; j < m[i].size(); ++j) {
-            int q = m[i][j].first;
-            double total = -m[i][j].second;
-            out.m[i].push_back(make_pair(i, out.diag[i]));
-            if(i != q) out.m[q].push_back(make_pair(q, out.diag[q]));
-            for(k = 0; k < out.m[i].size(); ++k) {
-                for(int z = 0; z < out.m[q].size(); ++z) {
-                    if(out.m[i][k].first != out.m[q][z].first)
-                        continue;
-                    total += out.m[i][k].second * out.m[q][z].second;
+        out.updateStart.push_back(out.updateSupers.size());
+    }
+
+    return out;
+}
+
+LLTMatrix *SPDMatrix::factor(const SymbolicLLT &symbolic) const
+{
+    int i, j;
+    int sz = m.size();
+
+    if(!symbolic.matches(*this)) {
+        Debugging::out() << "Symbolic factorization does not match the matrix" << endl;
+        return new MyLLTMatrix();
+    }
+
+    MyLLTMatrix *outP = new MyLLTMatrix();
+    MyLLTMatrix &out = *outP;
+    out.superStart = symbolic.superStart;
+    out.superRowStart = symbolic.superRowStart;
+    out.superRows = symbolic.superRows;
+    int supers = symbolic.supernodes();
+
+    out.superValueStart.resize(supers + 1, 0);
+    for(int s = 0; s < supers; ++s) {
+        size_t cols = symbolic.superStart[s + 1] - symbolic.superStart[s];
+        size_t rows = symbolic.superRowStart[s + 1] - symbolic.superRowStart[s];
+        out.superValueStart[s + 1] = out.superValueStart[s] + cols * rows;
+    }
+    out.values.assign(out.superValueStart[supers], 0.);
+
+    vector<double> values(symbolic.inputCols.size()); //entries of m, flattened
+    for(i = 0; i < sz; ++i) for(j = 0; j < (int)m[i].size(); ++j)
+        values[symbolic.inputStart[i] + j] = m[i][j].second;
+
+    //Left looking supernodal cholesky decomposition: each supernode gathers the updates from
+    //the earlier supernodes that have rows in its columns, and is then factored as a dense panel.
+    //Those are all in its subtree of the elimination tree, so independent subtrees are factored
+    //in parallel.  The result does not depend on the number of threads.
+    int threads = getNumThreads();
+    vector<vector<int> > relative(threads); //row -> row within the current supernode, per worker
+    vector<vector<double> > update(threads);
+    atomic<bool> failed(false);
+    static const int narrowSupernode = 4; //updates from supernodes up to this wide go straight into the panel
+
+    parallelTree(symbolic.superParent, [&](int s, int worker) {
+        int i, j, k;
+        int first = out.superStart[s], last = out.superStart[s + 1];
+        int cols = last - first;
+        const int *rows = &out.superRows[out.superRowStart[s]];
+        int nrows = out.superRowStart[s + 1] - out.superRowStart[s];
+        double *panel = &out.values[out.superValueStart[s]];
+        vector<int> &rel = relative[worker];
+        if(rel.empty())
+            rel.resize(sz);
+
+        if(failed)
+            return;
+
+        for(i = 0; i < nrows; ++i)
+            rel[rows[i]] = i;
+
+        //initialize it with m's entries
+        for(j = first; j < last; ++j)
+            for(k = symbolic.pmStart[j]; k < symbolic.pmStart[j + 1]; ++k)
+                panel[(j - first) * nrows + rel[symbolic.pmRows[k]]] += values[symbolic.pmSource[k]];
+
+        //updates from earlier supernodes
+        for(int u = symbolic.updateStart[s]; u < symbolic.updateStart[s + 1]; ++u) {
+            int desc = symbolic.updateSupers[u];
+            int dcols = out.superStart[desc + 1] - out.superStart[desc];
+            const int *drows = &out.superRows[out.superRowStart[desc]];
+            int dnrows = out.superRowStart[desc + 1] - out.superRowStart[desc];
+            const double *dpanel = &out.values[out.superValueStart[desc]];
+
+            int p = symbolic.updateRows[u], q = p;
+            while(q < dnrows && drows[q] < last)
+                ++q;
+
+            //update = L(p.., :) * L(p..q, :)^T -- only the lower triangle is needed
+            int um = dnrows - p, un = q - p;
+            if(dcols <= narrowSupernode) { //not worth a dense block
+                for(j = 0; j < un; ++j) {
+                    double *pcol = panel + (drows[p + j] - first) * nrows;
+                    for(k = 0; k < dcols; ++k) {
+                        const double *dcol = dpanel + k * dnrows + p;
+                        double val = dcol[j];
+                        for(i = j; i < um; ++i)
+                            pcol[rel[drows[p + i]]] -= dcol[i] * val;
+                    }
+                }
+            }
+            else {
+                vector<double> &buf = update[worker];
+                buf.assign(um * un, 0.);
+                for(k = 0; k < dcols; ++k) {
+                    const double *dcol = dpanel + k * dnrows + p;
+                    for(j = 0; j < un; ++j) {
+                        double val = dcol[j];
+                        double *ucol = &buf[j * um];
+                        for(i = j; i < um; ++i)
+                            ucol[i] += dcol[i] * val;
+                    }
+                }
+                for(j = 0; j < un; ++j) {
+                    double *pcol = panel + (drows[p + j] - first) * nrows;
+                    for(i = j; i < um; ++i)
+                        pcol[rel[drows[p + i]]] -= buf[j * um + i];
                 }
             }
-            out.m[i].pop_back();
-            if(i != q) out.m[q].pop_back();
+        }
 
-            totErr += fabs(total);
+        //dense factorization of the panel
+        for(j = 0; j < cols; ++j) {
+            double *pcol = panel + j * nrows;
+            for(k = 0; k < j; ++k) {
+                const double *kcol = panel + k * nrows;
+                double val = kcol[j];
+                for(i = j; i < nrows; ++i)
+                    pcol[i] -= kcol[i] * val;
+            }
+            if(pcol[j] <= 0.) { //not positive definite
+                failed = true;
+                return;
+            }
+            double diag = sqrt(pcol[j]);
+            double dinv = 1. / diag;
+            pcol[j] = diag;
+            for(i = j + 1; i < nrows; ++i)
+                pcol[i] *= dinv;
         }
+    });
+
+    if(failed) {
+        assert(false && "Not positive definite matrix (or ill-conditioned)");
+        delete outP;
+        return new MyLLTMatrix();
     }
-    */
+
+    out.perm = symbolic.perm;
 
     return outP;
 }
 
-void MyLLTMatrix::initMt()  //compute the transposed entries (by rows)
+//forward and back substitution on nb interleaved permuted right hand sides, with the
+//forward substitution starting from row first (everything before it is zero)
+void MyLLTMatrix::substitute(double *x, int nb, int first) const
 {
-    int i, j;
+    int i, j, r;
+    int supers = (int)superStart.size() - 1;
 
-    mt.clear();
-    mt.resize(m.size());
+    //solve L (L^T x) = b for (L^T x)
+    for(int s = 0; s < supers; ++s) {
+        if(superStart[s + 1] <= first)
+            continue;
+        int cols = superStart[s + 1] - superStart[s];
+        const int *rows = &superRows[superRowStart[s]];
+        int nrows = superRowStart[s + 1] - superRowStart[s];
+        const double *panel = &values[superValueStart[s]];
+        for(j = 0; j < cols; ++j) {
+            const double *pcol = panel + j * nrows;
+            double *src = x + rows[j] * nb;
+            for(r = 0; r < nb; ++r)
+                src[r] /= pcol[j];
+            for(i = j + 1; i < nrows; ++i) {
+                double *dst = x + rows[i] * nb;
+                double val = pcol[i];
+                for(r = 0; r < nb; ++r)
+                    dst[r] -= src[r] * val;
+            }
+        }
+    }
 
-    for(i = 0; i < (int)m.size(); ++i) {
-        for(j = 0; j < (int)m[i].size(); ++j) {
-            mt[m[i][j].first].push_back(make_pair(i, m[i][j].second));
+    //solve L^T x = b for x
+    for(int s = supers - 1; s >= 0; --s) {
+        int cols = superStart[s + 1] - superStart[s];
+        const int *rows = &superRows[superRowStart[s]];
+        int nrows = superRowStart[s + 1] - superRowStart[s];
+        const double *panel = &values[superValueStart[s]];
+        for(j = cols - 1; j >= 0; --j) {
+            const double *pcol = panel + j * nrows;
+            double *dst = x + rows[j] * nb;
+            for(i = j + 1; i < nrows; ++i) {
+                const double *src = x + rows[i] * nb;
+                double val = pcol[i];
+                for(r = 0; r < nb; ++r)
+                    dst[r] -= src[r] * val;
+            }
+            for(r = 0; r < nb; ++r)
+                dst[r] /= pcol[j];
         }
     }
 }
 
 bool MyLLTMatrix::solve(vector<double> &b) const
 {
-    int i, j;
+    int i;
+    int sz = perm.size();
 
-    if(b.size() != m.size())
+    if((int)b.size() != sz)
         return false;
 
     vector<double> bp(b.size());
     //permute
-    for(i = 0; i < (int)b.size(); ++i)
+    for(i = 0; i < sz; ++i)
         bp[perm[i]] = b[i];
 
-    //solve L (L^T x) = b for (L^T x)
-    for(i = 0; i < (int)bp.size(); ++i) {
-        for(j = 0; j < (int)m[i].size(); ++j)
-            bp[i] -= bp[m[i][j].first] * m[i][j].second;
-        bp[i] /= diag[i];
-    }
-
-    //solve L^T x = b for x
-    for(i = bp.size() - 1; i >= 0; --i) {
-        for(j = 0; j < (int)mt[i].size(); ++j)
-            bp[i] -= bp[mt[i][j].first] * mt[i][j].second;
-        bp[i] /= diag[i];
-    }
+    substitute(bp.data(), 1, 0);
 
     //unpermute
-    for(i = 0; i < (int)b.size(); ++i)
+    for(i = 0; i < sz; ++i)
         b[i] = bp[perm[i]];
 
     return true;
 }
+
+bool MyLLTMatrix::solveMany(vector<vector<double> > &bs) const
+{
+    int i;
+    for(i = 0; i < (int)bs.size(); ++i)
+        if(bs[i].size() != perm.size())
+            return false;
+
+    int blocks = (bs.size() + blockSize - 1) / blockSize;
+    parallelFor(0, blocks, [&](int block) {
+        solveBlock(bs, block * blockSize, min((block + 1) * blockSize, (int)bs.size()));
+    });
+
+    return true;
+}
+
+//same as solve, but for the right hand sides bs[begin..end) stored interleaved, so that
+//every entry of the factor is loaded once for the whole block
+void MyLLTMatrix::solveBlock(vector<vector<double> > &bs, int begin, int end) const
+{
+    int i, r;
+    int nb = end - begin;
+    int sz = perm.size();
+
+    //permute, and find the first row where any right hand side is nonzero--the forward
+    //substitution leaves everything before it zero
+    vector<double> bp(sz * nb);
+    int first = sz;
+    for(i = 0; i < sz; ++i) {
+        double *row = &bp[perm[i] * nb];
+        for(r = 0; r < nb; ++r) {
+            row[r] = bs[begin + r][i];
+            if(row[r] != 0. && perm[i] < first)
+                first = perm[i];
+        }
+    }
+
+    substitute(bp.data(), nb, first);
+
+    //unpermute
+    for(i = 0; i < sz; ++i) {
+        const double *row = &bp[perm[i] * nb];
+        for(r = 0; r < nb; ++r)
+            bs[begin + r][i] = row[r];
+    }
+}
 #endif
@@ -22,6 +22,8 @@
 #include <vector>
 #include <map>
 #include <algorithm>
+#include <memory>
+#include <mutex>
 #include <assert.h>
 
 #include "mathutils.h"
@@ -34,9 +36,63 @@ class LLTMatrix
 public:
     virtual ~LLTMatrix() {}
     virtual bool solve(vector<double> &b) const = 0;
+    //solves for several right hand sides at once (in place)
+    virtual bool solveMany(vector<vector<double> > &bs) const;
     virtual int size() const = 0;
 };
 
+class SPDMatrix;
+
+//preconditioners for the iterative solver
+enum Preconditioner { jacobiPreconditioner, incompleteCholeskyPreconditioner };
+
+static const double defaultSolverTolerance = 1e-8; //relative residual the iterative solver stops at
+static const int maxSolverIterations = 10000;
+
+//fill-reducing orderings for the factorization.  The exact minimum degree ordering is slow on large
+//matrices and kept mostly for comparison; nested dissection gives less fill on very large meshes.
+//The automatic ordering picks approximate minimum degree or nested dissection by size.
+enum FillOrdering { minimumDegreeOrdering, approximateMinimumDegreeOrdering, nestedDissectionOrdering,
+                    automaticOrdering };
+
+static const FillOrdering defaultFillOrdering = automaticOrdering;
+static const int nestedDissectionSize = 100000; //automatic ordering uses nested dissection from this size on
+
+/**
+* Symbolic analysis of an SPDMatrix -- the fill-reducing permutation, the elimination tree
+* and the supernodes of the factor.  It depends only on where the nonzeros of the matrix
+* are, so it can be reused to factor any matrix with the same pattern (e.g., the same mesh
+* with a different heat weight) and only the numeric factorization is repeated.
+*/
+class SymbolicLLT
+{
+public:
+    SymbolicLLT() : nonzeros(0) {}
+
+    int size() const { return perm.size(); }
+    int factorNonzeros() const { return nonzeros; } //strictly below the diagonal
+    int supernodes() const { return (int)superStart.size() - 1; }
+    bool matches(const SPDMatrix &matrix) const; //true if the matrix has the pattern this was computed for
+
+private:
+    vector<int> perm; //permutation
+    vector<int> parent; //elimination tree of the permuted matrix, -1 for roots
+    vector<int> inputStart, inputCols; //pattern of the rows of the original matrix
+    vector<int> pmStart, pmRows, pmSource; //columns of the permuted lower triangle: rows and indices of the original entries
+
+    //supernode s is columns superStart[s] .. superStart[s + 1] - 1, which share the rows
+    //superRows[superRowStart[s]] ... (its own columns first)
+    vector<int> superStart, superRowStart, superRows;
+    vector<int> columnSuper; //supernode of every column
+    vector<int> superParent; //supernodal elimination tree
+    //supernode s is updated by supernodes updateSupers[updateStart[s]] ... (ascending), each
+    //from its row updateRows[...] on--fixed here so the numeric result cannot depend on the schedule
+    vector<int> updateStart, updateSupers, updateRows;
+    int nonzeros;
+
+    friend class SPDMatrix;
+};
+
 /**
 * Represents a symmetric positive definite (spd) matrix -- 
 * primary intended use is inside LSQSystem (because it's symmetric, only the lower triangle
@@ -45,15 +101,111 @@ public:
 class SPDMatrix
 {
 public:
-    SPDMatrix(const vector<vector<pair<int, double> > > &inM) : m(inM) {}
+    SPDMatrix(const vector<vector<pair<int, double> > > &inM, FillOrdering inOrdering = defaultFillOrdering)
+        : m(inM), ordering(inOrdering) {}
     LLTMatrix *factor() const;
 
+    SymbolicLLT analyze() const; //symbolic factorization only
+    //numeric factorization using a previous symbolic one, which must match this matrix
+    LLTMatrix *factor(const SymbolicLLT &symbolic) const;
+
+    //preconditioned conjugate gradients behind the LLTMatrix interface, for matrices whose factor
+    //would not fit in memory.  solveMany starts every solve from the previous solution if that is
+    //closer than zero.  Incomplete cholesky falls back to Jacobi if it breaks down.
+    LLTMatrix *iterativeSolver(double tolerance = defaultSolverTolerance,
+                               Preconditioner preconditioner = incompleteCholeskyPreconditioner) const;
+
+    int size() const { return m.size(); }
+    const vector<vector<pair<int, double> > > &rows() const { return m; }
+    void multiply(const vector<double> &x, vector<double> &out) const; //out = (whole symmetric matrix) * x
+
 private:
     vector<int> computePerm() const; //computes a fill-reduction permutation
+    vector<int> minimumDegreeOrder() const; //exact minimum degree elimination order
 
     vector<vector<pair<int, double> > > m; //rows -- lower triangle
+    FillOrdering ordering;
+
+    friend class SymbolicLLT;
 };
 
+static const int defaultSymbolicCacheCapacity = 4;
+
+/**
+* Symbolic factorizations by key (e.g., a hash of the mesh connectivity), for factoring many
+* matrices that share a few patterns.  An entry is only used if it matches the matrix exactly,
+* so a key collision costs a miss, not a wrong factorization.  The least recently used entry
+* is dropped when the cache is full.  Safe to use from several threads.
+*/
+class SymbolicCache
+{
+public:
+    SymbolicCache(int inCapacity = defaultSymbolicCacheCapacity) : cap(inCapacity), clock(0), hitCount(0), missCount(0) {}
+
+    //the symbolic factorization of matrix: the cached one for key if it matches, otherwise a new
+    //analysis that replaces it
+    shared_ptr<const SymbolicLLT> get(unsigned long long key, const SPDMatrix &matrix);
+
+    void setCapacity(int inCapacity); //0 turns the cache off
+    int capacity() const { return cap; }
+    void clear(); //drops the entries and resets the counters
+
+    int hits() const { lock_guard<mutex> guard(lock); return hitCount; }
+    int misses() const { lock_guard<mutex> guard(lock); return missCount; }
+    int size() const;
+
+private:
+    struct Entry
+    {
+        unsigned long long key;
+        shared_ptr<const SymbolicLLT> symbolic;
+        long long lastUse;
+    };
+
+    mutable mutex lock;
+    vector<Entry> entries;
+    int cap;
+    long long clock;
+    int hitCount, missCount;
+};
+
+/**
+* A way of turning an SPDMatrix into an LLTMatrix, looked up by name at runtime.  Registered
+* from the start are "builtin" (the supernodal cholesky factorization), "iterative" (conjugate
+* gradients) and, when compiled with EIGEN, "eigen" (Eigen's SimplicialLDLT).
+*/
+class SolverBackend
+{
+public:
+    virtual ~SolverBackend() {}
+    //returns NULL on failure.  Backends that can reuse a symbolic factorization use symbolic (if not
+    //NULL), recomputing it into symbolic when it does not match the matrix; the others ignore it.
+    virtual LLTMatrix *factor(const SPDMatrix &matrix, SymbolicLLT *symbolic = NULL) const = 0;
+};
+
+void PINOCCHIO_API registerSolverBackend(const string &name, SolverBackend *backend); //takes ownership, replaces any backend of that name
+const SolverBackend PINOCCHIO_API *getSolverBackend(const string &name); //NULL if there is none
+vector<string> PINOCCHIO_API solverBackendNames(); //sorted
+
+//the backend callers use unless told otherwise--empty (the default) lets them pick by problem size.
+//Returns false, leaving the setting alone, if there is no backend of that name.
+bool PINOCCHIO_API setDefaultSolverBackend(const string &name);
+string PINOCCHIO_API defaultSolverBackend();
+
+//how one backend did on one system: times are in seconds, the residual is the largest
+//|Ax - b| / |b| over the right hand sides
+struct SolverBenchmark
+{
+    SolverBenchmark() : ok(false), factorTime(0.), solveTime(0.), residual(0.) {}
+
+    string backend;
+    bool ok; //false if factoring or solving failed
+    double factorTime, solveTime, residual;
+};
+
+//factors matrix and solves for all of rhs (with solveMany) with every registered backend
+vector<SolverBenchmark> PINOCCHIO_API benchmarkSolverBackends(const SPDMatrix &matrix, const vector<vector<double> > &rhs);
+
 /**
 * Sparse linear least squares solver -- with support for hard constraints
 * Intended usage:
@@ -71,22 +223,33 @@ private:
 *        ... = s.getResult(...);
 *      ]
 *    ]
-* Where the stuff in brackets [] may be repeated multiple times
+* Where the stuff in brackets [] may be repeated multiple times.  As long as constraints are only
+* changed in their coefficients (not in which variables they use), calling factor() again reuses
+* the index assignment, the hard constraint pivots and the structure of the normal equations.
 */
 template<class V, class C> class LSQSystem
 {
 public:
-    LSQSystem() : factoredMatrix(NULL) {}
+    LSQSystem() : patternChanged(true), factoredMatrix(NULL) {}
     ~LSQSystem() { if(factoredMatrix) delete factoredMatrix; }
 
     void addConstraint(bool hard, const map<V, double> &lhs, const C &id)
     {
-        constraints[make_pair(id, -1)] = Constraint(hard, lhs);
+        typename map<pair<C, int>, Constraint>::iterator it = constraints.find(make_pair(id, -1));
+        if(it == constraints.end())
+            it = constraints.insert(make_pair(make_pair(id, -1), Constraint())).first;
+        else if(it->second.hard == hard && samePattern(it->second.lhs, lhs)) { //just new coefficients
+            it->second.lhs = lhs;
+            return;
+        }
+        it->second = Constraint(hard, lhs);
+        patternChanged = true;
     }
 
     void addConstraint(bool hard, double rhs, const map<V, double> &lhs)
     {
         constraints[make_pair(C(), (int)constraints.size())] = Constraint(hard, lhs, rhs);
+        patternChanged = true;
     }
 
     void setRhs(const C &id, double rhs)
@@ -97,75 +260,259 @@ public:
 
     bool factor()
     {
-        int i;
-        typename map<pair<C, int>, Constraint>::iterator it;
-
-        //This is a mess.  This function needs to assign indices to both variables and
-        //constraints, row-reduce the hard-constraint matrix, and construct the soft constraint
-        //matrix by substituting the reduced hard-constraints into the soft constraints.
-        //All while keeping track of what's happening to the right hand side of the
-        //system.
-        //The result is somewhat difficult to follow.
-        //One possible optimization (optimize factorization and especially solving in
-        //the presence of large amounts of equality constraints and the like)
-        //is to treat the constraints whose rhs will not change separately.
-        //The way to make it prettier (should this become necessary) is to
-        //make structures for the different types of indices (instead of using ints and pairs)
-        //also put hard constraints in front rather than at the end.
-
-        //init
-        varIds.clear();
-        constraintMap.clear();
-        substitutedHard.clear();
-        rhsTransform.clear();
-        softMatrix.clear();
-        softNum = 0;
+        //Every variable gets a raw index and every hard constraint an extra "rhs column" standing for
+        //its right hand side, so hard constraint r reads sum(a_j x_j) - 1 * rhs_r = 0.  Gauss-Jordan
+        //elimination of the hard constraints then turns each into a substitution (pivot variable =
+        //combination of free variables and rhs columns) and tracks the right hand sides for free.
+        //Substituting into the soft constraints gives the soft matrix (free variables) and the
+        //transform of the right hand side (rhs columns, moved to the other side).
+        //The first call (and any after the pattern changed) also chooses the pivots, numbers the
+        //free variables and lays out the lower triangle of A^T A; later calls only refill values.
+        int i, j, k;
+        bool rebuilt = patternChanged;
+        if(rebuilt && !analyzePattern())
+            return false;
 
-        //assign indices to soft constraints
-        for(it = constraints.begin(); it != constraints.end(); ++it) {
-            if(!it->second.hard) {
-                constraintMap[it->first] = softNum++;
+        if(!eliminate(!rebuilt)) {
+            if(rebuilt)
+                return false; //near-singular hard constraints
+            patternChanged = true; //a reused pivot got too small--choose them again
+            return factor();
+        }
+        if(rebuilt && !layoutSystem())
+            return false;
+
+        //substitutions, as free variable indices and right hand side transforms
+        int hardNum = pivotVar.size();
+        rhsFrom.clear();
+        rhsTo.clear();
+        rhsVal.clear();
+        subStart.assign(1, 0);
+        subCols.clear();
+        subVals.clear();
+        for(k = 0; k < hardNum; ++k) {
+            const vector<pair<int, double> > &sub = rows[pivotRow[k]];
+            for(j = 0; j < (int)sub.size(); ++j) {
+                if(sub[j].first < varNum) {
+                    subCols.push_back(freeIdx[sub[j].first]);
+                    subVals.push_back(sub[j].second);
+                }
+                else
+                    addRhsTransform(stepOfRow[sub[j].first - varNum], softNum + k, sub[j].second);
+            }
+            subStart.push_back(subCols.size());
+        }
+
+        //soft matrix: scatter each substituted soft constraint and gather it in the fixed pattern
+        int c = 0;
+        for(typename map<pair<C, int>, Constraint>::const_iterator it = constraints.begin(); it != constraints.end(); ++it, ++c) {
+            if(it->second.hard)
+                continue;
+            int s = constraintIdx[c];
+            scatter(c, it->second.lhs, NULL);
+            for(j = softStart[s]; j < softStart[s + 1]; ++j) {
+                softVals[j] = work[softRaw[j]];
+                work[softRaw[j]] = 0.;
             }
+            for(j = softRhsStart[s]; j < softRhsStart[s + 1]; ++j) {
+                int col = softRhsCols[j];
+                addRhsTransform(stepOfRow[col - varNum], s, -work[col]);
+                work[col] = 0.;
+            }
+        }
+
+        //A^T A into the precomputed slots
+        fill(spdValues.begin(), spdValues.end(), 0.);
+        int t = 0;
+        for(i = 0; i < softNum; ++i) {
+            for(j = softStart[i]; j < softStart[i + 1]; ++j) for(k = softStart[i]; k <= j; ++k)
+                spdValues[productSlot[t++]] += softVals[j] * softVals[k];
+        }
+        for(i = 0; i < softVars; ++i) {
+            for(j = 0; j < (int)spdm[i].size(); ++j)
+                spdm[i][j].second = spdValues[spdStart[i] + j];
+        }
+
+        //factor the SPDMatrix to get the LLTMatrix--the symbolic part is redone only if the pattern changed
+        SPDMatrix spdMatrix(spdm);
+        if(factoredMatrix)
+            delete factoredMatrix;
+        if(rebuilt && !symbolic.matches(spdMatrix))
+            symbolic = spdMatrix.analyze();
+        factoredMatrix = spdMatrix.factor(symbolic);
+        if(factoredMatrix->size() != softVars)
+            return false;
+
+        return true;
+    }
+
+    bool solve()
+    {
+        int i, j;
+        int hardNum = pivotVar.size();
+        typename map<pair<C, int>, Constraint>::const_iterator it;
+
+        //grab the rhs's of the constraints
+        rhs0.resize(softNum + hardNum);
+        for(it = constraints.begin(), i = 0; it != constraints.end(); ++it, ++i)
+            rhs0[constraintIdx[i]] = it->second.rhs;
+
+        rhs1.assign(rhs0.begin(), rhs0.begin() + softNum);
+        rhs1.resize(softNum + hardNum, 0.); //for hard constraints, transform is absolute, not "additive"
+        //transform them (as per hard constraints substitution)
+        for(i = 0; i < (int)rhsFrom.size(); ++i)
+            rhs1[rhsTo[i]] += rhsVal[i] * rhs0[softNum + rhsFrom[i]];
+
+        //multiply by A^T (as in (A^T A)^-1 x = A^T b )
+        result.assign(softVars + hardNum, 0.);
+        for(i = 0; i < softNum; ++i) { //i is row
+            for(j = softStart[i]; j < softStart[i + 1]; ++j) //softCols[j] is column
+                result[softCols[j]] += softVals[j] * rhs1[i]; //but the matrix is transposed :)
+        }
+
+        rhs2.assign(result.begin(), result.begin() + softVars);
+        if(!factoredMatrix->solve(rhs2))
+            return false;
+        copy(rhs2.begin(), rhs2.end(), result.begin());
+
+        //now solve for the hard constraints
+        for(i = 0; i < hardNum; ++i) {
+            double cur = rhs1[softNum + i];
+            for(j = subStart[i]; j < subStart[i + 1]; ++j)
+                cur += subVals[j] * result[subCols[j]];
+            result[softVars + i] = cur;
         }
 
-        //isolate hard constraints
-        vector<map<V, double> > hardConstraints;
-        vector<pair<C, int> > hardConstraintIds;
+        return true;
+    }
+
+    double getResult(const V &var) const
+    {
+        typename map<V, int>::const_iterator it = varIndex.find(var);
+        assert(it != varIndex.end() && it->second < (int)result.size());
+        return result[it->second];
+    }
+
+private:
+    struct Constraint {
+        Constraint() : hard(false), rhs(0.) {}
+        Constraint(bool inHard, const map<V, double> &inLhs, double inRhs = 0.)
+            : hard(inHard), lhs(inLhs), rhs(inRhs) {}
+
+        bool hard;
+        map<V, double> lhs;
+        double rhs;
+    };
+
+    static bool samePattern(const map<V, double> &a, const map<V, double> &b)
+    {
+        if(a.size() != b.size())
+            return false;
+        typename map<V, double>::const_iterator ia = a.begin(), ib = b.begin();
+        for(; ia != a.end(); ++ia, ++ib)
+            if(ia->first != ib->first)
+                return false;
+        return true;
+    }
+
+    //numbers the variables and constraints
+    bool analyzePattern()
+    {
+        typename map<pair<C, int>, Constraint>::const_iterator it;
+        typename map<V, double>::const_iterator vit;
+        map<V, int> rawMap;
+        vector<V> rawVars;
+
+        conStart.assign(1, 0);
+        conVars.clear();
+        constraintIdx.clear();
+        softNum = 0;
         int hardNum = 0;
         for(it = constraints.begin(); it != constraints.end(); ++it) {
-            if(it->second.hard) {
-                hardConstraints.push_back(it->second.lhs);
-                hardConstraintIds.push_back(it->first);
+            for(vit = it->second.lhs.begin(); vit != it->second.lhs.end(); ++vit) {
+                typename map<V, int>::iterator rit = rawMap.find(vit->first);
+                if(rit == rawMap.end()) {
+                    rit = rawMap.insert(make_pair(vit->first, (int)rawVars.size())).first;
+                    rawVars.push_back(vit->first);
+                }
+                conVars.push_back(rit->second);
+            }
+            conStart.push_back(conVars.size());
+            constraintIdx.push_back(it->second.hard ? -1 : softNum++); //hard ones are set by layoutSystem
+            if(it->second.hard)
                 ++hardNum;
+        }
+        varNum = rawVars.size();
+        varIds.swap(rawVars); //raw order until layoutSystem
+        rows.resize(hardNum);
+        colRows.resize(varNum);
+        work.assign(varNum + hardNum, 0.);
+        mark.assign(varNum + hardNum, 0);
+        return true;
+    }
+
+    //eliminates the hard constraints into rows[pivotRow[k]], the substitution for pivotVar[k].  Chooses
+    //the pivots unless usePivots, in which case it only checks that the previous ones are still good
+    bool eliminate(bool usePivots)
+    {
+        int i, j, r, k;
+        int hardNum = rows.size();
+
+        //hard constraint rows by raw index, rhs columns last
+        typename map<pair<C, int>, Constraint>::const_iterator it;
+        int c = 0;
+        for(r = 0; r < varNum; ++r)
+            colRows[r].clear();
+        r = 0;
+        for(it = constraints.begin(); it != constraints.end(); ++it, ++c) {
+            if(!it->second.hard)
+                continue;
+            vector<pair<int, double> > &row = rows[r];
+            row.clear();
+            typename map<V, double>::const_iterator vit = it->second.lhs.begin();
+            for(j = conStart[c]; j < conStart[c + 1]; ++j, ++vit) {
+                row.push_back(make_pair(conVars[j], vit->second));
+                colRows[conVars[j]].push_back(r);
             }
+            sort(row.begin(), row.end());
+            row.push_back(make_pair(varNum + r, -1.));
+            ++r;
         }
 
-        map<V, map<V, double> > substitutions; //"substitutions[x] = (y, 3.), (z, 2.)" means "x = 3y+2z + c"
-        map<V, map<pair<C, int>, double> > substitutionsRhs; //the "c" in the above equation as a lin.comb. of rhs's
-        map<V, int> substitutionConstraintIdx; //keeps track of which constraint a substitution came from
-        vector<map<pair<C, int>, double> > hardRhs(hardConstraints.size());
-        for(i = 0; i < (int)hardConstraints.size(); ++i)
-            hardRhs[i][hardConstraintIds[i]] = 1.;
-        while(hardConstraints.size()) {
-            typename map<V, double>::iterator it;
-            typename map<pair<C, int>, double>::iterator rit;
+        if(!usePivots) {
+            pivotRow.clear();
+            pivotVar.clear();
+            stepOfRow.assign(hardNum, -1);
+        }
+        for(k = 0; k < hardNum; ++k) {
             //find best variable and equation -- essentially pivoting
-            V bestVar;
-            int bestEq = -1;
+            int bestRow = -1, bestVar = -1;
             double bestVal = 0;
-            for(i = 0; i < (int)hardConstraints.size(); ++i) {
-                for(it = hardConstraints[i].begin(); it != hardConstraints[i].end(); ++it) {
+            if(usePivots) {
+                bestRow = pivotRow[k];
+                bestVar = pivotVar[k];
+                const vector<pair<int, double> > &row = rows[bestRow];
+                int pos = find(row, bestVar);
+                if(pos >= 0)
+                    bestVal = fabs(row[pos].second) / (double(realSize(row)) - 0.9);
+            }
+            else for(i = 0; i < hardNum; ++i) {
+                if(stepOfRow[i] >= 0)
+                    continue;
+                const vector<pair<int, double> > &row = rows[i];
+                int size = realSize(row);
+                for(j = 0; j < size; ++j) {
                     //take the variable with the max absolute weight, but also heavily
                     //prefer variables with simple substitutions
-                    double val = fabs(it->second) / (double(hardConstraints[i].size()) - 0.9);
+                    double val = fabs(row[j].second) / (double(size) - 0.9);
                     if(val > bestVal) {
                         bestVal = val;
-                        bestEq = i;
-                        bestVar = it->first;
+                        bestRow = i;
+                        bestVar = row[j].first;
 
                         //an equality or hard assignment constraint is always good enough
-                        if(val > .5 && hardConstraints[i].size() <= 2) {
-                            i = hardConstraints.size(); //break from the outer loop as well
+                        if(val > .5 && size <= 2) {
+                            i = hardNum; //break from the outer loop as well
                             break;
                         }
                     }
@@ -174,249 +521,255 @@ public:
 
             if(bestVal < 1e-10)
                 return false; //near-singular matrix
-
-            substitutionConstraintIdx[bestVar] = substitutions.size();
-            substitutionsRhs[bestVar] = hardRhs[bestEq];
-            constraintMap[hardConstraintIds[bestEq]] = softNum + substitutions.size();
-
-            swap(hardConstraints[bestEq], hardConstraints.back());
-            swap(hardConstraintIds[bestEq], hardConstraintIds.back());
-            swap(hardRhs[bestEq], hardRhs.back());
-            double factor = -1. / hardConstraints.back()[bestVar];
-            //figure out the substitution
-            map<V, double> &curSub = substitutions[bestVar];
-            map<pair<C, int>, double> &curSubRhs = substitutionsRhs[bestVar];
-            for(it = hardConstraints.back().begin(); it != hardConstraints.back().end(); ++it) {
-                if(it->first != bestVar)
-                    curSub[it->first] = it->second * factor;
-            }
-            for(rit = curSubRhs.begin(); rit != curSubRhs.end(); ++rit)
-                rit->second *= -factor;
-
-            //now substitute into the unprocessed hard constraints
-            hardConstraints.pop_back();
-            hardConstraintIds.pop_back();
-            hardRhs.pop_back();
-            for(i = 0; i < (int)hardConstraints.size(); ++i) {
-                if(hardConstraints[i].count(bestVar) == 0)
-                    continue;
-                double varWeight = hardConstraints[i][bestVar];
-                hardConstraints[i].erase(bestVar);
-                for(it = curSub.begin(); it != curSub.end(); ++it)
-                    hardConstraints[i][it->first] += it->second * varWeight;
-                //and the rhs
-                for(rit = curSubRhs.begin(); rit != curSubRhs.end(); ++rit)
-                    hardRhs[i][rit->first] -= rit->second * varWeight;
+            if(!usePivots) {
+                pivotRow.push_back(bestRow);
+                pivotVar.push_back(bestVar);
+                stepOfRow[bestRow] = k;
             }
 
-            //now substitute into the other substitutions
-            typename map<V, map<V, double> >::iterator sit;
-            for(sit = substitutions.begin(); sit != substitutions.end(); ++sit) {
-                if(sit->second.count(bestVar) == 0)
+            //turn the row into the substitution
+            vector<pair<int, double> > &sub = rows[bestRow];
+            int pos = find(sub, bestVar);
+            double factor = -1. / sub[pos].second;
+            sub.erase(sub.begin() + pos);
+            for(j = 0; j < (int)sub.size(); ++j)
+                sub[j].second *= factor;
+
+            //and substitute it into the other rows, unprocessed or substitutions
+            vector<int> &users = colRows[bestVar];
+            for(i = 0; i < (int)users.size(); ++i) {
+                r = users[i];
+                if(r == bestRow)
                     continue;
-                double varWeight = sit->second[bestVar];
-                sit->second.erase(bestVar);
-                for(it = curSub.begin(); it != curSub.end(); ++it)
-                    sit->second[it->first] += it->second * varWeight;
-                //and the rhs
-                map<pair<C, int>, double> &srhs = substitutionsRhs[sit->first];
-                for(rit = curSubRhs.begin(); rit != curSubRhs.end(); ++rit) {
-                    srhs[rit->first] += rit->second * varWeight;
-                }
+                pos = find(rows[r], bestVar);
+                if(pos < 0)
+                    continue; //listed twice
+                double varWeight = rows[r][pos].second;
+                substitute(r, pos, varWeight, sub);
             }
+            users.clear();
         }
+        return true;
+    }
 
-        //now that we know which variables are determined by hard constraints, give indices to the rest
-        map<V, int> varMap; //maps variables to indices
-        //variables from soft constraints first
-        for(it = constraints.begin(); it != constraints.end(); ++it) {
+    //numbers the free variables, lays out the soft matrix and the lower triangle of A^T A
+    bool layoutSystem()
+    {
+        int i, j, k, c;
+        int hardNum = pivotVar.size();
+        typename map<pair<C, int>, Constraint>::const_iterator it;
+
+        //hard constraints are numbered by when they were eliminated
+        for(c = 0, i = 0; c < (int)constraintIdx.size(); ++c) {
+            if(constraintIdx[c] < 0)
+                constraintIdx[c] = softNum + stepOfRow[i++];
+        }
+
+        //variables from soft constraints first, then the substituted ones
+        vector<V> rawVars;
+        rawVars.swap(varIds);
+        freeIdx.assign(varNum, -1);
+        for(k = 0; k < hardNum; ++k)
+            freeIdx[pivotVar[k]] = -2;
+        varIds.clear();
+        for(it = constraints.begin(), c = 0; it != constraints.end(); ++it, ++c) {
             if(it->second.hard)
                 continue;
-            typename map<V, double>::iterator it2;
-            for(it2 = it->second.lhs.begin(); it2 != it->second.lhs.end(); ++it2) {
-                if(varMap.count(it2->first) || substitutions.count(it2->first))
+            for(j = conStart[c]; j < conStart[c + 1]; ++j) {
+                if(freeIdx[conVars[j]] != -1)
                     continue;
-                varMap[it2->first] = varIds.size();
-                varIds.push_back(it2->first);
+                freeIdx[conVars[j]] = varIds.size();
+                varIds.push_back(rawVars[conVars[j]]);
             }
         }
-        int softVars = varIds.size();
-        //then the hard constraint variables
-        varIds.resize(softVars + hardNum);
-        typename map<V, map<V, double> >::iterator sit;
-        for(sit = substitutions.begin(); sit != substitutions.end(); ++sit) {
-            int idx = substitutionConstraintIdx[sit->first] + softVars;
-            varMap[sit->first] = idx;
-            varIds[idx] = sit->first;
-        }
-
-        //now compute substitutedHard -- the substitutions with respect to the indices
-        substitutedHard.resize(substitutions.size());
-        for(sit = substitutions.begin(); sit != substitutions.end(); ++sit) {
-            typename map<V, double>::iterator it;
-            int idx = substitutionConstraintIdx[sit->first];
-            for(it = sit->second.begin(); it != sit->second.end(); ++it) {
-                if(varMap.count(it->first) == 0)
+        softVars = varIds.size();
+        for(k = 0; k < hardNum; ++k) {
+            freeIdx[pivotVar[k]] = softVars + k;
+            varIds.push_back(rawVars[pivotVar[k]]);
+            const vector<pair<int, double> > &sub = rows[pivotRow[k]];
+            for(j = 0; j < (int)sub.size(); ++j)
+                if(sub[j].first < varNum && freeIdx[sub[j].first] < 0)
                     return false; //variable is left free by both hard and soft constraints--bad system
-                substitutedHard[idx].push_back(make_pair(varMap[it->first], it->second));
-            }
         }
-
-        //compute the softMatrix (and the rhs transform)
-        vector<map<int, double> > rhsTransformMap(hardNum); //the rhsTransform matrix as a map
-        softMatrix.resize(softNum);
-        for(it = constraints.begin(); it != constraints.end(); ++it) {
+        varIndex.clear();
+        for(i = 0; i < (int)varIds.size(); ++i)
+            varIndex[varIds[i]] = i;
+
+        //pattern of the soft matrix
+        vector<int> touched;
+        vector<pair<int, int> > cols; //(free index, raw index)
+        softStart.assign(1, 0);
+        softRaw.clear();
+        softCols.clear();
+        softRhsStart.assign(1, 0);
+        softRhsCols.clear();
+        for(it = constraints.begin(), c = 0; it != constraints.end(); ++it, ++c) {
             if(it->second.hard)
                 continue;
-            map<V, double> modLhs = it->second.lhs;
-            typename map<V, double>::iterator it2, it3;
-            int idx = constraintMap[it->first];
-            for(it2 = it->second.lhs.begin(); it2 != it->second.lhs.end(); ++it2) {
-                if(substitutions.count(it2->first) == 0)
-                    continue;
-                double fac = it2->second;
-                map<V, double> &curSub = substitutions[it2->first];
-                for(it3 = curSub.begin(); it3 != curSub.end(); ++it3) {
-                    modLhs[it3->first] += fac * it3->second;
-                }
-                map<pair<C, int>, double> &curRhsSub = substitutionsRhs[it2->first];
-                typename map<pair<C, int>, double>::iterator it4;
-                for(it4 = curRhsSub.begin(); it4 != curRhsSub.end(); ++it4) {
-                    rhsTransformMap[constraintMap[it4->first] - softNum][idx] -= fac * it4->second;
-                }
+            touched.clear();
+            scatter(c, it->second.lhs, &touched);
+            cols.clear();
+            for(j = 0; j < (int)touched.size(); ++j) {
+                int col = touched[j];
+                work[col] = 0.;
+                mark[col] = 0;
+                if(col < varNum)
+                    cols.push_back(make_pair(freeIdx[col], col));
+                else
+                    softRhsCols.push_back(col);
             }
-            for(it2 = modLhs.begin(); it2 != modLhs.end(); ++it2) { //write modLhs into the right form
-                if(substitutions.count(it2->first))
-                    continue;
-                softMatrix[idx].push_back(make_pair(varMap[it2->first], it2->second));
+            sort(cols.begin(), cols.end());
+            for(j = 0; j < (int)cols.size(); ++j) {
+                softCols.push_back(cols[j].first);
+                softRaw.push_back(cols[j].second);
             }
-            sort(softMatrix[idx].begin(), softMatrix[idx].end());
+            softStart.push_back(softCols.size());
+            softRhsStart.push_back(softRhsCols.size());
         }
+        softVals.resize(softCols.size());
 
-        //add the rhs transforms for the hard constraints
-        //and get the rhsTransform into the right form
-        typename map<V, map<pair<C, int>, double> >::iterator rit;
-        for(rit = substitutionsRhs.begin(); rit != substitutionsRhs.end(); ++rit) {
-            typename map<pair<C, int>, double>::iterator it;
-            int idx = substitutionConstraintIdx[rit->first] + softNum;
-            for(it = rit->second.begin(); it != rit->second.end(); ++it) {
-                rhsTransformMap[constraintMap[it->first] - softNum][idx] += it->second;
-            }
-        }
-        for(i = 0; i < hardNum; ++i) {
-            rhsTransform.push_back(vector<pair<int, double> >(rhsTransformMap[i].begin(),
-                                                              rhsTransformMap[i].end()));
+        //lower triangle of A^T A by sorting the coordinates of all the products
+        vector<long long> products;
+        for(i = 0; i < softNum; ++i) {
+            for(j = softStart[i]; j < softStart[i + 1]; ++j) for(k = softStart[i]; k <= j; ++k)
+                products.push_back((long long)softCols[j] * softVars + softCols[k]);
         }
-
-        //multiply the softMatrix by its transpose to get an SPDMatrix
-        vector<vector<pair<int, double> > > spdm; //the lower triangle of A^T * A
-        vector<map<int, double> > spdMap(softVars); //the lower triangle of A^T * A as a map
-        for(i = 0; i < (int)softMatrix.size(); ++i) {
-            int j, k;
-            for(j = 0; j < (int)softMatrix[i].size(); ++j) for(k = 0; k <= j; ++k) {
-                spdMap[softMatrix[i][j].first][softMatrix[i][k].first] +=
-                    softMatrix[i][j].second * softMatrix[i][k].second;
-            }
+        vector<long long> entries = products;
+        sort(entries.begin(), entries.end());
+        entries.erase(unique(entries.begin(), entries.end()), entries.end());
+        productSlot.resize(products.size());
+        for(i = 0; i < (int)products.size(); ++i)
+            productSlot[i] = lower_bound(entries.begin(), entries.end(), products[i]) - entries.begin();
+
+        spdStart.assign(softVars + 1, 0);
+        spdm.assign(softVars, vector<pair<int, double> >());
+        for(i = 0; i < (int)entries.size(); ++i) {
+            int row = entries[i] / softVars;
+            spdm[row].push_back(make_pair((int)(entries[i] % softVars), 0.));
+            ++spdStart[row + 1];
         }
         for(i = 0; i < softVars; ++i)
-            spdm.push_back(vector<pair<int, double> >(spdMap[i].begin(), spdMap[i].end()));
-
-        //factor the SPDMatrix to get the LLTMatrix
-        SPDMatrix spdMatrix(spdm);
-        if(factoredMatrix)
-            delete factoredMatrix;
-        factoredMatrix = spdMatrix.factor();
-        if(factoredMatrix->size() != softVars)
-            return false;
+            spdStart[i + 1] += spdStart[i];
+        spdValues.resize(entries.size());
 
+        patternChanged = false;
         return true;
     }
 
-    bool solve()
+    //adds the soft constraint c, with pivot variables substituted, into work.  If touched is not
+    //NULL, every column written for the first time is appended to it (and marked)
+    void scatter(int c, const map<V, double> &lhs, vector<int> *touched)
     {
-        result.clear();
-        typename map<pair<C, int>, Constraint>::const_iterator it;
-        vector<double> rhs0, rhs1;
-
-        //grab the rhs's of the constraints
-        for(it = constraints.begin(); it != constraints.end(); ++it) {
-            int idx = constraintMap[it->first];
-            if((int)rhs0.size() <= idx)
-                rhs0.resize(idx + 1, 0.);
-            rhs0[idx] = it->second.rhs;
-        }
-
-        rhs1 = rhs0;
-        int i, j;
-        for(i = softNum; i < (int)rhs1.size(); ++i)
-            rhs1[i] = 0; //for hard constraints, transform is absolute, not "additive"
-        //transform them (as per hard constraints substitution)
-        for(i = 0; i < (int)rhsTransform.size(); ++i) {
-            for(j = 0; j < (int)rhsTransform[i].size(); ++j) {
-                rhs1[rhsTransform[i][j].first] += rhsTransform[i][j].second * rhs0[softNum + i];
+        typename map<V, double>::const_iterator vit = lhs.begin();
+        for(int j = conStart[c]; j < conStart[c + 1]; ++j, ++vit) {
+            int v = conVars[j];
+            double fac = vit->second;
+            int step = freeIdx[v] - softVars; //of the substitution, if v has one
+            if(step < 0) {
+                touch(v, touched);
+                work[v] += fac;
+                continue;
             }
-        }
-
-        //multiply by A^T (as in (A^T A)^-1 x = A^T b )
-        vector<double> rhs2(factoredMatrix->size(), 0);
-        for(i = 0; i < (int)softMatrix.size(); ++i) { //i is row
-            for(j = 0; j < (int)softMatrix[i].size(); ++j) { //softMatrix[i][j].first is column
-                int col = softMatrix[i][j].first;
-                //but the matrix is transposed :)
-                rhs2[col] += softMatrix[i][j].second * rhs1[i];
+            const vector<pair<int, double> > &sub = rows[pivotRow[step]];
+            for(int k = 0; k < (int)sub.size(); ++k) {
+                touch(sub[k].first, touched);
+                work[sub[k].first] += fac * sub[k].second;
             }
         }
+    }
 
-        if(!factoredMatrix->solve(rhs2))
-            return false;
-
-        for(i = 0; i < (int)rhs2.size(); ++i) {
-            result[varIds[i]] = rhs2[i];
+    void touch(int col, vector<int> *touched)
+    {
+        if(touched && !mark[col]) {
+            mark[col] = 1;
+            touched->push_back(col);
         }
-        
-        //now solve for the hard constraints
-        int hardNum = (int)varIds.size() - (int)rhs2.size();
-        for(i = 0; i < hardNum; ++i) {
-            double cur = rhs1[softNum + i];
-            for(j = 0; j < (int)substitutedHard[i].size(); ++j) {
-                cur += substitutedHard[i][j].second * rhs2[substitutedHard[i][j].first];
+    }
+
+    //rows[r] = rows[r] without entry pos + weight * sub, keeping it sorted
+    void substitute(int r, int pos, double weight, const vector<pair<int, double> > &sub)
+    {
+        vector<pair<int, double> > &row = rows[r];
+        merged.clear();
+        int i = 0, j = 0;
+        while(i < (int)row.size() || j < (int)sub.size()) {
+            if(i == pos) {
+                ++i;
+                continue;
+            }
+            if(j == (int)sub.size() || (i < (int)row.size() && row[i].first < sub[j].first))
+                merged.push_back(row[i++]);
+            else if(i == (int)row.size() || sub[j].first < row[i].first) {
+                merged.push_back(make_pair(sub[j].first, weight * sub[j].second));
+                if(sub[j].first < varNum)
+                    colRows[sub[j].first].push_back(r); //r now uses this variable
+                ++j;
+            }
+            else {
+                merged.push_back(make_pair(row[i].first, row[i].second + weight * sub[j].second));
+                ++i;
+                ++j;
             }
-            result[varIds[i + rhs2.size()]] = cur;
         }
-
-        return true;
+        row.swap(merged);
     }
 
-    double getResult(const V &var) const
+    void addRhsTransform(int from, int to, double val)
     {
-        assert(result.find(var) != result.end());
-        return result.find(var)->second;
+        rhsFrom.push_back(from);
+        rhsTo.push_back(to);
+        rhsVal.push_back(val);
     }
 
-private:
-    struct Constraint {
-        Constraint() {}
-        Constraint(bool inHard, const map<V, double> &inLhs, double inRhs = 0.)
-            : hard(inHard), lhs(inLhs), rhs(inRhs) {}
+    int realSize(const vector<pair<int, double> > &row) const //entries that are variables, not rhs columns
+    {
+        return lower_bound(row.begin(), row.end(), make_pair(varNum, -1e300)) - row.begin();
+    }
 
-        bool hard;
-        map<V, double> lhs;
-        double rhs;
-    };
+    static int find(const vector<pair<int, double> > &row, int col)
+    {
+        typename vector<pair<int, double> >::const_iterator it = lower_bound(row.begin(), row.end(), make_pair(col, -1e300));
+        return it != row.end() && it->first == col ? int(it - row.begin()) : -1;
+    }
 
     map<pair<C, int>, Constraint> constraints;
+    bool patternChanged; //set when a constraint is added or uses different variables
 
     //set during solve
-    map<V, double> result;
+    vector<double> result; //by the index in varIds
+    vector<double> rhs0, rhs1, rhs2;
 
-    //variables set during factor
+    //the pattern--recomputed only when it changes
+    int varNum; //number of distinct variables (raw indices are in order of first use)
+    vector<int> conStart, conVars; //raw indices of the variables of every constraint, in map order
+    vector<int> constraintIdx; //row of every constraint in the rhs: soft ones first, hard ones by elimination step
     int softNum; //number of soft constraints
+    int softVars; //number of variables solved for in the least squares sense
     vector<V> varIds; //first the variables softly solved for, then the ones substituted
-    map<pair<C, int>, int> constraintMap;
-    vector<vector<pair<int, double> > > substitutedHard;
-    vector<vector<pair<int, double> > > rhsTransform;
-    vector<vector<pair<int, double> > > softMatrix;
+    map<V, int> varIndex; //inverse of varIds
+    vector<int> freeIdx; //index in varIds of every raw index
+    vector<int> pivotRow, pivotVar, stepOfRow; //elimination order of the hard constraints
+    vector<int> softStart, softCols, softRaw; //soft matrix by rows: free and raw variable indices
+    vector<int> softRhsStart, softRhsCols; //rhs columns that end up in every soft row
+    vector<int> spdStart, productSlot; //where each product of soft entries goes in the lower triangle of A^T A
+    vector<vector<pair<int, double> > > spdm; //the lower triangle of A^T A
+
+    //values--recomputed by every factor
+    vector<double> softVals, spdValues;
+    vector<int> subStart, subCols; //hard variable i = rhs1[softNum + i] + subVals * (free variables subCols)
+    vector<double> subVals;
+    vector<int> rhsFrom, rhsTo; //rhs1[rhsTo] += rhsVal * rhs0[softNum + rhsFrom]
+    vector<double> rhsVal;
+
+    //elimination scratch space
+    vector<vector<pair<int, double> > > rows; //hard constraints, then substitutions, by raw index
+    vector<vector<int> > colRows; //rows that may use every variable
+    vector<pair<int, double> > merged;
+    vector<double> work;
+    vector<char> mark;
+
     LLTMatrix *factoredMatrix;
+    SymbolicLLT symbolic; //kept so refactoring the same pattern skips the symbolic analysis
 };
 
 #endif //LSQSOLVER_H_INCLUDED
@@ -17,6 +17,7 @@
 */
 
 #include "mesh.h"
+#include "meshoperators.h"
 #include "hashutils.h"
 #include "utils.h"
 #include "debugging.h"
@@ -648,19 +649,19 @@ bool Mesh::isConnected() const
     reached[0] = true;
     unsigned int reachedCount = 1;
 
+    MeshAdjacency adj = computeAdjacency(*this);
     int inTodo = 0;
     while(inTodo < (int)todo.size()) {
-        int startEdge = vertices[todo[inTodo++]].edge;
-        int curEdge = startEdge;
-        do {
-            curEdge = edges[edges[curEdge].prev].twin; //walk around
-            int vtx = edges[curEdge].vertex;
+        int cur = todo[inTodo++];
+        const int *ring = adj.ring(cur);
+        for(int j = 0; j < adj.degree(cur); ++j) {
+            int vtx = ring[j];
             if(!reached[vtx]) {
                 reached[vtx] = true;
                 ++reachedCount;
                 todo.push_back(vtx);
             }
-        } while(curEdge != startEdge);        
+        }
     }
 
     return reachedCount == vertices.size();
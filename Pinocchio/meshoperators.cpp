@@ -0,0 +1,148 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "meshoperators.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+//the triangles are the consecutive triples of half-edges; half-edge e goes from
+//edges[edges[e].prev].vertex to edges[e].vertex
+static int nextEdge(int e) { return (e % 3 == 2) ? e - 2 : e + 1; }
+
+MeshAdjacency computeAdjacency(const Mesh &m)
+{
+    int nv = m.vertices.size();
+    MeshAdjacency out;
+    out.offsets.resize(nv + 1, 0);
+
+    //count the degrees, then walk around every vertex in parallel
+    for(int e = 0; e < (int)m.edges.size(); ++e)
+        ++out.offsets[m.edges[m.edges[e].prev].vertex + 1];
+    for(int i = 0; i < nv; ++i)
+        out.offsets[i + 1] += out.offsets[i];
+
+    out.neighbors.resize(out.offsets[nv]);
+    out.halfEdges.resize(out.offsets[nv]);
+    parallelFor(0, nv, [&](int i) {
+        int start = m.vertices[i].edge;
+        if(start < 0)
+            return;
+        int cur = start, idx = out.offsets[i];
+        do {
+            out.neighbors[idx] = m.edges[cur].vertex;
+            out.halfEdges[idx] = cur;
+            ++idx;
+            cur = m.edges[m.edges[cur].prev].twin;
+        } while(cur != start && idx < out.offsets[i + 1]);
+    });
+
+    return out;
+}
+
+vector<double> computeVertexAreas(const Mesh &m, const MeshAdjacency &adj)
+{
+    int nt = m.edges.size() / 3;
+    vector<double> triArea(nt);
+    parallelFor(0, nt, [&](int t) {
+        const Pinocchio::Vector3 &p0 = m.vertices[m.edges[3 * t].vertex].pos;
+        const Pinocchio::Vector3 &p1 = m.vertices[m.edges[3 * t + 1].vertex].pos;
+        const Pinocchio::Vector3 &p2 = m.vertices[m.edges[3 * t + 2].vertex].pos;
+        triArea[t] = ((p1 - p0) % (p2 - p0)).length();
+    });
+
+    //every outgoing half-edge belongs to a different triangle around the vertex
+    vector<double> out(adj.size(), 0.);
+    parallelFor(0, adj.size(), [&](int i) {
+        for(int k = adj.offsets[i]; k < adj.offsets[i + 1]; ++k)
+            out[i] += triArea[adj.halfEdges[k] / 3];
+    });
+
+    return out;
+}
+
+vector<vector<pair<int, double> > > computeCotLaplacian(const Mesh &m, const MeshAdjacency &adj,
+                                                        const vector<double> &diagonalAdd)
+{
+    int ne = m.edges.size();
+
+    //cotangent of the angle opposite every half-edge, computed triangle by triangle
+    vector<double> cot(ne);
+    parallelFor(0, ne / 3, [&](int t) {
+        for(int e = 3 * t; e < 3 * t + 3; ++e) {
+            const Pinocchio::Vector3 &from = m.vertices[m.edges[m.edges[e].prev].vertex].pos;
+            const Pinocchio::Vector3 &to = m.vertices[m.edges[e].vertex].pos;
+            const Pinocchio::Vector3 &opp = m.vertices[m.edges[nextEdge(e)].vertex].pos;
+            Pinocchio::Vector3 v1 = from - opp, v2 = to - opp;
+            cot[e] = (v1 * v2) / (1e-6 + (v1 % v2).length());
+        }
+    });
+
+    vector<vector<pair<int, double> > > out(adj.size());
+    parallelFor(0, adj.size(), [&](int i) {
+        double sum = 0.;
+        for(int k = adj.offsets[i]; k < adj.offsets[i + 1]; ++k) {
+            int e = adj.halfEdges[k];
+            double w = cot[e] + cot[m.edges[e].twin];
+            sum += w;
+            if(adj.neighbors[k] < i)
+                out[i].push_back(make_pair(adj.neighbors[k], -w));
+        }
+        sort(out[i].begin(), out[i].end());
+        out[i].push_back(make_pair(i, sum + (diagonalAdd.empty() ? 0. : diagonalAdd[i])));
+    });
+
+    return out;
+}
+
+unsigned long long connectivityHash(const Mesh &m)
+{
+    //FNV-1a over the vertex count, the edge of every vertex and the half-edges
+    unsigned long long out = 14695981039346656037ULL;
+    auto add = [&out](unsigned int x) {
+        for(int b = 0; b < 4; ++b, x >>= 8) {
+            out ^= (unsigned char)x;
+            out *= 1099511628211ULL;
+        }
+    };
+
+    add(m.vertices.size());
+    for(int i = 0; i < (int)m.vertices.size(); ++i)
+        add(m.vertices[i].edge);
+    for(int e = 0; e < (int)m.edges.size(); ++e) {
+        add(m.edges[e].vertex);
+        add(m.edges[e].prev);
+        add(m.edges[e].twin);
+    }
+    return out;
+}
+
+vector<Pinocchio::Vector3> ringNormals(const Mesh &m, const MeshAdjacency &adj, int i)
+{
+    int deg = adj.degree(i);
+    const int *ring = adj.ring(i);
+    const Pinocchio::Vector3 &cPos = m.vertices[i].pos;
+
+    vector<Pinocchio::Vector3> out(deg);
+    for(int j = 0; j < deg; ++j) {
+        Pinocchio::Vector3 v1 = m.vertices[ring[j]].pos - cPos;
+        Pinocchio::Vector3 v2 = m.vertices[ring[(j + 1) % deg]].pos - cPos;
+        out[j] = (v1 % v2).normalize();
+    }
+    return out;
+}
@@ -0,0 +1,56 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef MESHOPERATORS_H_INCLUDED
+#define MESHOPERATORS_H_INCLUDED
+
+#include "mesh.h"
+
+//one-ring adjacency in compressed rows: the neighbors of vertex i, in order around it, are
+//neighbors[offsets[i]] ... neighbors[offsets[i + 1] - 1].  halfEdges holds the matching
+//outgoing half-edge for each neighbor.
+struct MeshAdjacency
+{
+    int size() const { return (int)offsets.size() - 1; }
+    int degree(int i) const { return offsets[i + 1] - offsets[i]; }
+    const int *ring(int i) const { return &neighbors[offsets[i]]; }
+
+    vector<int> offsets;
+    vector<int> neighbors;
+    vector<int> halfEdges;
+};
+
+MeshAdjacency PINOCCHIO_API computeAdjacency(const Mesh &m);
+
+//twice the area of the triangles around each vertex
+vector<double> PINOCCHIO_API computeVertexAreas(const Mesh &m, const MeshAdjacency &adj);
+
+//cotangent Laplacian as the rows of its lower triangle, each sorted by column with the diagonal last--
+//the format SPDMatrix takes.  Off-diagonal entries are minus the sum of the two cotangents opposite
+//the edge, diagonal entries the sum over the row plus diagonalAdd[i] (if not empty).
+vector<vector<pair<int, double> > > PINOCCHIO_API computeCotLaplacian(const Mesh &m, const MeshAdjacency &adj,
+                                                                      const vector<double> &diagonalAdd = vector<double>());
+
+//64-bit hash of the connectivity (the half-edge structure), which is all the pattern of the
+//Laplacian depends on--meshes that differ only in vertex positions hash the same
+unsigned long long PINOCCHIO_API connectivityHash(const Mesh &m);
+
+//normals of the triangles around vertex i, in ring order
+vector<Pinocchio::Vector3> PINOCCHIO_API ringNormals(const Mesh &m, const MeshAdjacency &adj, int i);
+
+#endif //MESHOPERATORS_H_INCLUDED
@@ -0,0 +1,190 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "optimizer.h"
+
+static double dot(const vector<double> &a, const vector<double> &b)
+{
+    double out = 0.;
+    for(int i = 0; i < (int)a.size(); ++i)
+        out += a[i] * b[i];
+    return out;
+}
+
+double LBFGSOptimizer::minimize(Objective &objective, vector<double> &x)
+{
+    int i, j;
+    int n = x.size();
+    stats = OptimizerStats();
+
+    vector<double> gradient(n);
+    double value = objective.gradient(x, gradient);
+    ++stats.gradients;
+    stats.initialValue = value;
+
+    vector<vector<double> > s, y; //correction pairs, oldest first
+    vector<double> rho;
+    vector<double> dir(n), alpha;
+    int smallDecreases = 0; //consecutive iterations that decreased the value by less than relativeTol
+
+    for(stats.iterations = 0; stats.iterations < maxIterations; ++stats.iterations) {
+        if(sqrt(dot(gradient, gradient)) < gradientTol) {
+            stats.converged = true;
+            break;
+        }
+
+        //two loop recursion: dir = -H * gradient
+        for(i = 0; i < n; ++i)
+            dir[i] = -gradient[i];
+        alpha.resize(s.size());
+        for(j = (int)s.size() - 1; j >= 0; --j) {
+            alpha[j] = rho[j] * dot(s[j], dir);
+            for(i = 0; i < n; ++i)
+                dir[i] -= alpha[j] * y[j][i];
+        }
+        double step = 1.;
+        if(s.empty()) //no curvature information yet
+            step = initialStep / sqrt(dot(dir, dir));
+        else {
+            double gamma = dot(s.back(), y.back()) / dot(y.back(), y.back());
+            for(i = 0; i < n; ++i)
+                dir[i] *= gamma;
+        }
+        for(j = 0; j < (int)s.size(); ++j) {
+            double beta = rho[j] * dot(y[j], dir);
+            for(i = 0; i < n; ++i)
+                dir[i] += s[j][i] * (alpha[j] - beta);
+        }
+
+        if(dot(dir, gradient) >= 0.) { //not a descent direction--restart from steepest descent
+            s.clear();
+            y.clear();
+            rho.clear();
+            for(i = 0; i < n; ++i)
+                dir[i] = -gradient[i];
+            step = initialStep / sqrt(dot(dir, dir));
+        }
+
+        vector<double> oldX = x, oldGradient = gradient;
+        double oldValue = value;
+        if(!lineSearch(objective, x, value, gradient, dir, step))
+            break;
+
+        if(oldValue - value > relativeTol * fabs(oldValue))
+            smallDecreases = 0;
+        else if(++smallDecreases >= stallIterations) {
+            ++stats.iterations;
+            break;
+        }
+
+        vector<double> ds(n), dy(n);
+        for(i = 0; i < n; ++i) {
+            ds[i] = x[i] - oldX[i];
+            dy[i] = gradient[i] - oldGradient[i];
+        }
+        double sy = dot(ds, dy);
+        if(sy > 1e-16) { //skip updates that would lose positive definiteness
+            if((int)s.size() == memory) {
+                s.erase(s.begin());
+                y.erase(y.begin());
+                rho.erase(rho.begin());
+            }
+            s.push_back(ds);
+            y.push_back(dy);
+            rho.push_back(1. / sy);
+        }
+    }
+
+    stats.finalValue = value;
+    return value;
+}
+
+//bracketing and zooming line search (Nocedal and Wright, algorithms 3.5 and 3.6)
+bool LBFGSOptimizer::lineSearch(Objective &objective, vector<double> &x, double &value, vector<double> &gradient,
+                                const vector<double> &dir, double step)
+{
+    int i;
+    int n = x.size();
+    vector<double> start = x, trialGradient(n), loGradient = gradient;
+
+    double value0 = value;
+    double slope0 = dot(gradient, dir);
+
+    double lo = 0., hi = -1.; //hi < 0 means that the minimum is not bracketed yet
+    double loValue = value0, loSlope = slope0, hiValue = 0.;
+
+    for(int count = 0; count < maxLineSearch; ++count) {
+        for(i = 0; i < n; ++i)
+            x[i] = start[i] + step * dir[i];
+        //the value alone decides most trials, so the gradient is only computed once it is known to be needed
+        double trialValue = objective.evaluate(x);
+        ++stats.evaluations;
+
+        if(trialValue > value0 + armijo * step * slope0 || trialValue >= loValue) {
+            hi = step;
+            hiValue = trialValue;
+        }
+        else {
+            trialValue = objective.gradient(x, trialGradient);
+            ++stats.gradients;
+            double trialSlope = dot(trialGradient, dir);
+
+            if(fabs(trialSlope) <= -wolfe * slope0) { //strong Wolfe conditions hold
+                value = trialValue;
+                gradient = trialGradient;
+                return true;
+            }
+            if(trialSlope * ((hi < 0. ? step * 2. : hi) - step) >= 0.) {
+                hi = lo;
+                hiValue = loValue;
+            }
+            lo = step;
+            loValue = trialValue;
+            loSlope = trialSlope;
+            loGradient = trialGradient;
+        }
+
+        if(hi < 0.) //expand
+            step *= 2.;
+        else { //minimum of the quadratic through lo and hi, safeguarded to the middle of the bracket
+            double width = hi - lo; //negative if hi is below lo
+            double a = min(lo, hi), b = max(lo, hi);
+            if(b - a <= 1e-12 * b) //bracket collapsed
+                break;
+            double next = lo + 0.5 * width;
+            double denom = 2. * (hiValue - loValue - loSlope * width);
+            if(denom > 0.)
+                next = lo - loSlope * width * width / denom;
+            if(!(next > a + 0.1 * (b - a) && next < b - 0.1 * (b - a)))
+                next = 0.5 * (a + b);
+            step = next;
+        }
+    }
+
+    //settle for sufficient decrease if the curvature condition could not be met
+    if(lo > 0.) {
+        for(i = 0; i < n; ++i)
+            x[i] = start[i] + lo * dir[i];
+        value = loValue;
+        gradient = loGradient;
+        return true;
+    }
+
+    x = start;
+    return false;
+}
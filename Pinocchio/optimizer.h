@@ -0,0 +1,101 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef OPTIMIZER_H_INCLUDED
+#define OPTIMIZER_H_INCLUDED
+
+#include <vector>
+
+#include "mathutils.h"
+
+/**
+* Function to be minimized by an Optimizer
+*/
+class Objective
+{
+public:
+    virtual ~Objective() {}
+    virtual double evaluate(const vector<double> &x) = 0;
+    //returns the value at x and puts the gradient into gradient
+    virtual double gradient(const vector<double> &x, vector<double> &gradient) = 0;
+};
+
+/**
+* What happened during the last Optimizer::minimize call
+*/
+struct OptimizerStats
+{
+    OptimizerStats() : iterations(0), evaluations(0), gradients(0), initialValue(0.), finalValue(0.), converged(false) {}
+
+    int iterations;
+    int evaluations; //calls to Objective::evaluate
+    int gradients; //calls to Objective::gradient
+    double initialValue;
+    double finalValue;
+    bool converged; //the gradient vanished--false if the value stalled, maxIterations was hit or the line search failed
+};
+
+/**
+* Unconstrained local minimizer -- refineEmbedding accepts any subclass
+*/
+class PINOCCHIO_API Optimizer
+{
+public:
+    virtual ~Optimizer() {}
+
+    //minimizes starting at x, leaves the minimum in x and returns the value there
+    virtual double minimize(Objective &objective, vector<double> &x) = 0;
+
+    const OptimizerStats &getStats() const { return stats; }
+
+protected:
+    OptimizerStats stats;
+};
+
+/**
+* Limited memory BFGS with a line search that enforces the strong Wolfe conditions
+* (sufficient decrease with constant armijo, curvature with constant wolfe).
+* Stops when the gradient norm falls below gradientTol or stallIterations iterations in a row
+* each decrease the value by less than relativeTol times the value--a single small decrease
+* is not enough, since the first steps are short before any curvature is known.
+*/
+class PINOCCHIO_API LBFGSOptimizer : public Optimizer
+{
+public:
+    LBFGSOptimizer() : memory(6), maxIterations(200), maxLineSearch(10), gradientTol(1e-6),
+                       relativeTol(1e-6), stallIterations(3), armijo(1e-4), wolfe(0.9), initialStep(1e-3) {}
+
+    double minimize(Objective &objective, vector<double> &x);
+
+    int memory; //number of correction pairs kept
+    int maxIterations;
+    int maxLineSearch; //function evaluations per line search
+    double gradientTol;
+    double relativeTol;
+    int stallIterations;
+    double armijo;
+    double wolfe;
+    double initialStep; //length of the first step, before any curvature is known
+
+private:
+    //finds step along dir, updates x, value and gradient; returns false on failure
+    bool lineSearch(Objective &objective, vector<double> &x, double &value, vector<double> &gradient,
+                    const vector<double> &dir, double step);
+};
+
+#endif //OPTIMIZER_H_INCLUDED
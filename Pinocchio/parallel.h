@@ -0,0 +1,238 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef PARALLEL_H_INCLUDED
+#define PARALLEL_H_INCLUDED
+
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <vector>
+
+#include "mathutils.h"
+
+//number of threads the parallel loops may use -- 0 means one per hardware thread
+inline int &parallelThreadSetting() { static int threads = 0; return threads; }
+inline void setNumThreads(int threads) { parallelThreadSetting() = threads; }
+
+//true on the threads running the body of a parallel loop--loops nested in it then run serially
+//instead of each starting its own threads
+inline bool &insideParallelLoop() { static thread_local bool inside = false; return inside; }
+
+inline int getNumThreads()
+{
+    if(insideParallelLoop())
+        return 1;
+    int out = parallelThreadSetting();
+    if(out <= 0)
+        out = (int)thread::hardware_concurrency();
+    return out < 1 ? 1 : out;
+}
+
+//threads the parallel loops run on, started when first needed and then kept, blocked on a condition
+//variable between loops, so that loops called many times a second (e.g., per frame or per objective
+//evaluation) do not pay for starting threads
+class ThreadPool
+{
+public:
+    //never destroyed: its threads block until the process exits
+    static ThreadPool &instance() { static ThreadPool *pool = new ThreadPool(); return *pool; }
+
+    //calls job(t) for every t in [0, threads), job(0) on this thread and the others on pool threads, and
+    //returns when all have.  While another thread is using the pool, only job(0) is called, so job(0)
+    //must be able to do all the work alone--the loops below hand out work dynamically, so it can.
+    void run(int threads, const function<void(int)> &job)
+    {
+        if(threads <= 1 || !busy.try_lock()) {
+            job(0);
+            return;
+        }
+
+        {
+            lock_guard<mutex> guard(lock);
+            while((int)workers.size() < threads - 1)
+                workers.push_back(thread(&ThreadPool::loop, this, (int)workers.size() + 1));
+            curJob = &job;
+            active = threads;
+            remaining = threads - 1;
+            ++generation;
+        }
+        wake.notify_all();
+
+        job(0);
+
+        {
+            unique_lock<mutex> guard(lock);
+            finished.wait(guard, [this]() { return remaining == 0; });
+        }
+        busy.unlock();
+    }
+
+private:
+    ThreadPool() : curJob(NULL), active(0), remaining(0), generation(0) {}
+
+    void loop(int index)
+    {
+        insideParallelLoop() = true;
+        long long seen = 0;
+        unique_lock<mutex> guard(lock);
+        while(true) {
+            wake.wait(guard, [&]() { return generation != seen; });
+            seen = generation;
+            if(index >= active)
+                continue;
+
+            const function<void(int)> *job = curJob;
+            guard.unlock();
+            (*job)(index);
+            guard.lock();
+            if(--remaining == 0)
+                finished.notify_one();
+        }
+    }
+
+    mutex busy; //held for the whole of run
+    mutex lock; //protects the fields below
+    condition_variable wake, finished;
+    vector<thread> workers;
+    const function<void(int)> *curJob;
+    int active, remaining;
+    long long generation;
+};
+
+//calls func(i) for every i in [begin, end).  Iterations are handed out one at a time,
+//so func should do a reasonable amount of work and must be safe to call concurrently.
+template<class F> void parallelFor(int begin, int end, const F &func)
+{
+    int threads = min(getNumThreads(), end - begin);
+    if(threads <= 1) {
+        for(int i = begin; i < end; ++i)
+            func(i);
+        return;
+    }
+
+    atomic<int> next(begin);
+    auto work = [&]() {
+        bool outer = insideParallelLoop();
+        insideParallelLoop() = true;
+        for(int i = next++; i < end; i = next++)
+            func(i);
+        insideParallelLoop() = outer;
+    };
+
+    ThreadPool::instance().run(threads, [&](int) { work(); });
+}
+
+//calls func(i, worker) for every node i of the forest given by parent (-1 for roots), each one only
+//after func has returned for all of its children.  worker is in [0, getNumThreads()) and identifies
+//the calling thread, for per-thread scratch space.  Every worker keeps its ready nodes in a deque,
+//takes the newest one itself and steals the oldest ones from the others when it runs out, so it
+//mostly stays within one subtree.  Workers with nothing to take sleep until a node becomes ready.
+template<class F> void parallelTree(const vector<int> &parent, const F &func)
+{
+    int n = parent.size();
+    int threads = n < 1 ? 1 : min(getNumThreads(), n);
+
+    struct Queue
+    {
+        mutex lock;
+        deque<int> nodes;
+    };
+    vector<Queue> queues(threads);
+    vector<atomic<int> > pending(n); //children not done yet
+    for(int i = 0; i < n; ++i)
+        pending[i] = 0;
+    for(int i = 0; i < n; ++i)
+        if(parent[i] != -1)
+            ++pending[parent[i]];
+
+    //hand out the leaves in contiguous runs, which tend to be subtrees
+    vector<int> leaves;
+    for(int i = 0; i < n; ++i)
+        if(pending[i] == 0)
+            leaves.push_back(i);
+    for(int i = 0; i < (int)leaves.size(); ++i)
+        queues[(long long)i * threads / leaves.size()].nodes.push_front(leaves[i]);
+
+    atomic<int> done(0);
+    atomic<int> queued((int)leaves.size()); //nodes in the queues
+    atomic<int> sleeping(0);
+    mutex sleepLock;
+    condition_variable ready;
+    auto wakeSleepers = [&](bool all) {
+        if(sleeping == 0) //queued or done was changed first, so a worker about to sleep will see that
+            return;
+        lock_guard<mutex> guard(sleepLock); //a worker that saw nothing to do is waiting by now
+        if(all)
+            ready.notify_all();
+        else
+            ready.notify_one();
+    };
+
+    auto work = [&](int worker) {
+        bool outer = insideParallelLoop();
+        insideParallelLoop() = true;
+        while(done < n) {
+            int node = -1;
+            for(int k = 0; node == -1 && k < threads; ++k) {
+                Queue &q = queues[(worker + k) % threads];
+                lock_guard<mutex> guard(q.lock);
+                if(q.nodes.empty())
+                    continue;
+                if(k == 0) {
+                    node = q.nodes.back();
+                    q.nodes.pop_back();
+                }
+                else {
+                    node = q.nodes.front();
+                    q.nodes.pop_front();
+                }
+                --queued;
+            }
+            if(node == -1) { //nothing ready--wait for the others
+                unique_lock<mutex> guard(sleepLock);
+                ++sleeping;
+                ready.wait(guard, [&]() { return queued > 0 || done == n; });
+                --sleeping;
+                continue;
+            }
+
+            func(node, worker);
+
+            int p = parent[node];
+            if(p != -1 && --pending[p] == 0) {
+                {
+                    lock_guard<mutex> guard(queues[worker].lock);
+                    queues[worker].nodes.push_back(p);
+                    ++queued;
+                }
+                wakeSleepers(false);
+            }
+            if(++done == n)
+                wakeSleepers(true);
+        }
+        insideParallelLoop() = outer;
+    };
+
+    ThreadPool::instance().run(threads, work);
+}
+
+#endif //PARALLEL_H_INCLUDED
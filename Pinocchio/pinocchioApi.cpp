@@ -18,13 +18,74 @@
 
 #include "pinocchioApi.h"
 #include "debugging.h"
+#include "parallel.h"
+#include "voxelheat.h"
 #include <fstream>
+#include <sstream>
 
 ostream *Debugging::outStream = new ofstream();
+thread_local ostream *Debugging::threadOutStream = NULL;
 
-PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
+static bool mirrorSymmetrySetting = false;
+
+void setUseMirrorSymmetry(bool use) { mirrorSymmetrySetting = use; }
+bool useMirrorSymmetry() { return mirrorSymmetrySetting; }
+
+//the mirror map of the prepared mesh if symmetric rigging is on and the mesh is symmetric, empty otherwise
+static vector<int> findMirror(const Mesh &m)
+{
+    vector<int> mirror;
+    if(useMirrorSymmetry() && detectMirrorSymmetry(m, &mirror))
+        Debugging::out() << "Mesh is mirror symmetric, rigging one half" << endl;
+    return mirror;
+}
+
+//discrete embedding and refinement of one skeleton into the prepared mesh.
+//Returns an empty embedding on failure.
+static vector<Pinocchio::Vector3> embedSkeleton(const Skeleton &given, TreeType *distanceField,
+                                                const vector<Sphere> &medialSurface, const vector<Sphere> &spheres,
+                                                const PtGraph &graph, const vector<Pinocchio::Vector3> &previousEmbedding,
+                                                double *penalty = NULL)
 {
     int i;
+
+    //discrete embedding
+    vector<vector<int> > possibilities = computePossibilities(graph, spheres, given);
+
+    //constraints can be set by respecifying possibilities for skeleton joints:
+    //to constrain joint i to sphere j, use: possiblities[i] = vector<int>(1, j);
+
+    vector<int> embeddingIndices;
+    if(previousEmbedding.size() > 0)
+        embeddingIndices = discreteEmbedWarm(graph, spheres, given, possibilities, previousEmbedding);
+    else if((int)given.cGraph().verts.size() > hierarchicalEmbedJoints)
+        embeddingIndices = discreteEmbedHierarchical(graph, spheres, given, possibilities);
+    else
+        embeddingIndices = discreteEmbed(graph, spheres, given, possibilities);
+
+    if(embeddingIndices.size() == 0) //failure
+        return vector<Pinocchio::Vector3>();
+
+    if(penalty)
+        *penalty = embeddingPenalty(graph, spheres, given, embeddingIndices);
+
+    vector<Pinocchio::Vector3> discreteEmbedding = splitPaths(embeddingIndices, graph, given);
+
+    //continuous refinement
+    vector<Pinocchio::Vector3> medialCenters(medialSurface.size());
+    for(i = 0; i < (int)medialSurface.size(); ++i)
+        medialCenters[i] = medialSurface[i].center;
+
+    return refineEmbedding(distanceField, medialCenters, discreteEmbedding, given);
+}
+
+PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
+{
+    return autorig(given, m, vector<Pinocchio::Vector3>());
+}
+
+PinocchioOutput autorig(const Skeleton &given, const Mesh &m, const vector<Pinocchio::Vector3> &previousEmbedding)
+{
     PinocchioOutput out;
 
     Mesh newMesh = prepareMesh(m);
@@ -32,6 +93,49 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
     if(newMesh.vertices.size() == 0)
         return out;
 
+    vector<int> mirror = findMirror(newMesh);
+    bool symmetric = !mirror.empty();
+
+    TreeType *distanceField = constructDistanceField(newMesh, defaultTreeTol, symmetric);
+
+    //discretization
+    vector<Sphere> medialSurface = sampleMedialSurface(distanceField, defaultTreeTol, symmetric);
+
+    vector<Sphere> spheres = packSpheres(medialSurface);
+
+    PtGraph graph = connectSamples(distanceField, spheres);
+
+    out.embedding = embedSkeleton(given, distanceField, medialSurface, spheres, graph, previousEmbedding);
+
+    if(out.embedding.size() == 0) { //failure
+        delete distanceField;
+        return out;
+    }
+    if(symmetric)
+        out.embedding = symmetrizeEmbedding(out.embedding, given);
+
+    //attachment
+    VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
+    out.attachment = new Attachment(newMesh, given, out.embedding, tester, 1., NULL, symmetric ? &mirror : NULL);
+
+    //cleanup
+    delete tester;
+    delete distanceField;
+
+    return out;
+}
+
+PinocchioOutput autorigVoxelHeat(const Skeleton &given, const Mesh &m, int resolution, double initialHeatWeight)
+{
+    PinocchioOutput out;
+
+    if(m.vertices.size() == 0)
+        return out;
+
+    Mesh newMesh = m; //prepareMesh without the connectivity check
+    newMesh.computeVertexNormals();
+    newMesh.normalizeBoundingBox();
+
     TreeType *distanceField = constructDistanceField(newMesh);
 
     //discretization
@@ -41,31 +145,77 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
 
     PtGraph graph = connectSamples(distanceField, spheres);
 
-    //discrete embedding
-    vector<vector<int> > possibilities = computePossibilities(graph, spheres, given);
+    out.embedding = embedSkeleton(given, distanceField, medialSurface, spheres, graph, vector<Pinocchio::Vector3>());
 
-    //constraints can be set by respecifying possibilities for skeleton joints:
-    //to constrain joint i to sphere j, use: possiblities[i] = vector<int>(1, j);
+    //attachment
+    if(out.embedding.size() > 0)
+        out.attachment = voxelHeatAttachment(newMesh, given, out.embedding, distanceField, resolution, initialHeatWeight);
 
-    vector<int> embeddingIndices = discreteEmbed(graph, spheres, given, possibilities);
+    delete distanceField;
 
-    if(embeddingIndices.size() == 0) { //failure
-        delete distanceField;
+    return out;
+}
+
+PinocchioOutput autorig(const vector<Skeleton> &candidates, const Mesh &m, int *chosen)
+{
+    int i;
+    PinocchioOutput out;
+
+    if(chosen)
+        *chosen = -1;
+
+    Mesh newMesh = prepareMesh(m);
+
+    if(newMesh.vertices.size() == 0 || candidates.size() == 0)
         return out;
-    }
 
-    vector<Pinocchio::Vector3> discreteEmbedding = splitPaths(embeddingIndices, graph, given);
+    vector<int> mirror = findMirror(newMesh);
+    bool symmetric = !mirror.empty();
 
-    //continuous refinement
-    vector<Pinocchio::Vector3> medialCenters(medialSurface.size());
-    for(i = 0; i < (int)medialSurface.size(); ++i)
-        medialCenters[i] = medialSurface[i].center;
+    TreeType *distanceField = constructDistanceField(newMesh, defaultTreeTol, symmetric);
 
-    out.embedding = refineEmbedding(distanceField, medialCenters, discreteEmbedding, given);
+    //discretization is shared by all the skeletons
+    vector<Sphere> medialSurface = sampleMedialSurface(distanceField, defaultTreeTol, symmetric);
 
-    //attachment
+    vector<Sphere> spheres = packSpheres(medialSurface);
+
+    PtGraph graph = connectSamples(distanceField, spheres);
+
+    vector<vector<Pinocchio::Vector3> > embeddings(candidates.size());
+    vector<double> penalties(candidates.size(), 1e37);
+    vector<ostringstream> logs(candidates.size()); //printed in order after all are embedded
+    parallelFor(0, (int)candidates.size(), [&](int c) {
+        Debugging::setThreadOutStream(&logs[c]);
+        embeddings[c] = embedSkeleton(candidates[c], distanceField, medialSurface, spheres, graph,
+                                      vector<Pinocchio::Vector3>(), &penalties[c]);
+        Debugging::setThreadOutStream(NULL);
+    });
+
+    int best = -1;
+    for(i = 0; i < (int)candidates.size(); ++i) {
+        Debugging::out() << logs[i].str();
+        if(embeddings[i].size() == 0)
+            continue;
+        Debugging::out() << "Skeleton " << i << " residual = " << penalties[i] << endl;
+        if(best == -1 || penalties[i] < penalties[best])
+            best = i;
+    }
+
+    if(best == -1) { //failure
+        delete distanceField;
+        return out;
+    }
+
+    if(chosen)
+        *chosen = best;
+    out.embedding = embeddings[best];
+    if(symmetric)
+        out.embedding = symmetrizeEmbedding(out.embedding, candidates[best]);
+
+    //attachment only for the winner
     VisTester<TreeType> *tester = new VisTester<TreeType>(distanceField);
-    out.attachment = new Attachment(newMesh, given, out.embedding, tester);
+    out.attachment = new Attachment(newMesh, candidates[best], out.embedding, tester, 1., NULL,
+                                    symmetric ? &mirror : NULL);
 
     //cleanup
     delete tester;
@@ -73,4 +223,3 @@ PinocchioOutput autorig(const Skeleton &given, const Mesh &m)
 
     return out;
 }
-
@@ -22,6 +22,7 @@
 #include "mesh.h"
 #include "quaddisttree.h"
 #include "attachment.h"
+#include "optimizer.h"
 
 struct PinocchioOutput
 {
@@ -35,17 +36,50 @@ struct PinocchioOutput
 //see the implementation of this function to find out how to use the individual functions
 PinocchioOutput PINOCCHIO_API autorig(const Skeleton &given, const Mesh &m);
 
+//same, but the discrete embedding starts from previousEmbedding (e.g. the PinocchioOutput::embedding
+//of a similar mesh rigged with the same skeleton) and only falls back to the full search if that fails
+PinocchioOutput PINOCCHIO_API autorig(const Skeleton &given, const Mesh &m,
+                                      const vector<Pinocchio::Vector3> &previousEmbedding);
+
+//rigs the mesh with whichever candidate skeleton embeds with the lowest residual penalty.  The distance
+//field and sphere graph are computed once and the candidates are embedded in parallel; only the best
+//one gets an attachment.  If chosen is not NULL, it is set to the index of that skeleton (-1 on failure).
+PinocchioOutput PINOCCHIO_API autorig(const vector<Skeleton> &candidates, const Mesh &m, int *chosen = NULL);
+
+static const int defaultVoxelHeatResolution = 128; //voxels along each side of the unit cube
+
+//same as autorig, but the weights come from heat diffusion through the volume (see voxelheat.h) and no
+//mesh Laplacian is set up.  Only the distance field looks at the mesh, so it need not be a single connected
+//component: it is normalized as in prepareMesh, but not rejected for having several.
+PinocchioOutput PINOCCHIO_API autorigVoxelHeat(const Skeleton &given, const Mesh &m,
+                                               int resolution = defaultVoxelHeatResolution,
+                                               double initialHeatWeight = 1.);
+
 //============================================individual steps=====================================
 
 //fits mesh inside unit cube, makes sure there's exactly one connected component
 Mesh PINOCCHIO_API prepareMesh(const Mesh &m);
 
+static const double defaultSymmetryTol = 0.002;
+
+//checks whether the prepared mesh is its own mirror image about the x = 0.5 plane: every vertex must have
+//a mirror vertex within tol and every triangle a mirror triangle.  If so and mirror is not NULL, it is set
+//to the mirror of every vertex (vertices on the plane are their own).
+bool PINOCCHIO_API detectMirrorSymmetry(const Mesh &m, vector<int> *mirror = NULL, double tol = defaultSymmetryTol);
+
+//when on (off by default), autorig checks the mesh for mirror symmetry and, if it is symmetric, computes
+//the distance field, the medial surface and the weights for one half and mirrors them onto the other
+void PINOCCHIO_API setUseMirrorSymmetry(bool use);
+bool PINOCCHIO_API useMirrorSymmetry();
+
 
 typedef DRootNode<DistData<3>, 3, ArrayIndexer> TreeType; //our distance field octree type
 static const double defaultTreeTol = 0.003;
 
-//constructs a distance field on an octree--user responsible for deleting output
-TreeType PINOCCHIO_API *constructDistanceField(const Mesh &m, double tol = defaultTreeTol);
+//constructs a distance field on an octree--user responsible for deleting output.  If mirrorX, the
+//mesh must be mirror symmetric (see detectMirrorSymmetry) and only the x > 0.5 half of the octree is
+//built; locate() mirrors points on the other half into it.
+TreeType PINOCCHIO_API *constructDistanceField(const Mesh &m, double tol = defaultTreeTol, bool mirrorX = false);
 
 struct Sphere {
     Sphere() : radius(0.) {}
@@ -56,8 +90,9 @@ struct Sphere {
 };
 
 //samples the distance field to find spheres on the medial surface
-//output is sorted by radius in decreasing order
-vector<Sphere> PINOCCHIO_API sampleMedialSurface(TreeType *distanceField, double tol = defaultTreeTol);
+//output is sorted by radius in decreasing order.  If mirrorX, only the half with x > 0.5 is sampled
+//and the samples are mirrored onto the other one.
+vector<Sphere> PINOCCHIO_API sampleMedialSurface(TreeType *distanceField, double tol = defaultTreeTol, bool mirrorX = false);
 
 //takes sorted medial surface samples and sparsifies the vector
 vector<Sphere> PINOCCHIO_API packSpheres(const vector<Sphere> &samples, int maxSpheres = 1000);
@@ -73,13 +108,52 @@ vector<vector<int> > PINOCCHIO_API computePossibilities(const PtGraph &graph, co
 vector<int> PINOCCHIO_API discreteEmbed(const PtGraph &graph, const vector<Sphere> &spheres,
                                         const Skeleton &skeleton, const vector<vector<int> > &possibilities);
 
+static const int defaultMaxStageJoints = 8;
+static const int hierarchicalEmbedJoints = 12; //autorig embeds skeletons with more compressed joints hierarchically
+
+//finds discrete embedding for skeletons with many joints: the torso is embedded first, then each
+//limb subtree independently and in parallel, split further if it has more than maxStageJoints joints.
+//Cross-limb penalties are reconciled at the end.  Same as discreteEmbed for small skeletons.
+vector<int> PINOCCHIO_API discreteEmbedHierarchical(const PtGraph &graph, const vector<Sphere> &spheres,
+                                                    const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                                                    int maxStageJoints = defaultMaxStageJoints);
+
+//penalty (residual) of a complete discrete embedding, as reported by discreteEmbed
+double PINOCCHIO_API embeddingPenalty(const PtGraph &graph, const vector<Sphere> &spheres,
+                                      const Skeleton &skeleton, const vector<int> &embeddingIndices);
+
+static const int defaultWarmStartCandidates = 6;
+static const double defaultWarmStartMaxPenalty = 0.5;
+
+//restricts the possibilities of every joint to the candidates spheres closest to where the joint
+//was in previousEmbedding (one point per joint of the unreduced skeleton)
+vector<vector<int> > PINOCCHIO_API warmStartPossibilities(const PtGraph &graph, const Skeleton &skeleton,
+                                                          const vector<vector<int> > &possibilities,
+                                                          const vector<Pinocchio::Vector3> &previousEmbedding,
+                                                          int candidates = defaultWarmStartCandidates);
+
+//finds discrete embedding among the warm start possibilities.  If there is no match or its
+//residual is above maxPenalty, runs the full search on possibilities instead.
+vector<int> PINOCCHIO_API discreteEmbedWarm(const PtGraph &graph, const vector<Sphere> &spheres,
+                                            const Skeleton &skeleton, const vector<vector<int> > &possibilities,
+                                            const vector<Pinocchio::Vector3> &previousEmbedding,
+                                            double maxPenalty = defaultWarmStartMaxPenalty,
+                                            int candidates = defaultWarmStartCandidates);
+
 //reinserts joints for unreduced skeleton
 vector<Pinocchio::Vector3> PINOCCHIO_API splitPaths(const vector<int> &discreteEmbedding, const PtGraph &graph,
                                          const Skeleton &skeleton);
 
-//refines embedding
+//refines embedding by minimizing the fine error with optimizer (an LBFGSOptimizer if NULL).  When the optimizer
+//stalls at a jump in the error, a round of per bone steps gets it going again, until a round stops helping.
 vector<Pinocchio::Vector3> PINOCCHIO_API refineEmbedding(TreeType *distanceField, const vector<Pinocchio::Vector3> &medialSurface,
-                                              const vector<Pinocchio::Vector3> &initialEmbedding, const Skeleton &skeleton);
+                                              const vector<Pinocchio::Vector3> &initialEmbedding, const Skeleton &skeleton,
+                                              Optimizer *optimizer = NULL);
+
+//makes the embedding mirror symmetric about the x = 0.5 plane: every joint with a symmetric one (fSym) is
+//averaged with the mirror image of that one, the others are moved onto the plane
+vector<Pinocchio::Vector3> PINOCCHIO_API symmetrizeEmbedding(const vector<Pinocchio::Vector3> &embedding,
+                                                             const Skeleton &skeleton);
 
 //to compute the attachment, create a new Attachment object
 
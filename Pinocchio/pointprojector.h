@@ -69,16 +69,65 @@ public:
         }
     
         rnodes.reserve((int)objs.size() * 2 - 1);
+        inLeft.assign(objs.size(), 0);
         initHelper(orders);
+        vector<char>().swap(inLeft);
     }
 
     Vec project(const Vec &from) const
+    {
+        int closest = -1;
+        return project(from, closest, todoBuffer());
+    }
+
+    //same, and closest is set to the index of the object the projection is on--if it is nonnegative
+    //on input, that object is used as the initial guess
+    Vec project(const Vec &from, int &closest) const
+    {
+        return project(from, closest, todoBuffer());
+    }
+
+    //projects a batch of points, best if consecutive points are close together: the object
+    //closest to the previous point bounds the search for the next one
+    void project(const vector<Vec> &from, vector<Vec> &out) const
+    {
+        vector<pair<double, int> > &todo = todoBuffer();
+        int closest = -1;
+        out.resize(from.size());
+        for(int i = 0; i < (int)from.size(); ++i)
+            out[i] = project(from[i], closest, todo);
+    }
+
+    struct RNode
+    {
+        Rec rect;
+        int child1, child2; //if child1 is -1, child2 is the object index
+    };
+
+    const vector<RNode> &getRNodes() const { return rnodes; }
+
+private:
+
+    //search stack, one per thread so that projections can run in parallel
+    static vector<pair<double, int> > &todoBuffer()
+    {
+        static thread_local vector<pair<double, int> > todo(10000);
+        return todo;
+    }
+
+    //closest is the index of the closest object on output--if it is nonnegative on input,
+    //that object is used as the initial guess
+    Vec project(const Vec &from, int &closest, vector<pair<double, int> > &todo) const
     {
         double minDistSq = 1e37;
         Vec closestSoFar;
 
+        if(closest >= 0) {
+            closestSoFar = objs[closest].project(from);
+            minDistSq = (from - closestSoFar).lengthsq();
+        }
+
         int sz = 1;
-        static pair<double, int> todo[10000];
         todo[0] = make_pair(rnodes[0].rect.distSqTo(from), 0);
 
         while(sz > 0) {
@@ -114,21 +163,12 @@ public:
             if(distSq <= minDistSq) {
                 minDistSq = distSq;
                 closestSoFar = curPt;
+                closest = c2;
             }
         }
 
         return closestSoFar;
-    };
-
-    struct RNode
-    {
-        Rec rect;
-        int child1, child2; //if child1 is -1, child2 is the object index
-    };
-
-    const vector<RNode> &getRNodes() const { return rnodes; }
-
-private:
+    }
 
     struct DL { bool operator()(const pair<double, int> &p1,
                                 const pair<double, int> &p2) const { return p1.first > p2.first; } };
@@ -147,20 +187,23 @@ private:
         else {
             int i, d;
             vector<int> orders1[Dim], orders2[Dim];
-            set<int> left;
             for(i = 0; i < num / 2; ++i)
-                left.insert(orders[curDim][i]);
+                inLeft[orders[curDim][i]] = 1;
         
             for(d = 0; d < Dim; ++d) {
                 orders1[d].reserve((num + 1) / 2);
                 orders2[d].reserve((num + 1) / 2);
                 for(i = 0; i < num; ++i) {
-                    if(left.count(orders[d][i]))
+                    if(inLeft[orders[d][i]])
                         orders1[d].push_back(orders[d][i]);
                     else
                         orders2[d].push_back(orders[d][i]);
                 }
             }
+            for(i = 0; i < num / 2; ++i) //clear for the children
+                inLeft[orders[curDim][i]] = 0;
+            for(d = 0; d < Dim; ++d) //no longer needed, free before recursing
+                vector<int>().swap(orders[d]);
         
             rnodes[out].child1 = initHelper(orders1, (curDim + 1) % Dim);
             rnodes[out].child2 = initHelper(orders2, (curDim + 1) % Dim);
@@ -181,5 +224,6 @@ private:
 
     vector<RNode> rnodes;
     vector<Obj> objs;
+    vector<char> inLeft; //scratch for initHelper: marks the objects going to the first child
 };
 #endif
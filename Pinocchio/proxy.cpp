@@ -0,0 +1,562 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "proxy.h"
+#include "pointprojector.h"
+#include "debugging.h"
+#include "parallel.h"
+#include <queue>
+
+//sum of squared distances to planes, weighted by area: q holds the upper triangle of the 4x4 matrix
+//(a^2, ab, ac, ad, b^2, bc, bd, c^2, cd, d^2) for the plane ax + by + cz + d = 0
+struct Quadric
+{
+    Quadric() : area(0.) { for(int i = 0; i < 10; ++i) q[i] = 0.; }
+    Quadric(const Pinocchio::Vector3 &n, double d, double inArea) : area(inArea)
+    {
+        q[0] = n[0] * n[0]; q[1] = n[0] * n[1]; q[2] = n[0] * n[2]; q[3] = n[0] * d;
+        q[4] = n[1] * n[1]; q[5] = n[1] * n[2]; q[6] = n[1] * d;
+        q[7] = n[2] * n[2]; q[8] = n[2] * d;
+        q[9] = d * d;
+        for(int i = 0; i < 10; ++i)
+            q[i] *= area;
+    }
+
+    Quadric operator+(const Quadric &o) const { Quadric out(*this); out += o; return out; }
+    Quadric &operator+=(const Quadric &o)
+    {
+        for(int i = 0; i < 10; ++i)
+            q[i] += o.q[i];
+        area += o.area;
+        return *this;
+    }
+
+    double evaluate(const Pinocchio::Vector3 &v) const
+    {
+        return q[0] * v[0] * v[0] + 2. * q[1] * v[0] * v[1] + 2. * q[2] * v[0] * v[2] + 2. * q[3] * v[0]
+            + q[4] * v[1] * v[1] + 2. * q[5] * v[1] * v[2] + 2. * q[6] * v[1]
+            + q[7] * v[2] * v[2] + 2. * q[8] * v[2] + q[9];
+    }
+
+    //the point with the smallest error, false if it is not well defined (e.g., on a flat patch)
+    bool minimize(Pinocchio::Vector3 &out) const
+    {
+        double c00 = q[4] * q[7] - q[5] * q[5], c01 = q[2] * q[5] - q[1] * q[7], c02 = q[1] * q[5] - q[2] * q[4];
+        double det = q[0] * c00 + q[1] * c01 + q[2] * c02;
+        double trace = q[0] + q[4] + q[7];
+        if(fabs(det) <= 1e-9 * trace * trace * trace)
+            return false;
+        double c11 = q[0] * q[7] - q[2] * q[2], c12 = q[1] * q[2] - q[0] * q[5], c22 = q[0] * q[4] - q[1] * q[1];
+        out[0] = -(c00 * q[3] + c01 * q[6] + c02 * q[8]) / det;
+        out[1] = -(c01 * q[3] + c11 * q[6] + c12 * q[8]) / det;
+        out[2] = -(c02 * q[3] + c12 * q[6] + c22 * q[8]) / det;
+        return true;
+    }
+
+    double q[10];
+    double area;
+};
+
+struct EdgeCollapse
+{
+    bool operator<(const EdgeCollapse &o) const { return cost > o.cost; } //for a min heap
+
+    double cost; //mean squared distance
+    int v1, v2; //v2 is merged into v1
+    int version1, version2; //of the vertices when this was computed
+};
+
+class Decimator
+{
+public:
+    Decimator(const Mesh &m);
+
+    void run(int targetVertices, double maxError);
+    Mesh result(const Mesh &m) const;
+
+    int numVertices() const { return aliveVertices; }
+    double error() const { return sqrt(maxCost); }
+
+private:
+    double placement(int v1, int v2, Pinocchio::Vector3 &pos) const; //returns the cost
+    void push(int v1, int v2);
+    void aliveTris(int v, vector<int> &out);
+    void neighbors(const vector<int> &tris, int v, vector<int> &out) const;
+    bool canCollapse(const EdgeCollapse &c, const Pinocchio::Vector3 &newPos);
+    void collapse(const EdgeCollapse &c, const Pinocchio::Vector3 &newPos);
+
+    vector<Pinocchio::Vector3> pos;
+    vector<int> corners; //3 per triangle
+    vector<char> triAlive, border;
+    vector<int> version; //-1 once the vertex is collapsed away
+    vector<vector<int> > vertTris; //may hold dead triangles
+    vector<Quadric> quadrics;
+    priority_queue<EdgeCollapse> heap;
+    int aliveVertices;
+    double maxCost;
+
+    vector<int> tris1, tris2, nbrs1, nbrs2, shared, common; //scratch
+};
+
+Decimator::Decimator(const Mesh &m) : aliveVertices(m.vertices.size()), maxCost(0.)
+{
+    int i, k;
+    int nv = m.vertices.size(), nt = m.edges.size() / 3;
+
+    pos.resize(nv);
+    for(i = 0; i < nv; ++i)
+        pos[i] = m.vertices[i].pos;
+    corners.resize(nt * 3);
+    for(i = 0; i < nt * 3; ++i)
+        corners[i] = m.edges[i].vertex;
+    triAlive.assign(nt, 1);
+    border.assign(nv, 0);
+    version.assign(nv, 0);
+    vertTris.resize(nv);
+    quadrics.resize(nv);
+
+    for(i = 0; i < nt; ++i) {
+        const Pinocchio::Vector3 &p1 = pos[corners[i * 3]], &p2 = pos[corners[i * 3 + 1]], &p3 = pos[corners[i * 3 + 2]];
+        Pinocchio::Vector3 n = (p2 - p1) % (p3 - p1);
+        double len = n.length();
+        if(len > 0.)
+            n = n / len;
+        Quadric plane(n, -(n * p1), len / 6.); //a third of the area to each vertex
+        for(k = 0; k < 3; ++k) {
+            quadrics[corners[i * 3 + k]] += plane;
+            vertTris[corners[i * 3 + k]].push_back(i);
+        }
+    }
+
+    //edges without a twin keep their place: a steep plane through them, perpendicular to the triangle
+    for(i = 0; i < (int)m.edges.size(); ++i) {
+        if(m.edges[i].twin >= 0)
+            continue;
+        int v1 = m.edges[m.edges[i].prev].vertex, v2 = m.edges[i].vertex;
+        int t = i / 3;
+        Pinocchio::Vector3 tn = (pos[corners[t * 3 + 1]] - pos[corners[t * 3]]) % (pos[corners[t * 3 + 2]] - pos[corners[t * 3]]);
+        Pinocchio::Vector3 n = (pos[v2] - pos[v1]) % tn;
+        double len = n.length();
+        if(len == 0.)
+            continue;
+        n = n / len;
+        Quadric plane(n, -(n * pos[v1]), 100. * (pos[v2] - pos[v1]).lengthsq());
+        plane.area = 0.;
+        quadrics[v1] += plane;
+        quadrics[v2] += plane;
+        border[v1] = border[v2] = 1;
+    }
+
+    vector<EdgeCollapse> initial;
+    initial.reserve(m.edges.size() / 2);
+    for(i = 0; i < (int)m.edges.size(); ++i) {
+        if(m.edges[i].twin >= i) //once per edge
+            continue;
+        EdgeCollapse c;
+        Pinocchio::Vector3 p;
+        c.v1 = m.edges[m.edges[i].prev].vertex;
+        c.v2 = m.edges[i].vertex;
+        c.cost = placement(c.v1, c.v2, p);
+        c.version1 = c.version2 = 0;
+        initial.push_back(c);
+    }
+    heap = priority_queue<EdgeCollapse>(less<EdgeCollapse>(), initial);
+}
+
+//the optimal point if it is near the edge, otherwise the best of the ends and the middle
+double Decimator::placement(int v1, int v2, Pinocchio::Vector3 &out) const
+{
+    int i;
+    double cost;
+    Quadric q = quadrics[v1] + quadrics[v2];
+
+    Pinocchio::Vector3 mid = (pos[v1] + pos[v2]) * 0.5;
+    double lenSq = (pos[v2] - pos[v1]).lengthsq();
+    if(q.minimize(out) && (out - mid).lengthsq() <= lenSq)
+        cost = q.evaluate(out);
+    else {
+        Pinocchio::Vector3 candidates[3] = { mid, pos[v1], pos[v2] };
+        cost = 1e37;
+        for(i = 0; i < 3; ++i) {
+            double cur = q.evaluate(candidates[i]);
+            if(cur < cost) {
+                cost = cur;
+                out = candidates[i];
+            }
+        }
+    }
+    return max(0., cost) / max(q.area, 1e-300);
+}
+
+void Decimator::push(int v1, int v2)
+{
+    EdgeCollapse c;
+    Pinocchio::Vector3 p;
+    c.cost = placement(v1, v2, p);
+    c.v1 = v1;
+    c.v2 = v2;
+    c.version1 = version[v1];
+    c.version2 = version[v2];
+    heap.push(c);
+}
+
+//the triangles around v that are still there--the dead ones are dropped from its list
+void Decimator::aliveTris(int v, vector<int> &out)
+{
+    vector<int> &tris = vertTris[v];
+    int i, cur = 0;
+    for(i = 0; i < (int)tris.size(); ++i)
+        if(triAlive[tris[i]])
+            tris[cur++] = tris[i];
+    tris.resize(cur);
+    out = tris;
+}
+
+void Decimator::neighbors(const vector<int> &tris, int v, vector<int> &out) const
+{
+    int i, k;
+    out.clear();
+    for(i = 0; i < (int)tris.size(); ++i)
+        for(k = 0; k < 3; ++k)
+            if(corners[tris[i] * 3 + k] != v)
+                out.push_back(corners[tris[i] * 3 + k]);
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+bool Decimator::canCollapse(const EdgeCollapse &c, const Pinocchio::Vector3 &newPos)
+{
+    int i, k;
+    aliveTris(c.v1, tris1);
+    aliveTris(c.v2, tris2);
+
+    shared.clear();
+    for(i = 0; i < (int)tris1.size(); ++i)
+        for(k = 0; k < 3; ++k)
+            if(corners[tris1[i] * 3 + k] == c.v2)
+                shared.push_back(tris1[i]);
+    if(shared.empty())
+        return false;
+    if(border[c.v1] && border[c.v2] && shared.size() > 1) //would pinch the border
+        return false;
+
+    //link condition: the only common neighbors are the vertices opposite the edge
+    neighbors(tris1, c.v1, nbrs1);
+    neighbors(tris2, c.v2, nbrs2);
+    common.clear();
+    set_intersection(nbrs1.begin(), nbrs1.end(), nbrs2.begin(), nbrs2.end(), back_inserter(common));
+    if(common.size() != shared.size())
+        return false;
+    if(nbrs1.size() + nbrs2.size() - common.size() < 5) //v1 would be left with fewer than 3 neighbors
+        return false;
+    for(i = 0; i < (int)common.size(); ++i) { //and so would the opposite vertices
+        vector<int> &tris = vertTris[common[i]];
+        int alive = 0;
+        for(k = 0; k < (int)tris.size(); ++k)
+            alive += triAlive[tris[k]];
+        if(alive <= 3)
+            return false;
+    }
+
+    //no triangle may flip or degenerate
+    for(int side = 0; side < 2; ++side) {
+        const vector<int> &tris = side ? tris2 : tris1;
+        int v = side ? c.v2 : c.v1, other = side ? c.v1 : c.v2;
+        for(i = 0; i < (int)tris.size(); ++i) {
+            const int *t = &corners[tris[i] * 3];
+            if(t[0] == other || t[1] == other || t[2] == other)
+                continue; //shared, goes away
+            Pinocchio::Vector3 p[3] = { pos[t[0]], pos[t[1]], pos[t[2]] };
+            Pinocchio::Vector3 before = (p[1] - p[0]) % (p[2] - p[0]);
+            for(k = 0; k < 3; ++k)
+                if(t[k] == v)
+                    p[k] = newPos;
+            Pinocchio::Vector3 after = (p[1] - p[0]) % (p[2] - p[0]);
+            if(after * before <= 0.2 * after.length() * before.length())
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void Decimator::collapse(const EdgeCollapse &c, const Pinocchio::Vector3 &newPos)
+{
+    int i, k;
+    for(i = 0; i < (int)shared.size(); ++i)
+        triAlive[shared[i]] = 0;
+    for(i = 0; i < (int)tris2.size(); ++i) {
+        if(!triAlive[tris2[i]])
+            continue;
+        for(k = 0; k < 3; ++k)
+            if(corners[tris2[i] * 3 + k] == c.v2)
+                corners[tris2[i] * 3 + k] = c.v1;
+        vertTris[c.v1].push_back(tris2[i]);
+    }
+    vector<int>().swap(vertTris[c.v2]);
+
+    pos[c.v1] = newPos;
+    quadrics[c.v1] += quadrics[c.v2];
+    border[c.v1] |= border[c.v2];
+    ++version[c.v1];
+    version[c.v2] = -1;
+    --aliveVertices;
+    maxCost = max(maxCost, c.cost);
+
+    //the collapses of the edges around v1 are stale now
+    aliveTris(c.v1, tris1);
+    neighbors(tris1, c.v1, nbrs1);
+    for(i = 0; i < (int)nbrs1.size(); ++i)
+        push(c.v1, nbrs1[i]);
+}
+
+void Decimator::run(int targetVertices, double maxError)
+{
+    while(aliveVertices > targetVertices && !heap.empty()) {
+        EdgeCollapse c = heap.top();
+        heap.pop();
+        if(version[c.v1] != c.version1 || version[c.v2] != c.version2) //stale
+            continue;
+        if(c.cost > SQR(maxError))
+            break;
+        Pinocchio::Vector3 newPos;
+        placement(c.v1, c.v2, newPos); //not stored in the heap, which is faster with small entries
+        if(canCollapse(c, newPos))
+            collapse(c, newPos);
+    }
+}
+
+Mesh Decimator::result(const Mesh &m) const
+{
+    int i, k;
+    Mesh out;
+    out.toAdd = m.toAdd;
+    out.scale = m.scale;
+
+    vector<int> index(pos.size(), -1);
+    for(i = 0; i < (int)pos.size(); ++i) {
+        if(version[i] < 0)
+            continue;
+        index[i] = out.vertices.size();
+        out.vertices.push_back(MeshVertex());
+        out.vertices.back().pos = pos[i];
+    }
+    for(i = 0; i < (int)triAlive.size(); ++i) {
+        if(!triAlive[i])
+            continue;
+        for(k = 0; k < 3; ++k) {
+            out.edges.push_back(MeshEdge());
+            out.edges.back().vertex = index[corners[i * 3 + k]];
+        }
+    }
+
+    out.computeTopology();
+    out.computeVertexNormals();
+    return out;
+}
+
+Mesh decimateMesh(const Mesh &m, int targetVertices, double maxError)
+{
+    Decimator decimator(m);
+    decimator.run(targetVertices, maxError);
+
+    Debugging::out() << "Decimated " << m.vertices.size() << " to " << decimator.numVertices()
+                     << " vertices, error " << decimator.error() << endl;
+
+    return decimator.result(m);
+}
+
+//barycentric coordinates of p, which is on the triangle
+static void barycentric(const Pinocchio::Vector3 &p, const Pinocchio::Vector3 &v1, const Pinocchio::Vector3 &v2,
+                        const Pinocchio::Vector3 &v3, double out[3])
+{
+    Pinocchio::Vector3 e1 = v2 - v1, e2 = v3 - v1, d = p - v1;
+    double d11 = e1 * e1, d12 = e1 * e2, d22 = e2 * e2, d1 = d * e1, d2 = d * e2;
+    double det = d11 * d22 - d12 * d12;
+    if(det <= 1e-12 * d11 * d22) { //degenerate: the closest vertex
+        double dist[3] = { (p - v1).lengthsq(), (p - v2).lengthsq(), (p - v3).lengthsq() };
+        int best = min_element(dist, dist + 3) - dist;
+        out[0] = out[1] = out[2] = 0.;
+        out[best] = 1.;
+        return;
+    }
+    out[1] = max(0., (d22 * d1 - d12 * d2) / det);
+    out[2] = max(0., (d11 * d2 - d12 * d1) / det);
+    out[0] = max(0., 1. - out[1] - out[2]);
+    double sum = out[0] + out[1] + out[2];
+    for(int k = 0; k < 3; ++k)
+        out[k] /= sum;
+}
+
+//out[j][p] is the weight of bone j at points[p], interpolated at its closest point on the mesh
+static vector<vector<double> > closestPointWeights(const Mesh &mesh, const Attachment &attachment,
+                                                   const vector<Pinocchio::Vector3> &points)
+{
+    int i;
+    int nv = mesh.vertices.size();
+
+    vector<Tri3Object> triobjvec;
+    for(i = 0; i < (int)mesh.edges.size(); i += 3)
+        triobjvec.push_back(Tri3Object(mesh.vertices[mesh.edges[i].vertex].pos,
+                                       mesh.vertices[mesh.edges[i + 1].vertex].pos,
+                                       mesh.vertices[mesh.edges[i + 2].vertex].pos));
+    ObjectProjector<3, Tri3Object> proj(triobjvec);
+
+    vector<Vector<double, -1> > meshWeights(nv);
+    for(i = 0; i < nv; ++i)
+        meshWeights[i] = attachment.getWeights(i);
+    int bones = meshWeights[0].size();
+
+    //consecutive points are usually close together, so each chunk starts its search from the last triangle
+    vector<vector<double> > boneWeights(bones, vector<double>(points.size(), 0.));
+    const int chunk = 256;
+    parallelFor(0, ((int)points.size() + chunk - 1) / chunk, [&](int c) {
+        int closest = -1;
+        int end = min((int)points.size(), (c + 1) * chunk);
+        for(int p = c * chunk; p < end; ++p) {
+            Pinocchio::Vector3 onMesh = proj.project(points[p], closest);
+            const Tri3Object &tri = triobjvec[closest];
+            double b[3];
+            barycentric(onMesh, tri.v1, tri.v2, tri.v3, b);
+            for(int k = 0; k < 3; ++k) {
+                const Vector<double, -1> &w = meshWeights[mesh.edges[closest * 3 + k].vertex];
+                for(int j = 0; j < bones; ++j)
+                    boneWeights[j][p] += b[k] * w[j];
+            }
+        }
+    });
+
+    return boneWeights;
+}
+
+Attachment *transferAttachment(const Mesh &mesh, const Attachment &attachment, const vector<Pinocchio::Vector3> &points)
+{
+    if(mesh.vertices.size() == 0 || mesh.edges.size() == 0)
+        return NULL;
+    return new Attachment(closestPointWeights(mesh, attachment, points));
+}
+
+//steps rounds of moving every vertex's weights halfway to the mean of its neighbors'.  The neighbors come
+//straight from the triangles, so the mesh may be open, have several components or be non-manifold.
+static void smoothWeights(const Mesh &mesh, vector<vector<double> > &boneWeights, int steps)
+{
+    int i, j, k, step;
+    int nv = mesh.vertices.size();
+
+    vector<pair<int, int> > pairs;
+    for(i = 0; i + 2 < (int)mesh.edges.size(); i += 3) {
+        for(k = 0; k < 3; ++k) {
+            int v1 = mesh.edges[i + k].vertex, v2 = mesh.edges[i + (k + 1) % 3].vertex;
+            pairs.push_back(make_pair(v1, v2));
+            pairs.push_back(make_pair(v2, v1));
+        }
+    }
+    sort(pairs.begin(), pairs.end());
+    pairs.erase(unique(pairs.begin(), pairs.end()), pairs.end());
+    vector<int> offsets(nv + 1, 0);
+    for(i = 0; i < (int)pairs.size(); ++i)
+        ++offsets[pairs[i].first + 1];
+    for(i = 0; i < nv; ++i)
+        offsets[i + 1] += offsets[i];
+
+    vector<double> smoothed(nv);
+    for(j = 0; j < (int)boneWeights.size(); ++j) {
+        vector<double> &w = boneWeights[j];
+        for(step = 0; step < steps; ++step) {
+            for(i = 0; i < nv; ++i) {
+                int degree = offsets[i + 1] - offsets[i];
+                if(degree == 0) {
+                    smoothed[i] = w[i];
+                    continue;
+                }
+                double sum = 0.;
+                for(k = offsets[i]; k < offsets[i + 1]; ++k)
+                    sum += w[pairs[k].second];
+                smoothed[i] = 0.5 * (w[i] + sum / degree);
+            }
+            w.swap(smoothed);
+        }
+    }
+}
+
+vector<Attachment *> transferAttachments(const Mesh &mesh, const Attachment &attachment, const vector<Mesh> &secondary,
+                                         int smoothingSteps)
+{
+    int i, g;
+    vector<Attachment *> out(secondary.size(), (Attachment *)NULL);
+    if(mesh.vertices.size() == 0 || mesh.edges.size() == 0)
+        return out;
+
+    //the closest points of all the meshes in one parallel pass, so that one big mesh is split across threads too
+    vector<int> offsets(secondary.size() + 1, 0);
+    for(g = 0; g < (int)secondary.size(); ++g)
+        offsets[g + 1] = offsets[g] + secondary[g].vertices.size();
+    vector<Pinocchio::Vector3> points(offsets.back());
+    for(g = 0; g < (int)secondary.size(); ++g)
+        for(i = 0; i < (int)secondary[g].vertices.size(); ++i)
+            points[offsets[g] + i] = secondary[g].vertices[i].pos;
+    vector<vector<double> > allWeights = closestPointWeights(mesh, attachment, points);
+
+    parallelFor(0, (int)secondary.size(), [&](int g) {
+        vector<vector<double> > boneWeights(allWeights.size());
+        for(int j = 0; j < (int)allWeights.size(); ++j)
+            boneWeights[j].assign(allWeights[j].begin() + offsets[g], allWeights[j].begin() + offsets[g + 1]);
+        if(smoothingSteps > 0)
+            smoothWeights(secondary[g], boneWeights, smoothingSteps);
+        out[g] = new Attachment(boneWeights);
+    });
+
+    return out;
+}
+
+PinocchioOutput autorigProxy(const Skeleton &given, const Mesh &m, int proxyVertices, double proxyError)
+{
+    int i;
+    PinocchioOutput out;
+
+    if((int)m.vertices.size() <= proxyVertices)
+        return autorig(given, m);
+
+    Mesh full = prepareMesh(m);
+    if(full.vertices.size() == 0)
+        return out;
+
+    //the proxy is decimated in the unit cube, where proxyError is measured, and normalized again: the
+    //embedding of autorig is in the frame of the proxy, which is a slight scaling and shift of this one
+    Mesh proxy = prepareMesh(decimateMesh(full, proxyVertices, proxyError));
+    if(proxy.vertices.size() == 0)
+        return out;
+    double toProxyScale = proxy.scale / full.scale;
+    Pinocchio::Vector3 toProxyAdd = proxy.toAdd - full.toAdd * toProxyScale;
+
+    PinocchioOutput proxyOut = autorig(given, proxy);
+    if(proxyOut.attachment == NULL)
+        return out;
+
+    out.embedding = proxyOut.embedding;
+    for(i = 0; i < (int)out.embedding.size(); ++i)
+        out.embedding[i] = (out.embedding[i] - toProxyAdd) / toProxyScale;
+
+    vector<Pinocchio::Vector3> points(full.vertices.size());
+    for(i = 0; i < (int)points.size(); ++i)
+        points[i] = toProxyAdd + full.vertices[i].pos * toProxyScale;
+    out.attachment = transferAttachment(proxy, *proxyOut.attachment, points);
+
+    delete proxyOut.attachment;
+    return out;
+}
@@ -0,0 +1,57 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include "pinocchioApi.h"
+
+static const int defaultProxyVertices = 20000;
+static const double defaultProxyError = 0.001; //in the unit cube, a third of the distance field tolerance
+
+//quadric error edge collapse decimation.  Collapses edges in order of increasing error until the mesh is
+//down to targetVertices or the next collapse would move the surface by more than maxError (the root mean
+//square distance from the collapsed vertex to the planes of the original triangles it replaces, in the
+//units of the mesh).  Collapses that would change the topology or flip triangles are skipped, so a
+//closed connected mesh stays closed and connected.
+Mesh PINOCCHIO_API decimateMesh(const Mesh &m, int targetVertices, double maxError = defaultProxyError);
+
+//weights at arbitrary points from an attachment of mesh: every point gets the weights at its closest point
+//on the mesh, interpolated barycentrically from the vertices of that triangle.  The points must be in the
+//frame of mesh.  User responsible for deleting the output.
+Attachment PINOCCHIO_API *transferAttachment(const Mesh &mesh, const Attachment &attachment,
+                                             const vector<Pinocchio::Vector3> &points);
+
+//weights for secondary meshes layered over a rigged mesh, such as clothing and accessories over a body,
+//without rigging them: the vertices of every secondary mesh get the weights at their closest points on mesh,
+//as in transferAttachment, and then smoothingSteps rounds of averaging with their neighbors, which evens out
+//the jumps where the closest point switches between body parts (e.g., a skirt between the legs).  The
+//secondary meshes must be in the frame of mesh, but need not be closed or connected.  All of them are
+//done in one parallel pass.  User responsible for deleting the output.
+vector<Attachment *> PINOCCHIO_API transferAttachments(const Mesh &mesh, const Attachment &attachment,
+                                                       const vector<Mesh> &secondary, int smoothingSteps = 0);
+
+//rigs a decimated proxy of the mesh with autorig and transfers the weights to the mesh vertices.  Skeleton
+//placement and heat weights change little with resolution, so this is much faster for big meshes.  Meshes
+//with at most proxyVertices vertices are rigged directly.  The output is like autorig's: the embedding is in
+//the frame of prepareMesh(m) and the attachment is of the vertices of m.
+PinocchioOutput PINOCCHIO_API autorigProxy(const Skeleton &given, const Mesh &m,
+                                           int proxyVertices = defaultProxyVertices,
+                                           double proxyError = defaultProxyError);
+
+#endif //PROXY_H
@@ -118,6 +118,14 @@ public:
     template<class Real> Real evaluate(const Vector<Real, Dim> &v)
     {
         if(node->getChild(0) == NULL) {
+            //a mirrored tree (see OctTreeMaker::make) locates points left of the x = 0.5 plane in leaves
+            //on its right, so they are evaluated at their mirror image
+            if(v[0] < Real(0.5) && node->getRect().getLo()[0] >= 0.5) {
+                Vector<Real, Dim> mirrored = v;
+                mirrored[0] = Real(1.) - v[0];
+                return super::evaluate((mirrored - node->getRect().getLo()).apply(divides<Real>(),
+                                                                                  node->getRect().getSize()));
+            }
             return super::evaluate((v - node->getRect().getLo()).apply(divides<Real>(),
                                                                        node->getRect().getSize()));
         }
@@ -156,12 +164,29 @@ typedef DRootNode<DistData<3>, 3> OctTreeRoot;
 template<class RootNode = OctTreeRoot> class OctTreeMaker 
 {
 public:
-    static RootNode *make(const ObjectProjector<3, Tri3Object> &proj, const Mesh &m, double tol)
+    //if mirrorX, the mesh must be symmetric about the x = 0.5 plane.  Only the x > 0.5 half of the tree
+    //is refined; the children of the root on the left stay leaves and locate() mirrors points into the
+    //right half, so the tree must be queried as locate(v)->evaluate(v).
+    static RootNode *make(const ObjectProjector<3, Tri3Object> &proj, const Mesh &m, double tol, bool mirrorX = false)
     {
-        DistObjEval eval(proj, m);
+        DistObjEval eval(proj, m, mirrorX);
         RootNode *out = new RootNode();
 
-        out->fullSplit(eval, tol, out, 0, true);
+        if(mirrorX) {
+            out->initFunc(eval, out->getRect());
+            out->split(out);
+            for(int i = 0; i < RootNode::numChildren; ++i) {
+                typename RootNode::Node *child = out->getChild(i);
+                eval.setRect(child->getRect());
+                if(i & 1)
+                    child->fullSplit(eval, tol, out, 1, true);
+                else
+                    child->initFunc(eval, child->getRect());
+            }
+            out->setMirrorX(true);
+        }
+        else
+            out->fullSplit(eval, tol, out, 0, true);
         out->preprocessIndex();
 
         return out;
@@ -182,15 +207,19 @@ private:
     class DistObjEval
     {
     public:
-        DistObjEval(const ObjectProjector<3, Tri3Object> &inProj, const Mesh &m) : proj(inProj), mint(m, Pinocchio::Vector3(1, 0, 0))
+        DistObjEval(const ObjectProjector<3, Tri3Object> &inProj, const Mesh &m, bool inMirrorX)
+            : proj(inProj), mint(m, Pinocchio::Vector3(1, 0, 0)), mirrorX(inMirrorX)
         {
             level = 0;
             rects[0] = Rect3(Pinocchio::Vector3(), Pinocchio::Vector3(1.));
             inside[0] = 0;
         }
 
-        double operator()(const Pinocchio::Vector3 &vec) const
+        double operator()(const Pinocchio::Vector3 &inVec) const
         {
+            Pinocchio::Vector3 vec = inVec;
+            if(mirrorX && vec[0] < 0.5)
+                vec[0] = 1. - vec[0]; //only the corners of the leaves left of the plane
             unsigned int cur = ROUND(vec[0] * 1023.) + 1024 * (ROUND(vec[1] * 1023.) + 1024 * ROUND(vec[2] * 1023.));
             unsigned int sz = cache.size();
             double &d = cache[cur];
@@ -237,6 +266,7 @@ private:
         mutable unordered_map<unsigned int, double> cache;
         const ObjectProjector<3, Tri3Object> &proj;
         Intersector mint;
+        bool mirrorX;
         mutable Rect3 rects[11];
         mutable int inside[11];
         mutable int level; //essentially index of last rect
@@ -19,6 +19,8 @@
 #include "pinocchioApi.h"
 #include "deriv.h"
 #include "debugging.h"
+#include "optimizer.h"
+#include "parallel.h"
 
 
 struct RP //information for refined embedding
@@ -38,78 +40,252 @@ struct RP //information for refined embedding
     ObjectProjector<3, Vec3Object> medProjector;
 };
 
-template<class Real> Real computeFineError(const vector<Vector<Real, 3> > &match, RP *rp)
+static const int boneSamples = 10; //points along every bone where the surface penalty is evaluated
+
+//a sample costs a few microseconds (a medial surface projection and a distance field evaluation), so
+//splitting the bones across threads pays off only for skeletons with enough of them: below this many
+//samples in all, the bone loops run serially
+static const int minParallelSamples = 100;
+
+//calls func(b) for every b in [0, bones), in parallel if there are enough samples
+template<class F> void forEachBone(int bones, const F &func)
 {
-    Real out = Real();
-    int i;
-    for(i = 1; i < (int)match.size(); ++i) {
-        int prev = rp->given.fPrev()[i];
-        
-        Real surfPenalty = Real();
-        Real lenPenalty = Real();
-        Real anglePenalty = Real();
-        Real symPenalty = Real();
-        
-        //-----------------surf
-        const int samples = 10;
-        for(int k = 0; k < samples; ++k) {
-            double frac = double(k) / double(samples);
-            Vector<Real, 3> cur = match[i] * Real(1. - frac) + match[prev] * Real(frac);
-            Pinocchio::Vector3 m = rp->medProjector.project(cur);
-            Real medDist = (cur - Vector<Real, 3>(m)).length();
-            Real surfDist = -rp->distanceField->locate(cur)->evaluate(cur);
-            Real penalty = SQR(min(medDist, Real(0.001) + max(Real(0.), Real(0.05) - surfDist)));
-            if(penalty > Real(SQR(0.003)))
-                surfPenalty += Real(1. / double(samples)) * penalty;
-        }
-        
-        //---------------length
-        Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
-        Real distSq = SQR(max(Real(-10.), (match[i] - match[prev]) *
-                                        (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
-        lenPenalty = max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
-        
-        //---------------sym
-        if(rp->given.fSym()[i] != -1) {
-            int s = rp->given.fSym()[i];
-            int sp = rp->given.fPrev()[s];
-            
-            Real sDistSq = (match[s] - match[sp]).lengthsq();
-            symPenalty = max(Real(1.05), max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
-        }
-        
-        //--------------angle
-        if(distSq > Real(1e-16)) {
-            Vector<Real, 3> curDir = (match[i] - match[prev]).normalize();
-            Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
-            if(curDir * skelDir < Real(1. - 1e-8))
-                anglePenalty = Real(0.5) * acos(curDir * skelDir);
-            anglePenalty = CUBE(Real(0.3) + anglePenalty);
-            if(curDir * skelDir < Real(0.))
-                anglePenalty *= 10.;
+    if(bones * boneSamples < minParallelSamples) {
+        for(int b = 0; b < bones; ++b)
+            func(b);
+    }
+    else
+        parallelFor(0, bones, func);
+}
+
+//distance field values at a batch of points along a bone.  Consecutive points usually fall into the
+//same octree leaf, so the previous leaf is tried before locating the next point from the root.
+template<class Real> void evaluateSamples(TreeType *distanceField, const vector<Vector<Real, 3> > &pts, vector<Real> &out)
+{
+    TreeType::Node *leaf = NULL;
+    out.resize(pts.size());
+    for(int i = 0; i < (int)pts.size(); ++i) {
+        Pinocchio::Vector3 pt = pts[i];
+        if(leaf == NULL || !leaf->getRect().contains(pt))
+            leaf = distanceField->locate(pt);
+        out[i] = leaf->evaluate(pts[i]);
+    }
+}
+
+//error of the bone from joint prev = fPrev()[i] to joint i.  Depends only on the positions of the two
+//ends of the bone and of the two ends of its symmetric bone (ignored if the bone has no symmetric one).
+template<class Real> Real computeBoneError(int i, const Vector<Real, 3> &cur, const Vector<Real, 3> &prevPos,
+                                           const Vector<Real, 3> &sym, const Vector<Real, 3> &symPrev, RP *rp)
+{
+    int prev = rp->given.fPrev()[i];
+
+    Real surfPenalty = Real();
+    Real lenPenalty = Real();
+    Real anglePenalty = Real();
+    Real symPenalty = Real();
+
+    //-----------------surf
+    const int samples = boneSamples;
+    vector<Vector<Real, 3> > pts(samples);
+    vector<Pinocchio::Vector3> dPts(samples), meds;
+    vector<Real> surfDists;
+    for(int k = 0; k < samples; ++k) {
+        double frac = double(k) / double(samples);
+        pts[k] = cur * Real(1. - frac) + prevPos * Real(frac);
+        dPts[k] = pts[k];
+    }
+    rp->medProjector.project(dPts, meds);
+    evaluateSamples(rp->distanceField, pts, surfDists);
+
+    for(int k = 0; k < samples; ++k) {
+        Real medDist = (pts[k] - Vector<Real, 3>(meds[k])).length();
+        Real surfDist = -surfDists[k];
+        Real penalty = SQR(min(medDist, Real(0.001) + max(Real(0.), Real(0.05) - surfDist)));
+        if(penalty > Real(SQR(0.003)))
+            surfPenalty += Real(1. / double(samples)) * penalty;
+    }
+
+    //---------------length
+    Real optDistSq = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).lengthsq();
+    Real distSq = SQR(max(Real(-10.), (cur - prevPos) *
+                                    (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]))) / optDistSq;
+    lenPenalty = max(Real(.5), (Real(0.0001) + optDistSq) / (Real(0.0001) + distSq));
+
+    //---------------sym
+    if(rp->given.fSym()[i] != -1) {
+        Real sDistSq = (sym - symPrev).lengthsq();
+        symPenalty = max(Real(1.05), max(distSq / (Real(0.001) + sDistSq), sDistSq / (Real(0.001) + distSq)));
+    }
+
+    //--------------angle
+    if(distSq > Real(1e-16)) {
+        Vector<Real, 3> curDir = (cur - prevPos).normalize();
+        Vector<Real, 3> skelDir = (rp->given.fGraph().verts[i] - rp->given.fGraph().verts[prev]).normalize();
+        if(curDir * skelDir < Real(1. - 1e-8))
+            anglePenalty = Real(0.5) * acos(curDir * skelDir);
+        anglePenalty = CUBE(Real(0.3) + anglePenalty);
+        if(curDir * skelDir < Real(0.))
+            anglePenalty *= 10.;
+    }
+
+    return Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
+}
+
+//the two ends of the symmetric bone of bone i (or of bone i itself if it has none)
+inline void symBone(int i, RP *rp, int &s, int &sp)
+{
+    s = rp->given.fSym()[i];
+    if(s == -1)
+        s = i;
+    sp = rp->given.fPrev()[s];
+}
+
+//the bones (all but joint 0) if bones is NULL, else bones itself
+static const vector<int> &boneList(int joints, const vector<int> *bones, vector<int> &all)
+{
+    if(bones)
+        return *bones;
+    all.resize(joints - 1);
+    for(int i = 1; i < joints; ++i)
+        all[i - 1] = i;
+    return all;
+}
+
+//the bones whose errors depend on the position of any of the given joints
+static vector<int> bonesOfJoints(const vector<int> &joints, RP *rp)
+{
+    int i, j, s, sp;
+    vector<int> out;
+    for(i = 1; i < (int)rp->given.fPrev().size(); ++i) {
+        symBone(i, rp, s, sp);
+        for(j = 0; j < (int)joints.size(); ++j) {
+            int jt = joints[j];
+            if(jt == i || jt == rp->given.fPrev()[i] || jt == s || jt == sp) {
+                out.push_back(i);
+                break;
+            }
         }
-        
-        out += Real(15000.) * surfPenalty + Real(0.25) * lenPenalty + Real(2.0) * anglePenalty + symPenalty;
     }
-    
     return out;
 }
 
-vector<Pinocchio::Vector3> optimizeEmbedding1D(vector<Pinocchio::Vector3> fineEmbedding, vector<Pinocchio::Vector3> dir, RP *rp)
+//fine error summed over the given bones (all of them if NULL)--steps that move only some joints only need
+//the bones that depend on them.  Bones are evaluated in parallel (if there are enough), but always summed in
+//the same order so the result does not depend on the number of threads.
+template<class Real> Real computeFineError(const vector<Vector<Real, 3> > &match, RP *rp, const vector<int> *bones = NULL)
+{
+    vector<int> all;
+    const vector<int> &list = boneList((int)match.size(), bones, all);
+    vector<Real> boneErrors(list.size());
+    forEachBone((int)list.size(), [&](int b) {
+        int i = list[b], s, sp;
+        symBone(i, rp, s, sp);
+        boneErrors[b] = computeBoneError(i, match[i], match[rp->given.fPrev()[i]], match[s], match[sp], rp);
+    });
+
+    Real out = Real();
+    for(int b = 0; b < (int)list.size(); ++b)
+        out += boneErrors[b];
+
+    return out;
+}
+
+//computes the fine error and its gradient with respect to every joint position, over the given bones as in
+//computeFineError.  Every bone error depends on only four joints, so it is differentiated with 12 forward mode
+//variables and the partial derivatives are added to those joints--a gradient costs a small constant times one
+//error evaluation.
+double computeFineGradient(const vector<Pinocchio::Vector3> &match, RP *rp, vector<Pinocchio::Vector3> &gradient,
+                           const vector<int> *bones = NULL)
+{
+    typedef Deriv<double, 12> DType;
+
+    int b, j, k, s, sp;
+    vector<int> all;
+    const vector<int> &list = boneList((int)match.size(), bones, all);
+    vector<DType> boneErrors(list.size());
+    forEachBone((int)list.size(), [&](int b) {
+        int i = list[b], j, k, s, sp;
+        symBone(i, rp, s, sp);
+        int joints[4] = { i, rp->given.fPrev()[i], s, sp };
+
+        Vector<DType, 3> dJoints[4];
+        for(j = 0; j < 4; ++j) for(k = 0; k < 3; ++k)
+            dJoints[j][k] = DType(match[joints[j]][k], j * 3 + k);
+
+        boneErrors[b] = computeBoneError(i, dJoints[0], dJoints[1], dJoints[2], dJoints[3], rp);
+    });
+
+    //accumulate serially, in bone order
+    double out = 0.;
+    gradient.assign(match.size(), Pinocchio::Vector3());
+    for(b = 0; b < (int)list.size(); ++b) {
+        int i = list[b];
+        symBone(i, rp, s, sp);
+        int joints[4] = { i, rp->given.fPrev()[i], s, sp };
+
+        out += boneErrors[b].getReal();
+        for(j = 0; j < 4; ++j) for(k = 0; k < 3; ++k)
+            gradient[joints[j]][k] += boneErrors[b].getDeriv(j * 3 + k);
+    }
+
+    return out;
+}
+
+//fine error as a function of all the joint coordinates, for the Optimizer
+class FineObjective : public Objective
+{
+public:
+    FineObjective(RP *inRp) : rp(inRp) {}
+
+    double evaluate(const vector<double> &x) { return computeFineError(toEmbedding(x), rp); }
+
+    double gradient(const vector<double> &x, vector<double> &gradient)
+    {
+        vector<Pinocchio::Vector3> embGradient;
+        double out = computeFineGradient(toEmbedding(x), rp, embGradient);
+        gradient.resize(x.size());
+        for(int i = 0; i < (int)x.size(); ++i)
+            gradient[i] = embGradient[i / 3][i % 3];
+        return out;
+    }
+
+    static vector<Pinocchio::Vector3> toEmbedding(const vector<double> &x)
+    {
+        vector<Pinocchio::Vector3> out(x.size() / 3);
+        for(int i = 0; i < (int)out.size(); ++i)
+            out[i] = Pinocchio::Vector3(x[i * 3], x[i * 3 + 1], x[i * 3 + 2]);
+        return out;
+    }
+
+    static vector<double> fromEmbedding(const vector<Pinocchio::Vector3> &embedding)
+    {
+        vector<double> out(embedding.size() * 3);
+        for(int i = 0; i < (int)out.size(); ++i)
+            out[i] = embedding[i / 3][i % 3];
+        return out;
+    }
+
+private:
+    RP *rp;
+};
+
+//moves the embedding along dir with steps that double as long as the error (of bones, if given) decreases
+static vector<Pinocchio::Vector3> optimizeEmbedding1D(vector<Pinocchio::Vector3> fineEmbedding, const vector<Pinocchio::Vector3> &dir, RP *rp,
+                                                      const vector<int> *bones = NULL)
 {
     int i;
     double step = 0.001;
-    
+
     for(i = 0; i < (int)fineEmbedding.size(); ++i) {
         step += dir[i].lengthsq();
     }
-    
+
     step = 0.0005 / sqrt(step);
-    
+
     double prevErr = -1e10;
     int count = 0;
     while(++count) {
-        double curErr = computeFineError(fineEmbedding, rp);
+        double curErr = computeFineError(fineEmbedding, rp, bones);
         if(prevErr == -1e10 || curErr < prevErr) {
             step *= 2.;
             for(i = 0; i < (int)fineEmbedding.size(); ++i) {
@@ -126,90 +302,111 @@ vector<Pinocchio::Vector3> optimizeEmbedding1D(vector<Pinocchio::Vector3> fineEm
             break;
         }
     }
-    
+
     return fineEmbedding;
 }
 
+//one round of the original refinement: two steps down the gradient, then the two joints of every bone in
+//turn.  The error has jumps (e.g., a bone turning past perpendicular to the skeleton multiplies its angle
+//penalty by 10), and the optimizer stalls where every step along the full gradient crosses one.  These short
+//steps of a few joints at a time, which may also go uphill a little, usually get past it.
+static void refinementRound(vector<Pinocchio::Vector3> &fineEmbedding, RP *rp)
+{
+    int j, cur;
+    int sz = fineEmbedding.size();
+    vector<Pinocchio::Vector3> gradient, dir(sz);
+
+    for(j = 0; j < 2; ++j) {
+        computeFineGradient(fineEmbedding, rp, gradient);
+        for(cur = 0; cur < sz; ++cur)
+            dir[cur] = -gradient[cur];
+        fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, rp);
+    }
+
+    for(cur = 1; cur < sz; ++cur) { //only the bones that depend on the two joints matter for these steps
+        int prev = rp->given.fPrev()[cur];
+        vector<int> joints(1, cur);
+        joints.push_back(prev);
+        vector<int> bones = bonesOfJoints(joints, rp);
+        computeFineGradient(fineEmbedding, rp, gradient, &bones);
+
+        dir.assign(sz, Pinocchio::Vector3());
+        dir[cur] = -gradient[cur];
+        dir[prev] = -gradient[prev];
+        fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, rp, &bones);
+    }
+}
 
+static const int maxRefinementRounds = 10;
+static const double refinementRoundTol = 1e-3; //a round must lower the error by this fraction to continue
 
 //refines embedding
 vector<Pinocchio::Vector3> refineEmbedding(TreeType *distanceField, const vector<Pinocchio::Vector3> &medialSurface,
-                                const vector<Pinocchio::Vector3> &initialEmbedding, const Skeleton &skeleton)
+                                const vector<Pinocchio::Vector3> &initialEmbedding, const Skeleton &skeleton,
+                                Optimizer *optimizer)
 {
     RP rp(distanceField, skeleton, medialSurface);
 
-    int sz = initialEmbedding.size();
-    vector<Pinocchio::Vector3> fineEmbedding = initialEmbedding;
-    int i, k;
-    for(k = 0; k < 10; ++k) {
-        typedef Deriv<double, 6> DType;
-        typedef Deriv<double, -1> DType1;
-        
-        Debugging::out() << "E = " << computeFineError(fineEmbedding, &rp) << endl;
-        
-        for(int j = 0; j < 2; ++j) {
-            vector<Vector<DType1, 3> > dMatch(sz);
-            for(i = 0; i < sz; ++i) {
-                dMatch[i][0] = DType1(fineEmbedding[i][0], i * 3);
-                dMatch[i][1] = DType1(fineEmbedding[i][1], i * 3 + 1);
-                dMatch[i][2] = DType1(fineEmbedding[i][2], i * 3 + 2);
-            }
+    LBFGSOptimizer defaultOptimizer;
+    if(optimizer == NULL)
+        optimizer = &defaultOptimizer;
 
-            DType1 err = computeFineError(dMatch, &rp) + (DType1() * DType1(0., 3 * sz));
-            vector<Pinocchio::Vector3> dir(sz);
-        
-            for(i = 0; i < sz; ++i) {
-                dir[i][0] = -err.getDeriv(i * 3);
-                dir[i][1] = -err.getDeriv(i * 3 + 1);
-                dir[i][2] = -err.getDeriv(i * 3 + 2);
-            }
-            fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
-        }
-        
-        int cur;
-        for(cur = 1; cur < sz; ++cur) {
-            int prev = skeleton.fPrev()[cur];
-            
-            vector<Vector<DType, 3> > dMatch(sz);
-            for(i = 0; i < sz; ++i) {
-                dMatch[i][0] = DType(fineEmbedding[i][0]);
-                dMatch[i][1] = DType(fineEmbedding[i][1]);
-                dMatch[i][2] = DType(fineEmbedding[i][2]);
-                
-                int varNum = -1;
-                if(i == cur)
-                    varNum = 0;
-                else if(i == prev)
-                    varNum = 3;
-                
-                if(varNum >= 0) {
-                    dMatch[i][0] *= DType(1, varNum + 0);
-                    dMatch[i][1] *= DType(1, varNum + 1);
-                    dMatch[i][2] *= DType(1, varNum + 2);
-                }
-            }
-            
-            DType err = computeFineError(dMatch, &rp);
-            
-            vector<Pinocchio::Vector3> dir(sz);
-        
-            for(i = 0; i < sz; ++i) {
-                int varNum = -1;
-                if(i == cur)
-                    varNum = 0;
-                else if(i == prev)
-                    varNum = 3;
-                
-                if(varNum >= 0) {
-                    dir[i][0] = -err.getDeriv(varNum);
-                    dir[i][1] = -err.getDeriv(varNum + 1);
-                    dir[i][2] = -err.getDeriv(varNum + 2);
-                }
-            }
-            fineEmbedding = optimizeEmbedding1D(fineEmbedding, dir, &rp);
+    FineObjective objective(&rp);
+    vector<double> x = FineObjective::fromEmbedding(initialEmbedding);
+    double value = optimizer->minimize(objective, x);
+    double initialValue = optimizer->getStats().initialValue;
+    int iterations = optimizer->getStats().iterations, evaluations = optimizer->getStats().evaluations;
+    int gradients = optimizer->getStats().gradients;
+
+    //if the optimizer stalls (at a jump in the error), a round of the original refinement gets it going again.
+    //The round itself may go uphill a little, so it is judged after the optimizer has run from where it ends.
+    int round = 0;
+    while(round < maxRefinementRounds && !optimizer->getStats().converged) {
+        ++round;
+        vector<Pinocchio::Vector3> fineEmbedding = FineObjective::toEmbedding(x);
+        refinementRound(fineEmbedding, &rp);
+
+        vector<double> roundX = FineObjective::fromEmbedding(fineEmbedding);
+        double roundValue = optimizer->minimize(objective, roundX);
+        iterations += optimizer->getStats().iterations;
+        evaluations += optimizer->getStats().evaluations;
+        gradients += optimizer->getStats().gradients;
+
+        bool enough = roundValue < value * (1. - refinementRoundTol);
+        if(roundValue < value) {
+            x = roundX;
+            value = roundValue;
         }
+        if(!enough)
+            break;
     }
-    
-    return fineEmbedding;
+
+    Debugging::out() << "E = " << initialValue << " -> " << value << ", " << iterations << " optimizer iterations with "
+                     << evaluations << " evaluations and " << gradients << " gradients, " << round << " refinement rounds" << endl;
+
+    return FineObjective::toEmbedding(x);
 }
 
+vector<Pinocchio::Vector3> symmetrizeEmbedding(const vector<Pinocchio::Vector3> &embedding, const Skeleton &skeleton)
+{
+    int i;
+    vector<Pinocchio::Vector3> out = embedding;
+    vector<int> sym(embedding.size(), -1); //fSym only points one way
+    for(i = 0; i < (int)embedding.size(); ++i) {
+        if(skeleton.fSym()[i] >= 0) {
+            sym[i] = skeleton.fSym()[i];
+            sym[skeleton.fSym()[i]] = i;
+        }
+    }
+
+    for(i = 0; i < (int)embedding.size(); ++i) {
+        if(sym[i] < 0) {
+            out[i][0] = 0.5;
+            continue;
+        }
+        Pinocchio::Vector3 other = embedding[sym[i]];
+        other[0] = 1. - other[0];
+        out[i] = (embedding[i] + other) * 0.5;
+    }
+    return out;
+}
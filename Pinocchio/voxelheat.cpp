@@ -0,0 +1,518 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#include "voxelheat.h"
+#include "vecutils.h"
+#include "lsqSolver.h"
+#include "debugging.h"
+#include "parallel.h"
+#include <chrono>
+#include <queue>
+
+//the six neighbors of a voxel--direction d ^ 1 is opposite to d
+static const int voxelDirs[6][3] = { { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 } };
+
+static const int coarsestVoxelLevel = 1000; //the multigrid stops coarsening at this many cells and factors
+
+//one level of the multigrid hierarchy: a weighted graph Laplacian plus a mass term on cells with up to
+//six neighbors.  The finest level is the voxels and every coarser one merges 2x2x2 blocks of cells.
+//The coarse operators are Galerkin (restriction by summing, prolongation by injection), which just
+//adds up the couplings between blocks and their masses, so they stay symmetric positive definite.
+struct VoxelLevel
+{
+    int size() const { return mass.size(); }
+
+    int res; //cells per side of the grid of this level
+    vector<int> coord; //3 per cell
+    vector<int> nbr; //6 per cell, -1 if none
+    vector<double> weight; //6 per cell, coupling to the neighbor
+    vector<double> mass, diag; //diag is the mass plus the couplings
+    vector<int> parent; //cell on the next coarser level
+};
+
+class VoxelMultigrid
+{
+public:
+    VoxelMultigrid(const VoxelLevel &finest);
+    ~VoxelMultigrid() { delete coarsest; }
+
+    int numLevels() const { return levels.size(); }
+
+    //solves in place by conjugate gradients preconditioned with one V-cycle--returns the number of
+    //iterations, -1 on failure
+    int solve(vector<double> &b) const;
+
+private:
+    VoxelMultigrid(const VoxelMultigrid &);
+
+    void multiply(const VoxelLevel &l, const vector<double> &x, vector<double> &out) const;
+    void smooth(const VoxelLevel &l, const vector<double> &b, vector<double> &x, bool forward) const;
+    void vcycle(int level, const vector<double> &b, vector<double> &x) const; //x must be zero
+
+    vector<VoxelLevel> levels;
+    LLTMatrix *coarsest;
+};
+
+VoxelMultigrid::VoxelMultigrid(const VoxelLevel &finest) : levels(1, finest), coarsest(NULL)
+{
+    int i, d;
+    while(levels.back().size() > coarsestVoxelLevel && levels.back().res > 1) {
+        VoxelLevel &fine = levels.back();
+        VoxelLevel coarse;
+        coarse.res = (fine.res + 1) / 2;
+
+        vector<int> grid(coarse.res * coarse.res * coarse.res, -1);
+        fine.parent.resize(fine.size());
+        for(i = 0; i < fine.size(); ++i) {
+            int x = fine.coord[3 * i] / 2, y = fine.coord[3 * i + 1] / 2, z = fine.coord[3 * i + 2] / 2;
+            int &idx = grid[(z * coarse.res + y) * coarse.res + x];
+            if(idx < 0) {
+                idx = coarse.size();
+                coarse.coord.push_back(x);
+                coarse.coord.push_back(y);
+                coarse.coord.push_back(z);
+                coarse.mass.push_back(0.);
+            }
+            fine.parent[i] = idx;
+            coarse.mass[idx] += fine.mass[i];
+        }
+
+        coarse.nbr.assign(6 * coarse.size(), -1);
+        coarse.weight.assign(6 * coarse.size(), 0.);
+        for(i = 0; i < fine.size(); ++i) for(d = 0; d < 6; ++d) {
+            int n = fine.nbr[6 * i + d];
+            if(n < 0 || fine.parent[n] == fine.parent[i])
+                continue; //couplings inside a block cancel out
+            coarse.nbr[6 * fine.parent[i] + d] = fine.parent[n];
+            coarse.weight[6 * fine.parent[i] + d] += fine.weight[6 * i + d];
+        }
+
+        coarse.diag = coarse.mass;
+        for(i = 0; i < coarse.size(); ++i)
+            for(d = 0; d < 6; ++d)
+                coarse.diag[i] += coarse.weight[6 * i + d];
+
+        levels.push_back(coarse);
+    }
+
+    //the coarsest level is solved directly
+    const VoxelLevel &last = levels.back();
+    vector<vector<pair<int, double> > > rows(last.size());
+    for(i = 0; i < last.size(); ++i) {
+        for(d = 0; d < 6; ++d)
+            if(last.nbr[6 * i + d] >= 0 && last.nbr[6 * i + d] < i)
+                rows[i].push_back(make_pair(last.nbr[6 * i + d], -last.weight[6 * i + d]));
+        sort(rows[i].begin(), rows[i].end());
+        rows[i].push_back(make_pair(i, last.diag[i]));
+    }
+    coarsest = SPDMatrix(rows).factor();
+}
+
+void VoxelMultigrid::multiply(const VoxelLevel &l, const vector<double> &x, vector<double> &out) const
+{
+    int i, d;
+    out.resize(l.size());
+    for(i = 0; i < l.size(); ++i) {
+        double sum = l.diag[i] * x[i];
+        for(d = 0; d < 6; ++d)
+            if(l.nbr[6 * i + d] >= 0)
+                sum -= l.weight[6 * i + d] * x[l.nbr[6 * i + d]];
+        out[i] = sum;
+    }
+}
+
+//one Gauss-Seidel sweep--a forward one before the coarse correction and a backward one after
+//keep the V-cycle symmetric, as conjugate gradients needs
+void VoxelMultigrid::smooth(const VoxelLevel &l, const vector<double> &b, vector<double> &x, bool forward) const
+{
+    int k, d;
+    for(k = 0; k < l.size(); ++k) {
+        int i = forward ? k : l.size() - 1 - k;
+        double sum = b[i];
+        for(d = 0; d < 6; ++d)
+            if(l.nbr[6 * i + d] >= 0)
+                sum += l.weight[6 * i + d] * x[l.nbr[6 * i + d]];
+        x[i] = sum / l.diag[i];
+    }
+}
+
+void VoxelMultigrid::vcycle(int level, const vector<double> &b, vector<double> &x) const
+{
+    int i;
+    if(level + 1 == (int)levels.size()) {
+        x = b;
+        coarsest->solve(x);
+        return;
+    }
+
+    const VoxelLevel &l = levels[level];
+    smooth(l, b, x, true);
+
+    vector<double> r, coarseB(levels[level + 1].size(), 0.), coarseX(levels[level + 1].size(), 0.);
+    multiply(l, x, r);
+    for(i = 0; i < l.size(); ++i)
+        coarseB[l.parent[i]] += b[i] - r[i];
+    vcycle(level + 1, coarseB, coarseX);
+    for(i = 0; i < l.size(); ++i)
+        x[i] += coarseX[l.parent[i]];
+
+    smooth(l, b, x, false);
+}
+
+static double dot(const vector<double> &a, const vector<double> &b)
+{
+    double out = 0.;
+    for(int i = 0; i < (int)a.size(); ++i)
+        out += a[i] * b[i];
+    return out;
+}
+
+int VoxelMultigrid::solve(vector<double> &b) const
+{
+    int i, iter;
+    int n = levels[0].size();
+    if(coarsest == NULL)
+        return -1;
+
+    double bNorm = sqrt(dot(b, b));
+    vector<double> x(n, 0.), r = b, z(n, 0.), p, Ap;
+    if(bNorm == 0.) {
+        b.swap(x);
+        return 0;
+    }
+
+    vcycle(0, r, z);
+    p = z;
+    double rz = dot(r, z);
+    for(iter = 1; iter <= maxSolverIterations; ++iter) {
+        multiply(levels[0], p, Ap);
+        double alpha = rz / dot(p, Ap);
+        for(i = 0; i < n; ++i) {
+            x[i] += alpha * p[i];
+            r[i] -= alpha * Ap[i];
+        }
+        if(sqrt(dot(r, r)) <= defaultSolverTolerance * bNorm)
+            break;
+
+        z.assign(n, 0.);
+        vcycle(0, r, z);
+        double rzNew = dot(r, z);
+        for(i = 0; i < n; ++i)
+            p[i] = z[i] + (rzNew / rz) * p[i];
+        rz = rzNew;
+    }
+
+    b.swap(x);
+    return iter;
+}
+
+//voxelizes the unit cube at resolution res into the finest level: the voxels inside the mesh or holding
+//a vertex that the propagation from the bones reaches.  Every one of them is heated by the closest bone
+//that reached it (bone[i]), with the heat equation -Lw+Hw=HI scaled by the squared voxel size.
+//index maps grid cells to the level (-1 outside the domain).
+static VoxelLevel voxelHeatEquation(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                                    TreeType *distanceField, int res, double initialHeatWeight,
+                                    vector<int> &index, vector<int> &bone)
+{
+    int i, j, d;
+    int cells = res * res * res;
+    int bones = skeleton.fGraph().verts.size() - 1;
+    double h = 1. / res;
+
+    auto center = [&](int c) {
+        return Pinocchio::Vector3((c % res + .5) * h, (c / res % res + .5) * h, (c / (res * res) + .5) * h);
+    };
+    auto cellOf = [&](const Pinocchio::Vector3 &p) {
+        int out = 0;
+        for(int k = 2; k >= 0; --k)
+            out = out * res + max(0, min(res - 1, (int)floor(p[k] * res)));
+        return out;
+    };
+
+    //blocks of voxels far enough from the surface are inside or outside as a whole, so the distance
+    //field is only evaluated at every voxel near the surface
+    const int block = 4;
+    int blocks = (res + block - 1) / block;
+    vector<char> active(cells, 0);
+    parallelFor(0, blocks * blocks * blocks, [&](int b) {
+        int lo[3], hi[3], k;
+        for(k = 0; k < 3; ++k) {
+            lo[k] = (k == 0 ? b % blocks : k == 1 ? b / blocks % blocks : b / (blocks * blocks)) * block;
+            hi[k] = min(res, lo[k] + block);
+        }
+        Pinocchio::Vector3 mid(.5 * (lo[0] + hi[0]) * h, .5 * (lo[1] + hi[1]) * h, .5 * (lo[2] + hi[2]) * h);
+        double midDist = distanceField->locate(mid)->evaluate(mid);
+        bool whole = fabs(midDist) > block * h; //more than half the block diagonal
+        for(int z = lo[2]; z < hi[2]; ++z) for(int y = lo[1]; y < hi[1]; ++y) for(int x = lo[0]; x < hi[0]; ++x) {
+            int c = (z * res + y) * res + x;
+            if(whole)
+                active[c] = midDist < 0.;
+            else {
+                Pinocchio::Vector3 p = center(c);
+                active[c] = distanceField->locate(p)->evaluate(p) < 0.;
+            }
+        }
+    });
+    for(i = 0; i < (int)mesh.vertices.size(); ++i)
+        active[cellOf(mesh.vertices[i].pos)] = 1;
+
+    //propagate the closest bone from the voxels each bone passes through (Dijkstra with the
+    //distance to the bone segment, which is the straight distance as long as the voxels in
+    //between are in the domain)
+    vector<double> dist(cells, 1e37);
+    vector<int> cellBone(cells, -1);
+    priority_queue<pair<double, int>, vector<pair<double, int> >, greater<pair<double, int> > > todo;
+    for(j = 0; j < bones; ++j) {
+        const Pinocchio::Vector3 &v1 = match[j + 1], &v2 = match[skeleton.fPrev()[j + 1]];
+        int steps = 1 + (int)((v2 - v1).length() * 4. * res);
+        bool seeded = false;
+        for(i = 0; i <= steps; ++i) {
+            int c = cellOf(v1 + (v2 - v1) * (double(i) / steps));
+            double cDist = sqrt(distsqToSeg(center(c), v1, v2));
+            if(!active[c] || cDist >= dist[c])
+                continue;
+            dist[c] = cDist;
+            cellBone[c] = j;
+            todo.push(make_pair(cDist, c));
+            seeded = true;
+        }
+        if(seeded)
+            continue;
+
+        //the bone is outside the mesh: start from the closest voxel instead
+        int closest = -1;
+        double minDist = 1e37;
+        for(i = 0; i < cells; ++i) {
+            if(!active[i])
+                continue;
+            double cDist = distsqToSeg(center(i), v1, v2);
+            if(cDist < minDist) {
+                minDist = cDist;
+                closest = i;
+            }
+        }
+        if(closest >= 0 && sqrt(minDist) < dist[closest]) {
+            dist[closest] = sqrt(minDist);
+            cellBone[closest] = j;
+            todo.push(make_pair(dist[closest], closest));
+        }
+    }
+    while(!todo.empty()) {
+        pair<double, int> cur = todo.top();
+        todo.pop();
+        int c = cur.second;
+        if(cur.first > dist[c])
+            continue; //reached by a closer bone since
+        int x = c % res, y = c / res % res, z = c / (res * res);
+        const Pinocchio::Vector3 &v1 = match[cellBone[c] + 1], &v2 = match[skeleton.fPrev()[cellBone[c] + 1]];
+        for(d = 0; d < 6; ++d) {
+            int nx = x + voxelDirs[d][0], ny = y + voxelDirs[d][1], nz = z + voxelDirs[d][2];
+            if(nx < 0 || ny < 0 || nz < 0 || nx >= res || ny >= res || nz >= res)
+                continue;
+            int n = (nz * res + ny) * res + nx;
+            if(!active[n])
+                continue;
+            double nDist = sqrt(distsqToSeg(center(n), v1, v2));
+            if(nDist >= dist[n])
+                continue;
+            dist[n] = nDist;
+            cellBone[n] = cellBone[c];
+            todo.push(make_pair(nDist, n));
+        }
+    }
+
+    //voxels no bone reaches have no heat, so they are left out (with them the system would be singular)
+    VoxelLevel out;
+    out.res = res;
+    index.assign(cells, -1);
+    bone.clear();
+    for(i = 0; i < cells; ++i) {
+        if(cellBone[i] < 0)
+            continue;
+        index[i] = out.size();
+        out.coord.push_back(i % res);
+        out.coord.push_back(i / res % res);
+        out.coord.push_back(i / (res * res));
+        out.mass.push_back(h * h * initialHeatWeight / SQR(max(dist[i], .5 * h)));
+        bone.push_back(cellBone[i]);
+    }
+
+    out.nbr.assign(6 * out.size(), -1);
+    out.weight.assign(6 * out.size(), 0.);
+    out.diag = out.mass;
+    for(i = 0; i < out.size(); ++i) {
+        for(d = 0; d < 6; ++d) {
+            int nx = out.coord[3 * i] + voxelDirs[d][0], ny = out.coord[3 * i + 1] + voxelDirs[d][1];
+            int nz = out.coord[3 * i + 2] + voxelDirs[d][2];
+            if(nx < 0 || ny < 0 || nz < 0 || nx >= res || ny >= res || nz >= res)
+                continue;
+            int n = index[(nz * res + ny) * res + nx];
+            if(n < 0)
+                continue;
+            out.nbr[6 * i + d] = n;
+            out.weight[6 * i + d] = 1.;
+            out.diag[i] += 1.;
+        }
+    }
+
+    return out;
+}
+
+//boneWeights[j][i] is the (unnormalized) weight of bone j at vertex i
+static void voxelHeatWeights(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                             TreeType *distanceField, int res, double initialHeatWeight,
+                             vector<vector<double> > &boneWeights, int *voxels = NULL, int *iterations = NULL)
+{
+    int i, j, k;
+    int nv = mesh.vertices.size();
+    int bones = skeleton.fGraph().verts.size() - 1;
+
+    vector<int> index, bone;
+    VoxelLevel finest = voxelHeatEquation(mesh, skeleton, match, distanceField, res, initialHeatWeight, index, bone);
+    VoxelMultigrid multigrid(finest);
+
+    //trilinear interpolation between the centers of the voxels around every vertex that are in the domain
+    vector<vector<pair<int, double> > > samples(nv);
+    for(i = 0; i < nv; ++i) {
+        Pinocchio::Vector3 g = mesh.vertices[i].pos * res - Pinocchio::Vector3(.5, .5, .5);
+        int base[3];
+        double frac[3], sum = 0.;
+        for(k = 0; k < 3; ++k) {
+            base[k] = (int)floor(g[k]);
+            frac[k] = g[k] - base[k];
+        }
+        for(k = 0; k < 8; ++k) {
+            int c[3];
+            double w = 1.;
+            for(j = 0; j < 3; ++j) {
+                int bit = (k >> j) & 1;
+                c[j] = base[j] + bit;
+                w *= bit ? frac[j] : 1. - frac[j];
+            }
+            if(c[0] < 0 || c[1] < 0 || c[2] < 0 || c[0] >= res || c[1] >= res || c[2] >= res)
+                continue;
+            int idx = index[(c[2] * res + c[1]) * res + c[0]];
+            if(idx < 0 || w <= 0.)
+                continue;
+            samples[i].push_back(make_pair(idx, w));
+            sum += w;
+        }
+        for(k = 0; k < (int)samples[i].size(); ++k)
+            samples[i][k].second /= sum;
+    }
+
+    boneWeights.assign(bones, vector<double>(nv, 0.));
+    vector<int> boneIterations(bones, 0);
+    parallelFor(0, bones, [&](int j) {
+        vector<double> x(finest.size(), 0.);
+        for(int i = 0; i < (int)x.size(); ++i)
+            if(bone[i] == j)
+                x[i] = finest.mass[i];
+        boneIterations[j] = multigrid.solve(x);
+        for(int i = 0; i < nv; ++i)
+            for(int k = 0; k < (int)samples[i].size(); ++k)
+                boneWeights[j][i] += samples[i][k].second * x[samples[i][k].first];
+    });
+
+    //vertices with no voxel of the domain around them go to the closest bone
+    int lost = 0;
+    for(i = 0; i < nv; ++i) {
+        if(!samples[i].empty())
+            continue;
+        ++lost;
+        int closest = 0;
+        double minDist = 1e37;
+        for(j = 0; j < bones; ++j) {
+            double cur = distsqToSeg(mesh.vertices[i].pos, match[j + 1], match[skeleton.fPrev()[j + 1]]);
+            if(cur < minDist) {
+                minDist = cur;
+                closest = j;
+            }
+        }
+        boneWeights[closest][i] = 1.;
+    }
+
+    int maxIterations = 0;
+    for(j = 0; j < bones; ++j) {
+        if(boneIterations[j] < 0)
+            Debugging::out() << "Voxel heat solve failed for bone " << j << endl;
+        maxIterations = max(maxIterations, boneIterations[j]);
+    }
+    Debugging::out() << "Voxel heat: " << finest.size() << " voxels, " << multigrid.numLevels() << " levels, "
+                     << maxIterations << " iterations, " << lost << " vertices outside" << endl;
+    if(voxels)
+        *voxels = finest.size();
+    if(iterations)
+        *iterations = maxIterations;
+}
+
+Attachment *voxelHeatAttachment(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                                TreeType *distanceField, int resolution, double initialHeatWeight)
+{
+    vector<vector<double> > boneWeights;
+    voxelHeatWeights(mesh, skeleton, match, distanceField, resolution, initialHeatWeight, boneWeights);
+    return new Attachment(boneWeights);
+}
+
+static double secondsSince(const chrono::steady_clock::time_point &start)
+{
+    return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+}
+
+VoxelHeatComparison compareVoxelHeat(const Mesh &mesh, const Skeleton &skeleton, const vector<Pinocchio::Vector3> &match,
+                                     TreeType *distanceField, int resolution, double initialHeatWeight)
+{
+    int i, j;
+    VoxelHeatComparison out;
+    int nv = mesh.vertices.size();
+    int bones = skeleton.fGraph().verts.size() - 1;
+
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    VisTester<TreeType> tester(distanceField);
+    Attachment meshAttachment(mesh, skeleton, match, &tester, initialHeatWeight);
+    out.meshTime = secondsSince(start);
+
+    start = chrono::steady_clock::now();
+    vector<vector<double> > boneWeights;
+    voxelHeatWeights(mesh, skeleton, match, distanceField, resolution, initialHeatWeight, boneWeights,
+                     &out.voxels, &out.iterations);
+    Attachment voxelAttachment(boneWeights);
+    out.voxelTime = secondsSince(start);
+
+    int same = 0;
+    for(i = 0; i < nv; ++i) {
+        Vector<double, -1> w1 = meshAttachment.getWeights(i), w2 = voxelAttachment.getWeights(i);
+        int best1 = 0, best2 = 0;
+        for(j = 0; j < bones; ++j) {
+            double diff = fabs(w1[j] - w2[j]);
+            out.maxDifference = max(out.maxDifference, diff);
+            out.meanDifference += diff;
+            if(w1[j] > w1[best1])
+                best1 = j;
+            if(w2[j] > w2[best2])
+                best2 = j;
+        }
+        if(best1 == best2)
+            ++same;
+    }
+    if(nv > 0 && bones > 0) {
+        out.meanDifference /= double(nv) * bones;
+        out.sameDominantBone = double(same) / nv;
+    }
+    return out;
+}
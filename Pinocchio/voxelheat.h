@@ -0,0 +1,56 @@
+/*  This file is part of the Pinocchio automatic rigging library.
+    Copyright (C) 2007 Ilya Baran (ibaran@mit.edu)
+
+    This library is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    This library is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with this library; if not, write to the Free Software
+    Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+
+#ifndef VOXELHEAT_H
+#define VOXELHEAT_H
+
+#include "pinocchioApi.h"
+
+//bone weights from heat diffusion through the volume of the mesh instead of over its surface.
+//The unit cube is voxelized from the distance field (voxels inside plus those holding a vertex),
+//every voxel is heated by the bone closest to it through the volume, the heat equation is solved
+//by multigrid preconditioned conjugate gradients and the weights are interpolated back to the
+//vertices.  It does not look at the triangles, so it works on huge or messy meshes (degenerate
+//triangles, several components) as long as the distance field is reasonable.
+//User responsible for deleting the output.
+Attachment PINOCCHIO_API *voxelHeatAttachment(const Mesh &mesh, const Skeleton &skeleton,
+                                              const vector<Pinocchio::Vector3> &match, TreeType *distanceField,
+                                              int resolution = defaultVoxelHeatResolution,
+                                              double initialHeatWeight = 1.);
+
+struct VoxelHeatComparison
+{
+    VoxelHeatComparison() : meshTime(0.), voxelTime(0.), voxels(0), iterations(0),
+                            maxDifference(0.), meanDifference(0.), sameDominantBone(0.) {}
+
+    double meshTime; //seconds for the mesh Laplacian attachment
+    double voxelTime; //seconds for the voxel attachment
+    int voxels; //in the voxel domain
+    int iterations; //most conjugate gradient iterations any bone took
+    double maxDifference; //largest difference of a vertex weight
+    double meanDifference; //over all the vertices and bones
+    double sameDominantBone; //fraction of the vertices whose largest weight is on the same bone
+};
+
+//computes the mesh Laplacian and the voxel attachments of the same embedding and compares their weights
+VoxelHeatComparison PINOCCHIO_API compareVoxelHeat(const Mesh &mesh, const Skeleton &skeleton,
+                                                   const vector<Pinocchio::Vector3> &match, TreeType *distanceField,
+                                                   int resolution = defaultVoxelHeatResolution,
+                                                   double initialHeatWeight = 1.);
+
+#endif //VOXELHEAT_H